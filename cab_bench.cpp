@@ -0,0 +1,1895 @@
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+#include "cab_fs.hpp"
+#include "cab_copy.hpp"
+#include "cab_format.hpp"
+#include "cab_dir.hpp"
+#include "cab_import.hpp"
+#include "cab_stat.hpp"
+#include "cab_cache.hpp"
+#include "cabd.hpp"
+#include "cab_client.hpp"
+#include "cab_extract.hpp"
+#include "cab_range.hpp"
+
+// synthetic bitmap for an image of total_blocks blocks, with allocated and free runs
+// alternating so that roughly fill_ratio of the usable blocks end up allocated
+BitMap makeFragmentedBitMap(size_t total_blocks, double fill_ratio, size_t mean_run, std::mt19937_64 &rng, size_t block_size = MIN_BLOCK_SIZE)
+{
+    boot_record b_record = makeBootRecord(total_blocks * block_size, block_size);
+
+    BitMap bmap(b_record);
+    bmap.format();
+
+    std::geometric_distribution<size_t> used_run(1.0 / (mean_run * fill_ratio / (1 - fill_ratio) + 1));
+    std::geometric_distribution<size_t> free_run(1.0 / (mean_run + 1));
+    size_t block = 1 + b_record.bitmap_size_in_blocks + rootDirBlocks(b_record);
+    bmap.writeBits(0, block, 1);
+    while (block < total_blocks)
+    {
+        block += free_run(rng) + 1;
+        size_t used = std::min(used_run(rng) + 1, total_blocks - std::min(block, total_blocks));
+        bmap.writeBits(block, used, 1);
+        block += used;
+    }
+    return bmap;
+}
+
+// checks getFirstBlock against getFirstBlockScalar and times both on the same requests
+int benchFirstBlock(size_t total_blocks, size_t iterations)
+{
+    std::mt19937_64 rng(42);
+    const size_t request_sizes[] = {1, 8, 64, 512, 4096};
+
+    for (double fill_ratio : {0.5, 0.9, 0.99})
+    {
+        BitMap bmap = makeFragmentedBitMap(total_blocks, fill_ratio, 16, rng);
+
+        // differential check over random request sizes first
+        std::uniform_int_distribution<size_t> random_size(1, 8192);
+        for (size_t i = 0; i < 200; i++)
+        {
+            size_t block_amount = random_size(rng);
+            size_t scalar = bmap.getFirstBlockScalar(block_amount);
+            size_t word = bmap.getFirstBlock(block_amount);
+            if (scalar != word)
+            {
+                std::cout << "MISMATCH blocks=" << block_amount << " scalar=" << scalar << " word=" << word << std::endl;
+                return 1;
+            }
+        }
+
+        for (size_t block_amount : request_sizes)
+        {
+            size_t result = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; i++)
+                result += bmap.getFirstBlockScalar(block_amount);
+            double scalar_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+            start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; i++)
+                result -= bmap.getFirstBlock(block_amount);
+            double word_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+            std::cout << "first-block fill=" << fill_ratio << " blocks=" << block_amount
+                      << " scalar_ns=" << scalar_ns << " word_ns=" << word_ns
+                      << " speedup=" << scalar_ns / word_ns << (result ? " (results differ)" : "") << std::endl;
+        }
+    }
+    return 0;
+}
+
+// allocate/free churn against one allocation call; returns mean nanoseconds per operation
+template <typename Allocate>
+double runChurn(BitMap &bmap, size_t operations, size_t mean_file_blocks, Allocate allocate, size_t &failed)
+{
+    std::mt19937_64 rng(7);
+    std::geometric_distribution<size_t> file_blocks(1.0 / mean_file_blocks);
+    std::vector<std::pair<size_t, size_t>> live;
+    failed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < operations; i++)
+    {
+        if (!live.empty() && rng() % 2)
+        {
+            size_t victim = rng() % live.size();
+            bmap.writeBits(live[victim].first, live[victim].second, 0);
+            live[victim] = live.back();
+            live.pop_back();
+            continue;
+        }
+        size_t block_amount = file_blocks(rng) + 1;
+        size_t first_block = allocate(block_amount);
+        if (first_block == OUT_OF_FREE_SPACE)
+        {
+            failed++;
+            continue;
+        }
+        bmap.writeBits(first_block, block_amount, 1);
+        live.push_back({first_block, block_amount});
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / operations;
+}
+
+// compares the free-extent index against a bitmap scan on fragmented images
+int benchExtentIndex(size_t total_blocks, size_t operations)
+{
+    std::mt19937_64 rng(42);
+
+    for (double fill_ratio : {0.5, 0.9, 0.99})
+    {
+        BitMap scanned = makeFragmentedBitMap(total_blocks, fill_ratio, 16, rng);
+        BitMap indexed = scanned;
+
+        auto start = std::chrono::steady_clock::now();
+        indexed.buildExtentIndex();
+        double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::uniform_int_distribution<size_t> random_size(1, 8192);
+        for (size_t i = 0; i < 200; i++)
+        {
+            size_t block_amount = random_size(rng);
+            if (scanned.getFirstBlock(block_amount) != indexed.getFirstBlock(block_amount))
+            {
+                std::cout << "MISMATCH first-fit blocks=" << block_amount << std::endl;
+                return 1;
+            }
+        }
+
+        for (size_t mean_file_blocks : {16, 1024})
+        {
+            BitMap churn_scanned = scanned;
+            BitMap churn_indexed = indexed;
+            size_t scan_failed, best_failed;
+            double scan_ns = runChurn(churn_scanned, operations, mean_file_blocks, [&](size_t n) { return churn_scanned.getFirstBlock(n); }, scan_failed);
+            double best_ns = runChurn(churn_indexed, operations, mean_file_blocks, [&](size_t n) { return churn_indexed.getBestFitBlock(n); }, best_failed);
+
+            // the index must still describe exactly the bits writeBits left behind
+            BitMap rebuilt = churn_indexed;
+            rebuilt.buildExtentIndex();
+            if (rebuilt.getExtentIndex().extentsByAddress() != churn_indexed.getExtentIndex().extentsByAddress())
+            {
+                std::cout << "MISMATCH index out of sync with the bitmap" << std::endl;
+                return 1;
+            }
+
+            std::cout << "extent-index fill=" << fill_ratio << " mean_file_blocks=" << mean_file_blocks
+                      << " extents=" << indexed.getExtentIndex().extentCount() << " build_ms=" << build_ms
+                      << " scan_first_fit_ns=" << scan_ns << " index_best_fit_ns=" << best_ns << " speedup=" << scan_ns / best_ns
+                      << " failed_scan=" << scan_failed << " failed_index=" << best_failed << std::endl;
+        }
+    }
+    return 0;
+}
+
+// MB/s of copyRange from a host file into an image file, per method and buffer size
+int benchCopy(size_t file_mb)
+{
+    const char *source_name = "cab_bench_source.tmp";
+    const char *image_name = "cab_bench_image.tmp";
+    size_t length = file_mb << 20;
+
+    int source_fd = open(source_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int image_fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (source_fd < 0 || image_fd < 0)
+    {
+        std::cout << "could not create the temporary files" << std::endl;
+        return 1;
+    }
+
+    {
+        std::mt19937_64 rng(1);
+        CopyBuffer fill(DEFAULT_COPY_BUFFER_SIZE);
+        for (size_t i = 0; i < fill.getSize() / 8; i++)
+            ((uint64_t *)fill.getData())[i] = rng();
+        for (size_t written = 0; written < length; written += fill.getSize())
+            pwrite(source_fd, fill.getData(), std::min(fill.getSize(), length - written), written);
+    }
+
+    struct copy_case
+    {
+        const char *name;
+        copy_method method;
+        size_t buffer_size;
+    };
+    const copy_case cases[] = {
+        {"copy_file_range", COPY_FILE_RANGE, DEFAULT_COPY_BUFFER_SIZE},
+        {"sendfile", COPY_SENDFILE, DEFAULT_COPY_BUFFER_SIZE},
+        {"buffered", COPY_BUFFERED, 64 << 10},
+        {"buffered", COPY_BUFFERED, 256 << 10},
+        {"buffered", COPY_BUFFERED, 1 << 20},
+        {"buffered", COPY_BUFFERED, 4 << 20},
+        {"buffered", COPY_BUFFERED, 16 << 20},
+    };
+
+    // a 512 byte block boundary, so the copy is not page aligned on both sides
+    off_t image_offset = 70 * BYTES_PER_SECTOR;
+    for (const copy_case &c : cases)
+    {
+        CopyBuffer buffer(c.buffer_size);
+        auto start = std::chrono::steady_clock::now();
+        bool ok = copyRange(source_fd, 0, image_fd, image_offset, length, buffer, c.method);
+        fsync(image_fd);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "copy method=" << c.name << " buffer_kb=" << (c.buffer_size >> 10) << " mb=" << file_mb;
+        if (ok)
+            std::cout << " mb_per_s=" << file_mb / seconds << std::endl;
+        else
+            std::cout << " unsupported" << std::endl;
+    }
+
+    close(source_fd);
+    close(image_fd);
+    unlink(source_name);
+    unlink(image_name);
+    return 0;
+}
+
+// formatting time per mode for images of 16 MiB up to max_mb
+int benchFormat(size_t max_mb)
+{
+    const char *image_name = "cab_bench_image.tmp";
+    const struct
+    {
+        const char *name;
+        format_mode mode;
+    } modes[] = {{"fast", FORMAT_FAST}, {"write-zeros", FORMAT_WRITE_ZEROS}, {"legacy", FORMAT_LEGACY}};
+    unsigned int n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (size_t image_mb = 16; image_mb <= max_mb; image_mb *= 4)
+    {
+        for (auto &m : modes)
+        {
+            int image_fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (image_fd < 0 || ftruncate(image_fd, image_mb << 20) < 0)
+            {
+                std::cout << "could not create " << image_name << std::endl;
+                return 1;
+            }
+            close(image_fd);
+
+            auto start = std::chrono::steady_clock::now();
+            bool ok = formatImage(image_name, m.mode, n_threads);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "format mode=" << m.name << " image_mb=" << image_mb << " threads=" << n_threads
+                      << (ok ? " ms=" : " failed ms=") << ms << std::endl;
+        }
+    }
+    unlink(image_name);
+    return 0;
+}
+
+// the root directory scan searchFile used before DirIndex, kept as the reference
+size_t searchLinear(dir_entry *entries, size_t n_entries, const std::string &file_name)
+{
+    for (size_t i = 0; i < n_entries; i++)
+    {
+        std::string file_name_current(entries[i].file_name, entryNameLength(entries[i]));
+        if (file_name_current == file_name)
+            return i;
+    }
+    return ENTRY_NOT_FOUND;
+}
+
+// name lookups in a full root directory: linear scan against the hashed index
+int benchDirLookup(size_t lookups)
+{
+    std::mt19937_64 rng(3);
+    std::vector<dir_entry> entries(N_ROOT_ENTRIES);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < N_ROOT_ENTRIES; i++)
+    {
+        memset(&entries[i], 0, sizeof(dir_entry));
+        entries[i].first_block = 100 + i;
+        entries[i].file_type = BINARY_TYPE;
+        std::string name = "file_" + std::to_string(rng() % 100000000) + ".bin";
+        strncpy(entries[i].file_name, name.c_str(), FILE_NAME_SIZE - 1);
+        names.push_back(name);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    DirIndex dir_index(entries.data(), entries.size());
+    double build_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<std::string> queries;
+    for (size_t i = 0; i < lookups; i++)
+        queries.push_back(i % 4 == 3 ? "missing_" + std::to_string(i) : names[rng() % names.size()]);
+
+    for (const std::string &query : queries)
+    {
+        if (searchLinear(entries.data(), entries.size(), query) != dir_index.find(query))
+        {
+            std::cout << "MISMATCH name=" << query << std::endl;
+            return 1;
+        }
+    }
+
+    size_t checksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (const std::string &query : queries)
+        checksum += searchLinear(entries.data(), entries.size(), query);
+    double linear_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups;
+
+    start = std::chrono::steady_clock::now();
+    for (const std::string &query : queries)
+        checksum -= dir_index.find(query);
+    double hashed_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups;
+
+    std::cout << "dir-lookup entries=" << N_ROOT_ENTRIES << " build_us=" << build_us << " linear_ns=" << linear_ns
+              << " hashed_ns=" << hashed_ns << " speedup=" << linear_ns / hashed_ns << (checksum ? " (results differ)" : "") << std::endl;
+    return 0;
+}
+
+// path lookup latency against directory depth and fan-out, with and without the dentry cache
+int benchPathLookup(size_t lookups)
+{
+    const char *image_name = "cab_bench_image.tmp";
+    std::mt19937_64 rng(5);
+
+    for (size_t fan_out : {8, 32, 126})
+    {
+        for (size_t depth : {1, 2, 4, 8, 16, 32})
+        {
+            int image_fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (image_fd < 0 || ftruncate(image_fd, 16 << 20) < 0)
+            {
+                std::cout << "could not create " << image_name << std::endl;
+                return 1;
+            }
+            close(image_fd);
+
+            CabImage image;
+            if (!formatImage(image_name, FORMAT_FAST, 1) || !image.open(image_name, true))
+                return 1;
+            BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+            bmap.buildExtentIndex();
+            DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+            PathResolver cached(image, dir_index);
+            PathResolver uncached(image, dir_index, 0);
+
+            // every level holds fan_out - 1 files and the next directory, names in random order
+            std::vector<std::string> components;
+            std::string leaf;
+            for (size_t level = 0; level <= depth; level++)
+            {
+                dir_location location;
+                cached.makeDirs(components, components.size(), bmap, location);
+                for (size_t i = 0; i + 1 < fan_out; i++)
+                {
+                    dir_entry entry;
+                    memset(&entry, 0, sizeof(entry));
+                    entry.first_block = 1;
+                    entry.file_type = BINARY_TYPE;
+                    std::string name = "f" + std::to_string(rng() % 1000000);
+                    strncpy(entry.file_name, name.c_str(), MAX_NAME_LENGTH);
+                    size_t slot = cached.takeFreeSlot(location);
+                    if (slot != ENTRY_NOT_FOUND)
+                        cached.insertEntry(location, slot, entry);
+                    leaf = name;
+                }
+                if (level < depth)
+                    components.push_back("d" + std::to_string(level));
+            }
+            std::string path = PathResolver::joinPath(components, components.size()) + "/" + leaf;
+            if (cached.lookup(path) == nullptr || cached.lookup(path) != uncached.lookup(path))
+            {
+                std::cout << "MISMATCH path=" << path << std::endl;
+                return 1;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            size_t found = 0;
+            for (size_t i = 0; i < lookups; i++)
+                found += uncached.lookup(path) != nullptr;
+            double uncached_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups;
+
+            start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < lookups; i++)
+                found += cached.lookup(path) != nullptr;
+            double cached_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups;
+
+            std::cout << "path-lookup fan_out=" << fan_out << " depth=" << depth << " uncached_ns=" << uncached_ns
+                      << " cached_ns=" << cached_ns << " speedup=" << uncached_ns / cached_ns
+                      << (found == 2 * lookups ? "" : " (lookups failed)") << std::endl;
+        }
+    }
+    unlink(image_name);
+    return 0;
+}
+
+// on-disk corpus for the import benchmarks: many small files spread over subdirectories
+// (SUBDIR_ENTRIES - 2 names fit in each), or a few large files
+typedef struct import_corpus
+{
+    const char *name;
+    std::vector<std::string> files;
+    size_t file_size;
+} import_corpus;
+
+const char *IMPORT_CORPUS_DIR = "cab_bench_corpus.tmp";
+const size_t IMPORT_FILES_PER_DIR = 100;
+
+std::vector<import_corpus> makeImportCorpora(size_t small_files, size_t large_mb)
+{
+    const size_t large_files = 8;
+    std::vector<import_corpus> corpora = {{"small", {}, 4 << 10}, {"large", {}, (large_mb << 20) / large_files}};
+
+    std::mt19937_64 rng(1);
+    CopyBuffer fill(DEFAULT_COPY_BUFFER_SIZE);
+    for (size_t i = 0; i < fill.getSize() / 8; i++)
+        ((uint64_t *)fill.getData())[i] = rng();
+    auto makeFile = [&](const std::string &name, size_t size) {
+        int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        for (size_t written = 0; fd >= 0 && written < size; written += fill.getSize())
+            pwrite(fd, fill.getData(), std::min(fill.getSize(), size - written), written);
+        if (fd >= 0)
+            close(fd);
+    };
+
+    std::string corpus_dir = IMPORT_CORPUS_DIR;
+    mkdir(corpus_dir.c_str(), 0755);
+    for (size_t i = 0; i < small_files; i++)
+    {
+        std::string dir = corpus_dir + "/s" + std::to_string(i / IMPORT_FILES_PER_DIR);
+        if (i % IMPORT_FILES_PER_DIR == 0)
+            mkdir(dir.c_str(), 0755);
+        corpora[0].files.push_back(dir + "/f" + std::to_string(i % IMPORT_FILES_PER_DIR));
+        makeFile(corpora[0].files.back(), corpora[0].file_size);
+    }
+    for (size_t i = 0; i < large_files; i++)
+    {
+        corpora[1].files.push_back(corpus_dir + "/large" + std::to_string(i));
+        makeFile(corpora[1].files.back(), corpora[1].file_size);
+    }
+    return corpora;
+}
+
+void removeImportCorpora(const std::vector<import_corpus> &corpora)
+{
+    std::string corpus_dir = IMPORT_CORPUS_DIR;
+    for (const import_corpus &c : corpora)
+        for (const std::string &name : c.files)
+            unlink(name.c_str());
+    for (size_t d = 0; d * IMPORT_FILES_PER_DIR < corpora[0].files.size(); d++)
+        rmdir((corpus_dir + "/s" + std::to_string(d)).c_str());
+    rmdir(corpus_dir.c_str());
+}
+
+// formats image_name big enough to take the whole corpus
+bool createCorpusImage(const import_corpus &c, const char *image_name, size_t block_size, size_t journal_bytes)
+{
+    // whole blocks per file, the subdirectories and the metadata
+    size_t data_bytes = c.files.size() * ((c.file_size + block_size - 1) / block_size * block_size);
+    size_t dir_bytes = (c.files.size() / IMPORT_FILES_PER_DIR + 16) * std::max(block_size, (size_t)SUBDIR_ENTRIES * ENTRY_SIZE);
+    size_t image_size = data_bytes + dir_bytes + 4 * block_size + (4 << 20) + journal_bytes;
+    int image_fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (image_fd < 0 || ftruncate(image_fd, image_size) < 0 || !formatImage(image_name, FORMAT_FAST, 1, block_size, ALLOC_BEST_FIT, journal_bytes))
+    {
+        std::cout << "could not create " << image_name << std::endl;
+        if (image_fd >= 0)
+            close(image_fd);
+        return false;
+    }
+    close(image_fd);
+    return true;
+}
+
+// formats a fresh image big enough for the corpus, runs import(context, stats) on it and
+// prints its throughput, final metadata commit included; false if a file was skipped
+template <typename Import>
+bool timeImport(const import_corpus &c, const std::string &label, Import import, size_t block_size = DEFAULT_BLOCK_SIZE,
+                size_t journal_bytes = DEFAULT_JOURNAL_SIZE)
+{
+    const char *image_name = "cab_bench_image.tmp";
+    if (!createCorpusImage(c, image_name, block_size, journal_bytes))
+        return false;
+
+    CabImage image;
+    image.open(image_name, true);
+    BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+    bmap.buildExtentIndex();
+    DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+    PathResolver resolver(image, dir_index);
+    import_context context = {image_name, image, bmap, resolver, false, 0, 0, nullptr, nullptr, MAX_FILE_EXTENTS};
+    batch_stats stats = {0, 0, 0, 0, 0, 0};
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = import(context, stats);
+    ok = commitImports(context, stats) && ok;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "import corpus=" << c.name << " files=" << c.files.size() << " file_kb=" << (c.file_size >> 10)
+              << " " << label << " files_per_s=" << stats.files_written / seconds
+              << " mb_per_s=" << (stats.bytes_written / seconds) / (1024 * 1024)
+              << " skipped=" << stats.files_skipped << " commits=" << stats.commits << std::endl;
+    image.close();
+    unlink(image_name);
+    return ok && stats.files_skipped == 0;
+}
+
+// files/s and MB/s of the writer's import for 1 to 8 threads
+int benchImport(size_t small_files, size_t large_mb)
+{
+    std::vector<import_corpus> corpora = makeImportCorpora(small_files, large_mb);
+    int result = 0;
+    for (const import_corpus &c : corpora)
+    {
+        for (unsigned int n_threads = 1; n_threads <= 8; n_threads *= 2)
+        {
+            bool ok = timeImport(c, "threads=" + std::to_string(n_threads), [&](import_context &context, batch_stats &stats) {
+                importFiles(context, c.files, n_threads, stats);
+                return true;
+            });
+            if (!ok)
+                result = 1;
+        }
+    }
+    removeImportCorpora(corpora);
+    return result;
+}
+
+// every corpus file looked up by path and extracted into output_dir, as cab_file_taker
+// does; the outputs are removed again. Returns the seconds taken, bytes counts what was written
+double timeExtract(CabImage &image, PathResolver &resolver, const import_corpus &c, const std::string &output_dir,
+                   size_t &files_extracted, size_t &bytes_extracted)
+{
+    CopyBuffer copy_buffer(DEFAULT_COPY_BUFFER_SIZE);
+    files_extracted = bytes_extracted = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < c.files.size(); i++)
+    {
+        dir_entry *entry = resolver.lookup(c.files[i]);
+        if (entry == nullptr || !extractFile(image, *entry, output_dir + "/" + std::to_string(i), copy_buffer))
+            continue;
+        files_extracted++;
+        bytes_extracted += extractedSize(image, *entry);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (size_t i = 0; i < c.files.size(); i++)
+        unlink((output_dir + "/" + std::to_string(i)).c_str());
+    return seconds;
+}
+
+// files/s and MB/s of cab_file_taker's extraction: each corpus is imported into a fresh
+// image, then every file is looked up by path and copied out to the host
+int benchExtract(size_t small_files, size_t large_mb)
+{
+    const char *image_name = "cab_bench_image.tmp";
+    const std::string output_dir = "cab_bench_extract.tmp";
+    std::vector<import_corpus> corpora = makeImportCorpora(small_files, large_mb);
+    mkdir(output_dir.c_str(), 0755);
+    int result = 0;
+    for (const import_corpus &c : corpora)
+    {
+        if (!createCorpusImage(c, image_name, DEFAULT_BLOCK_SIZE, DEFAULT_JOURNAL_SIZE))
+        {
+            result = 1;
+            continue;
+        }
+        CabImage image;
+        image.open(image_name, true);
+        BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+        bmap.buildExtentIndex();
+        DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+        PathResolver resolver(image, dir_index);
+        import_context context = {image_name, image, bmap, resolver, false, 0, 0, nullptr, nullptr, MAX_FILE_EXTENTS};
+        batch_stats stats = {0, 0, 0, 0, 0, 0};
+        importFiles(context, c.files, 1, stats);
+        if (!commitImports(context, stats) || stats.files_skipped != 0)
+            result = 1;
+
+        size_t files_extracted, bytes_extracted;
+        double seconds = timeExtract(image, resolver, c, output_dir, files_extracted, bytes_extracted);
+        if (files_extracted != c.files.size())
+            result = 1;
+        std::cout << "extract corpus=" << c.name << " files=" << files_extracted << " file_kb=" << (c.file_size >> 10)
+                  << " files_per_s=" << files_extracted / seconds
+                  << " mb_per_s=" << (bytes_extracted / seconds) / (1024 * 1024) << std::endl;
+        image.close();
+        unlink(image_name);
+    }
+    rmdir(output_dir.c_str());
+    removeImportCorpora(corpora);
+    return result;
+}
+
+// log-like text, the payload compression is meant for: n_files files of file_kb KiB each
+import_corpus makeLogCorpus(size_t n_files, size_t file_kb)
+{
+    import_corpus logs = {"logs", {}, file_kb << 10};
+    const char *levels[] = {"INFO", "INFO", "INFO", "WARN", "ERROR", "DEBUG"};
+    const int statuses[] = {200, 200, 200, 201, 404, 500};
+    std::mt19937_64 rng(7);
+    mkdir(IMPORT_CORPUS_DIR, 0755);
+    for (size_t f = 0; f < n_files; f++)
+    {
+        std::string text;
+        for (size_t line = 0; text.size() < logs.file_size; line++)
+        {
+            char buffer[192];
+            uint64_t r = rng();
+            snprintf(buffer, sizeof(buffer), "2026-10-16T12:%02zu:%02zu.%03u %-5s worker-%u request=%08x path=/api/v1/items/%u status=%d ms=%u.%02u\n",
+                     line / 60 % 60, line % 60, (unsigned)(r % 1000), levels[r % 6], (unsigned)(r >> 8) % 16, (unsigned)(r >> 16),
+                     (unsigned)(r >> 24) % 500, statuses[(r >> 40) % 6], (unsigned)(r >> 44) % 200, (unsigned)(r >> 52) % 100);
+            text += buffer;
+        }
+        text.resize(logs.file_size);
+        logs.files.push_back(std::string(IMPORT_CORPUS_DIR) + "/log" + std::to_string(f));
+        int fd = open(logs.files.back().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0)
+        {
+            writeAll(fd, text.data(), text.size(), 0);
+            close(fd);
+        }
+    }
+    return logs;
+}
+
+// compression ratio and MB/s (of the original bytes) for import and extraction of a log
+// corpus, stored raw (chunk_kb=0) and compressed with 1 and 4 import threads
+int benchCompress(size_t n_files, size_t file_kb)
+{
+    if (!compressionAvailable())
+    {
+        std::cout << "built without zlib, compression is not available" << std::endl;
+        return 1;
+    }
+    const char *image_name = "cab_bench_image.tmp";
+    const std::string output_dir = "cab_bench_extract.tmp";
+    import_corpus logs = makeLogCorpus(n_files, file_kb);
+    size_t original_bytes = logs.files.size() * logs.file_size;
+    mkdir(output_dir.c_str(), 0755);
+    int result = 0;
+    const struct
+    {
+        size_t chunk;
+        unsigned int n_threads;
+    } runs[] = {{0, 1}, {DEFAULT_COMPRESSION_CHUNK, 1}, {DEFAULT_COMPRESSION_CHUNK, 4}};
+    for (auto &run : runs)
+    {
+        if (!createCorpusImage(logs, image_name, DEFAULT_BLOCK_SIZE, DEFAULT_JOURNAL_SIZE))
+        {
+            result = 1;
+            break;
+        }
+        CabImage image;
+        image.open(image_name, true);
+        BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+        bmap.buildExtentIndex();
+        DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+        PathResolver resolver(image, dir_index);
+        import_context context = {image_name, image, bmap, resolver, false, 0, run.chunk, nullptr, nullptr, MAX_FILE_EXTENTS};
+        batch_stats stats = {0, 0, 0, 0, 0, 0};
+
+        auto start = std::chrono::steady_clock::now();
+        importFiles(context, logs.files, run.n_threads, stats);
+        bool ok = commitImports(context, stats) && stats.files_skipped == 0;
+        double import_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        size_t files_extracted, bytes_extracted;
+        double extract_seconds = timeExtract(image, resolver, logs, output_dir, files_extracted, bytes_extracted);
+        if (!ok || files_extracted != logs.files.size() || bytes_extracted != original_bytes)
+            result = 1;
+
+        std::cout << "compress corpus=" << logs.name << " files=" << logs.files.size() << " file_kb=" << file_kb
+                  << " chunk_kb=" << (run.chunk >> 10) << " threads=" << run.n_threads
+                  << " ratio=" << (double)original_bytes / stats.bytes_written
+                  << " import_mb_per_s=" << (original_bytes / import_seconds) / (1024 * 1024)
+                  << " extract_mb_per_s=" << (bytes_extracted / extract_seconds) / (1024 * 1024) << std::endl;
+        image.close();
+        unlink(image_name);
+    }
+    rmdir(output_dir.c_str());
+    for (const std::string &name : logs.files)
+        unlink(name.c_str());
+    rmdir(IMPORT_CORPUS_DIR);
+    return result;
+}
+
+// small-file layout of makeImportCorpora where duplicate_percent of the files repeat the
+// content of an earlier one (same bytes, another name)
+import_corpus makeDuplicateCorpus(size_t n_files, size_t file_kb, size_t duplicate_percent)
+{
+    import_corpus c = {"duplicates", {}, file_kb << 10};
+    size_t unique_files = std::max((size_t)1, n_files - n_files * std::min(duplicate_percent, (size_t)100) / 100);
+    std::vector<char> content(c.file_size);
+    std::string corpus_dir = IMPORT_CORPUS_DIR;
+    mkdir(corpus_dir.c_str(), 0755);
+    for (size_t i = 0; i < n_files; i++)
+    {
+        std::mt19937_64 rng(i % unique_files);
+        for (size_t w = 0; w + 8 <= content.size(); w += 8)
+        {
+            uint64_t word = rng();
+            memcpy(content.data() + w, &word, 8);
+        }
+        std::string dir = corpus_dir + "/s" + std::to_string(i / IMPORT_FILES_PER_DIR);
+        if (i % IMPORT_FILES_PER_DIR == 0)
+            mkdir(dir.c_str(), 0755);
+        c.files.push_back(dir + "/f" + std::to_string(i % IMPORT_FILES_PER_DIR));
+        int fd = open(c.files.back().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0)
+        {
+            writeAll(fd, content.data(), content.size(), 0);
+            close(fd);
+        }
+    }
+    return c;
+}
+
+// what --dedup costs and saves: hashing MB/s of the scalar and AVX2 kernels (which must agree),
+// then a corpus with duplicate_percent repeated files imported without dedup and with it
+int benchDedup(size_t n_files, size_t file_kb, size_t duplicate_percent)
+{
+    int result = 0;
+    std::vector<char> buffer(64 << 20);
+    std::mt19937_64 rng(3);
+    for (size_t w = 0; w + 8 <= buffer.size(); w += 8)
+    {
+        uint64_t word = rng();
+        memcpy(buffer.data() + w, &word, 8);
+    }
+    file_digest digests[2];
+    for (int vectorized = 0; vectorized <= (vectorizedHashing() ? 1 : 0); vectorized++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        file_digest digest = {{0, 0}};
+        for (size_t offset = 0; offset < buffer.size(); offset += DEDUP_CHUNK_SIZE)
+        {
+            file_digest chunk = hashChunk(buffer.data() + offset, DEDUP_CHUNK_SIZE, vectorized);
+            digest.hash[0] ^= chunk.hash[0];
+            digest.hash[1] ^= chunk.hash[1];
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        digests[vectorized] = digest;
+        std::cout << "dedup hash kernel=" << (vectorized ? "avx2" : "scalar") << " mb_per_s=" << (buffer.size() / seconds) / (1024 * 1024)
+                  << std::endl;
+    }
+    if (vectorizedHashing() && memcmp(&digests[0], &digests[1], sizeof(file_digest)) != 0)
+    {
+        std::cout << "dedup hash MISMATCH between the scalar and avx2 kernels" << std::endl;
+        result = 1;
+    }
+
+    import_corpus c = makeDuplicateCorpus(n_files, file_kb, duplicate_percent);
+    size_t logical_bytes = c.files.size() * c.file_size;
+    const char *image_name = "cab_bench_image.tmp";
+    const struct
+    {
+        bool dedup;
+        unsigned int n_threads;
+    } runs[] = {{false, 1}, {true, 1}, {true, 4}};
+    for (auto &run : runs)
+    {
+        if (!createCorpusImage(c, image_name, DEFAULT_BLOCK_SIZE, DEFAULT_JOURNAL_SIZE))
+        {
+            result = 1;
+            break;
+        }
+        CabImage image;
+        image.open(image_name, true);
+        BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+        bmap.buildExtentIndex();
+        DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+        PathResolver resolver(image, dir_index);
+        DedupIndex dedup;
+        dedup.load(image);
+        import_context context = {image_name, image, bmap, resolver, false, 0, 0, run.dedup ? &dedup : nullptr, nullptr,
+                                  MAX_FILE_EXTENTS};
+        batch_stats stats = {0, 0, 0, 0, 0, 0};
+
+        auto start = std::chrono::steady_clock::now();
+        importFiles(context, c.files, run.n_threads, stats);
+        bool ok = commitImports(context, stats) && stats.files_skipped == 0;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!ok)
+            result = 1;
+
+        std::cout << "dedup corpus=" << c.name << " files=" << c.files.size() << " file_kb=" << file_kb
+                  << " duplicate_percent=" << duplicate_percent << " dedup=" << run.dedup << " threads=" << run.n_threads
+                  << " import_s=" << seconds << " mb_per_s=" << (logical_bytes / seconds) / (1024 * 1024)
+                  << " bytes_written=" << stats.bytes_written << " bytes_saved=" << stats.bytes_deduplicated
+                  << " ratio=" << (double)logical_bytes / std::max(stats.bytes_written, (size_t)1) << std::endl;
+        image.close();
+        unlink(image_name);
+    }
+    removeImportCorpora({c});
+    return result;
+}
+
+// --pack on a corpus of n_files tiny files (1 to max_file_bytes bytes, three directory
+// levels of 100), without a block per file and with pack blocks: blocks taken, files/s of
+// the import and ns per lookup + read of a random file. The files only exist in memory,
+// each goes through reserveEntry and a pwrite as the writer would do with it
+int benchPack(size_t n_files, size_t max_file_bytes, size_t block_size)
+{
+    const char *image_name = "cab_bench_image.tmp";
+    std::vector<std::string> names(n_files);
+    std::vector<uint32_t> sizes(n_files);
+    std::mt19937_64 rng(7);
+    size_t logical_bytes = 0;
+    for (size_t i = 0; i < n_files; i++)
+    {
+        names[i] = "d" + std::to_string(i / 10000) + "/s" + std::to_string(i / IMPORT_FILES_PER_DIR % 100) + "/f" +
+                   std::to_string(i % IMPORT_FILES_PER_DIR);
+        sizes[i] = 1 + rng() % max_file_bytes;
+        logical_bytes += sizes[i];
+    }
+    std::vector<char> content(max_file_bytes);
+    for (size_t b = 0; b < content.size(); b++)
+        content[b] = 'a' + b % 26;
+    std::vector<size_t> probes(std::min(n_files, (size_t)100000));
+    for (size_t &probe : probes)
+        probe = rng() % n_files;
+
+    int result = 0;
+    for (int pack = 0; pack <= 1; pack++)
+    {
+        size_t dirs = n_files / IMPORT_FILES_PER_DIR + n_files / 10000 + 16;
+        size_t image_size = n_files * ((max_file_bytes + block_size - 1) / block_size * block_size) +
+                            dirs * std::max(block_size, (size_t)SUBDIR_ENTRIES * ENTRY_SIZE) + (4 << 20) + DEFAULT_JOURNAL_SIZE;
+        int image_fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (image_fd < 0 || ftruncate(image_fd, image_size) < 0 ||
+            !formatImage(image_name, FORMAT_FAST, 1, block_size, ALLOC_BEST_FIT, DEFAULT_JOURNAL_SIZE))
+        {
+            std::cout << "could not create " << image_name << std::endl;
+            if (image_fd >= 0)
+                close(image_fd);
+            return 1;
+        }
+        close(image_fd);
+
+        CabImage image;
+        image.open(image_name, true);
+        BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+        bmap.buildExtentIndex();
+        DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+        PathResolver resolver(image, dir_index);
+        PackWriter packer(image, bmap);
+        import_context context = {image_name, image, bmap, resolver, false, 0, 0, nullptr, pack ? &packer : nullptr, MAX_FILE_EXTENTS};
+        batch_stats stats = {0, 0, 0, 0, 0, 0};
+        size_t free_before = makeFragmentationReport(bmap.getExtentIndex()).free_blocks;
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n_files; i++)
+        {
+            import_job job;
+            if (!reserveEntry(context, names[i], sizes[i], job, stats))
+                break;
+            bool written = pwrite(image.fd(), content.data(), sizes[i], jobDataOffset(context, job)) == (ssize_t)sizes[i];
+            finishImport(context, job, written, stats);
+        }
+        bool ok = commitImports(context, stats) && stats.files_written == n_files;
+        double import_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t blocks_used = free_before - makeFragmentationReport(bmap.getExtentIndex()).free_blocks;
+
+        std::vector<char> data(max_file_bytes);
+        size_t read_failures = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t probe : probes)
+        {
+            dir_entry *entry = resolver.lookup(names[probe]);
+            if (entry == nullptr || pread(image.fd(), data.data(), entry->file_size_in_bytes, entryDataOffset(*entry, block_size)) !=
+                                        (ssize_t)sizes[probe] || memcmp(data.data(), content.data(), sizes[probe]) != 0)
+                read_failures++;
+        }
+        double read_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / probes.size();
+        if (!ok || read_failures != 0)
+            result = 1;
+
+        std::cout << "pack files=" << n_files << " max_file_bytes=" << max_file_bytes << " block_size=" << block_size
+                  << " pack=" << pack << " blocks_used=" << blocks_used
+                  << " space_efficiency=" << (double)logical_bytes / ((double)blocks_used * block_size)
+                  << " files_per_s=" << stats.files_written / import_seconds << " lookup_read_ns=" << read_ns
+                  << " skipped=" << n_files - stats.files_written << " read_failures=" << read_failures << std::endl;
+        image.close();
+        unlink(image_name);
+    }
+    return result;
+}
+
+// large files on a deliberately fragmented image: half of the data area is taken in runs
+// averaging 16 blocks, then file_mb files are imported (in memory, as benchPack does) until
+// 90% of the free space would be used, contiguous only and split over extents, against a
+// fresh image. Prints the share of files that found room, the extents per file and the
+// sequential read MB/s of the stored files with the page cache dropped first
+int benchSplit(size_t image_mb, size_t file_mb)
+{
+    const char *image_name = "cab_bench_image.tmp";
+    const size_t file_bytes = file_mb << 20;
+    std::vector<char> content(file_bytes);
+    for (size_t b = 0; b < content.size(); b++)
+        content[b] = (char)(b * 131 + b / 4096);
+    const struct
+    {
+        const char *label;
+        bool fragmented;
+        size_t max_extents;
+    } runs[] = {{"fresh", false, 1}, {"fragmented-contiguous", true, 1}, {"fragmented-split", true, MAX_FILE_EXTENTS}};
+
+    int result = 0;
+    for (auto &run : runs)
+    {
+        int image_fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (image_fd < 0 || ftruncate(image_fd, image_mb << 20) < 0 || !formatImage(image_name, FORMAT_FAST, 1))
+        {
+            std::cout << "could not create " << image_name << std::endl;
+            if (image_fd >= 0)
+                close(image_fd);
+            return 1;
+        }
+        close(image_fd);
+
+        CabImage image;
+        image.open(image_name, true);
+        size_t block_size = image.blockSize();
+        size_t total_blocks = image.bootRecord()->total_blocks;
+        BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+        bmap.buildExtentIndex();
+        if (run.fragmented)
+        {
+            // blocks nobody owns, only there to cut the free space up
+            std::mt19937_64 rng(11);
+            std::geometric_distribution<size_t> run_length(1.0 / 16);
+            for (size_t block = image.metadataEnd() / block_size; block < total_blocks;)
+            {
+                block += run_length(rng) + 1;
+                size_t used = std::min(run_length(rng) + 1, total_blocks - std::min(block, total_blocks));
+                bmap.writeBits(block, used, 1);
+                block += used;
+            }
+        }
+        DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+        PathResolver resolver(image, dir_index);
+        import_context context = {image_name, image, bmap, resolver, false, 0, 0, nullptr, nullptr, run.max_extents};
+        batch_stats stats = {0, 0, 0, 0, 0, 0};
+
+        size_t free_bytes = makeFragmentationReport(bmap.getExtentIndex()).free_blocks * block_size;
+        size_t attempted = std::max((size_t)1, free_bytes * 9 / 10 / file_bytes);
+        size_t extents = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < attempted; i++)
+        {
+            import_job job;
+            if (!reserveEntry(context, "f" + std::to_string(i), file_bytes, job, stats))
+                continue;
+            bool written;
+            if (job.split)
+            {
+                written = forEachExtentRange(job.extents, block_size, file_bytes, [&](off_t image_offset, off_t file_offset, size_t length) {
+                    return writeAll(image.fd(), content.data() + file_offset, length, image_offset);
+                }) && writeExtentMap(image.fd(), job.extents, job.map_blocks, block_size);
+                extents += job.extents.size();
+            }
+            else
+            {
+                written = writeAll(image.fd(), content.data(), file_bytes, jobDataOffset(context, job));
+                extents++;
+            }
+            finishImport(context, job, written, stats);
+        }
+        if (!commitImports(context, stats))
+            result = 1;
+        double import_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // every stored file read back in file order, piece by piece
+        fdatasync(image.fd());
+        posix_fadvise(image.fd(), 0, 0, POSIX_FADV_DONTNEED);
+        std::vector<char> data(file_bytes);
+        size_t read_failures = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < attempted; i++)
+        {
+            dir_entry *entry = resolver.lookup("f" + std::to_string(i));
+            if (entry == nullptr)
+                continue;
+            std::vector<file_extent> pieces = {{entry->first_block, entryBlocks(*entry, block_size)}};
+            bool read = entry->file_type != EXTENTS_TYPE || readExtentMap(image.fd(), *entry, block_size, total_blocks, pieces);
+            read = read && forEachExtentRange(pieces, block_size, file_bytes, [&](off_t image_offset, off_t file_offset, size_t length) {
+                return pread(image.fd(), data.data() + file_offset, length, image_offset) == (ssize_t)length;
+            });
+            if (!read || memcmp(data.data(), content.data(), file_bytes) != 0)
+                read_failures++;
+        }
+        double read_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (read_failures != 0 || (run.max_extents > 1 && stats.files_written != attempted))
+            result = 1;
+
+        std::cout << "split image_mb=" << image_mb << " file_mb=" << file_mb << " layout=" << run.label
+                  << " attempted=" << attempted << " stored=" << stats.files_written
+                  << " success_rate=" << (double)stats.files_written / attempted
+                  << " extents_per_file=" << (stats.files_written == 0 ? 0 : (double)extents / stats.files_written)
+                  << " import_mb_per_s=" << (stats.bytes_written / import_seconds) / (1024 * 1024)
+                  << " read_mb_per_s=" << (stats.files_written * file_bytes / read_seconds) / (1024 * 1024)
+                  << " read_failures=" << read_failures << std::endl;
+        image.close();
+        unlink(image_name);
+    }
+    return result;
+}
+
+// random 4 KiB reads inside one file_mb file through RangeReader, with the page cache dropped
+// first: latency percentiles of single reads, then the per-read cost in batches of 64, for the
+// file stored raw and compressed. The baseline is what a reader paid before, extracting the
+// whole file to read from the copy
+int benchRangeRead(size_t file_mb, size_t reads)
+{
+    const char *image_name = "cab_bench_image.tmp";
+    const std::string copy_name = "cab_bench_extract.tmp";
+    const size_t read_size = 4 << 10;
+    const size_t batch_size = 64;
+    size_t file_bytes = file_mb << 20;
+    std::vector<char> content(file_bytes);
+    std::mt19937_64 rng(5);
+    for (char &c : content)
+        c = 'a' + rng() % 16;
+    std::vector<uint64_t> offsets(reads);
+    for (uint64_t &offset : offsets)
+        offset = rng() % (file_bytes / read_size) * read_size;
+
+    int result = 0;
+    for (int compressed = 0; compressed <= (compressionAvailable() ? 1 : 0); compressed++)
+    {
+        int image_fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (image_fd < 0 || ftruncate(image_fd, file_bytes * 2 + (64 << 20)) < 0 || !formatImage(image_name, FORMAT_FAST, 1))
+        {
+            std::cout << "could not create " << image_name << std::endl;
+            if (image_fd >= 0)
+                close(image_fd);
+            return 1;
+        }
+        close(image_fd);
+
+        CabImage image;
+        image.open(image_name, true);
+        BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+        bmap.buildExtentIndex();
+        DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+        PathResolver resolver(image, dir_index);
+        import_context context = {image_name, image, bmap, resolver, false, 0, 0, nullptr, nullptr, MAX_FILE_EXTENTS};
+        batch_stats stats = {0, 0, 0, 0, 0, 0};
+        std::vector<char> stored;
+        if (compressed)
+            compressBuffer(content.data(), content.size(), DEFAULT_COMPRESSION_CHUNK, std::thread::hardware_concurrency(), stored);
+        const std::vector<char> &data = compressed ? stored : content;
+        import_job job;
+        bool ok = reserveEntry(context, "data", data.size(), job, stats, compressed ? COMPRESSED_TYPE : BINARY_TYPE);
+        ok = ok && writeAll(image.fd(), data.data(), data.size(), jobDataOffset(context, job));
+        if (ok)
+            finishImport(context, job, true, stats);
+        ok = ok && commitImports(context, stats);
+        image.close();
+
+        // reopened read-only, as a reader would, with nothing of the file cached
+        int drop_fd = open(image_name, O_RDONLY);
+        if (drop_fd >= 0)
+        {
+            posix_fadvise(drop_fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(drop_fd);
+        }
+        image.open(image_name, false);
+        DirIndex read_index(image.rootDir(), image.bootRecord()->n_root_entries);
+        PathResolver read_resolver(image, read_index);
+        RangeReader reader;
+        auto start = std::chrono::steady_clock::now();
+        dir_entry *entry = read_resolver.lookup("data");
+        ok = ok && entry != nullptr && reader.open(image, *entry) && reader.size() == file_bytes;
+        double open_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        if (!ok)
+        {
+            std::cout << "could not store and open the range-read file" << std::endl;
+            image.close();
+            unlink(image_name);
+            return 1;
+        }
+
+        std::vector<char> buffer(read_size * batch_size);
+        std::vector<double> latencies;
+        size_t mismatches = 0;
+        start = std::chrono::steady_clock::now();
+        for (uint64_t offset : offsets)
+        {
+            auto read_start = std::chrono::steady_clock::now();
+            ssize_t n = reader.read(buffer.data(), read_size, offset);
+            latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - read_start).count());
+            if (n != (ssize_t)read_size || memcmp(buffer.data(), content.data() + offset, read_size) != 0)
+                mismatches++;
+        }
+        double single_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) { return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))]; };
+
+        posix_fadvise(image.fd(), 0, 0, POSIX_FADV_DONTNEED);
+        std::vector<range_request> batch;
+        start = std::chrono::steady_clock::now();
+        for (size_t first = 0; first < offsets.size(); first += batch_size)
+        {
+            batch.clear();
+            for (size_t r = first; r < std::min(offsets.size(), first + batch_size); r++)
+                batch.push_back({offsets[r], read_size, buffer.data() + (r - first) * read_size, 0});
+            if (reader.readBatch(batch) != 0)
+                mismatches++;
+            for (size_t r = 0; r < batch.size(); r++)
+                mismatches += memcmp(batch[r].buffer, content.data() + batch[r].offset, read_size) != 0;
+        }
+        double batch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // a few extractions are enough to see what the whole-file copy costs per lookup
+        posix_fadvise(image.fd(), 0, 0, POSIX_FADV_DONTNEED);
+        CopyBuffer copy_buffer;
+        size_t extractions = 3;
+        start = std::chrono::steady_clock::now();
+        for (size_t e = 0; e < extractions; e++)
+        {
+            int copy_fd;
+            if (!extractFile(image, *entry, copy_name, copy_buffer) || (copy_fd = open(copy_name.c_str(), O_RDONLY)) < 0)
+            {
+                mismatches++;
+                continue;
+            }
+            if (pread(copy_fd, buffer.data(), read_size, offsets[e]) != (ssize_t)read_size)
+                mismatches++;
+            close(copy_fd);
+        }
+        double extract_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / extractions;
+        unlink(copy_name.c_str());
+        if (mismatches != 0)
+            result = 1;
+
+        std::cout << "range-read file_mb=" << file_mb << " stored=" << (compressed ? "compressed" : "raw") << " reads=" << reads
+                  << " open_us=" << open_us << " p50_us=" << percentile(0.50) << " p99_us=" << percentile(0.99)
+                  << " p999_us=" << percentile(0.999) << " reads_per_s=" << reads / single_seconds
+                  << " batch=" << batch_size << " batch_us_per_read=" << batch_seconds * 1e6 / reads
+                  << " batch_reads_per_s=" << reads / batch_seconds << " extract_then_read_us=" << extract_us
+                  << " mismatches=" << mismatches << std::endl;
+        image.close();
+        unlink(image_name);
+    }
+    return result;
+}
+
+// file_mb of data arriving through a pipe, as from a producer that cannot say how much it
+// will send: streamed straight into the image, against staged to a temporary file first and
+// imported from there, as the writer had to before. Prints MB/s including the commit, the
+// bytes written on the host and the extents the file ended up in, and reads the file back
+int benchStream(size_t file_mb)
+{
+    const char *image_name = "cab_bench_image.tmp";
+    // the staging file's name is also the stored file's, as the writer would import it
+    const char *staging_name = "cab_bench_stream.tmp";
+    const size_t file_bytes = file_mb << 20;
+    std::vector<char> content(file_bytes);
+    for (size_t b = 0; b < content.size(); b++)
+        content[b] = (char)(b * 131 + b / 4096);
+
+    int result = 0;
+    for (bool staged : {false, true})
+    {
+        int image_fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (image_fd < 0 || ftruncate(image_fd, file_bytes * 2 + (64 << 20)) < 0 || !formatImage(image_name, FORMAT_FAST, 1))
+        {
+            std::cout << "could not create " << image_name << std::endl;
+            if (image_fd >= 0)
+                close(image_fd);
+            return 1;
+        }
+        close(image_fd);
+
+        CabImage image;
+        image.open(image_name, true);
+        size_t block_size = image.blockSize();
+        BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+        bmap.buildExtentIndex();
+        DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+        PathResolver resolver(image, dir_index);
+        import_context context = {image_name, image, bmap, resolver, false, 0, 0, nullptr, nullptr, MAX_FILE_EXTENTS};
+        batch_stats stats = {0, 0, 0, 0, 0, 0};
+        CopyBuffer copy_buffer;
+        size_t free_blocks = makeFragmentationReport(bmap.getExtentIndex()).free_blocks;
+
+        int pipe_fds[2];
+        if (pipe(pipe_fds) < 0)
+        {
+            std::cout << "could not create a pipe" << std::endl;
+            return 1;
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::thread producer([&]() {
+            for (size_t done = 0; done < file_bytes;)
+            {
+                ssize_t n = write(pipe_fds[1], content.data() + done, file_bytes - done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                done += n;
+            }
+            close(pipe_fds[1]);
+        });
+        bool stored;
+        if (staged)
+        {
+            int staging_fd = open(staging_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            size_t staged_bytes = 0;
+            for (ssize_t n; staging_fd >= 0 && (n = read(pipe_fds[0], copy_buffer.getData(), copy_buffer.getSize())) > 0;)
+            {
+                if (!writeAll(staging_fd, copy_buffer.getData(), n, staged_bytes))
+                    break;
+                staged_bytes += n;
+            }
+            if (staging_fd >= 0)
+                close(staging_fd);
+            stored = staged_bytes == file_bytes && writeToCAB(context, staging_name, copy_buffer, stats);
+            unlink(staging_name);
+        }
+        else
+            stored = streamToCAB(context, pipe_fds[0], staging_name, copy_buffer, stats);
+        producer.join();
+        close(pipe_fds[0]);
+        stored = commitImports(context, stats) && stored;
+        fdatasync(image.fd());
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        dir_entry *entry = resolver.lookup(staging_name);
+        std::vector<file_extent> extents;
+        if (entry != nullptr)
+            extents = {{entry->first_block, entryBlocks(*entry, block_size)}};
+        RangeReader reader;
+        std::vector<char> data(file_bytes);
+        bool verified = stored && entry != nullptr && entry->file_size_in_bytes == file_bytes &&
+                        (entry->file_type != EXTENTS_TYPE ||
+                         readExtentMap(image.fd(), *entry, block_size, image.bootRecord()->total_blocks, extents)) &&
+                        reader.open(image, *entry) && reader.read(data.data(), file_bytes, 0) == (ssize_t)file_bytes &&
+                        memcmp(data.data(), content.data(), file_bytes) == 0;
+        // a stream's speculative blocks must all be given back
+        size_t blocks = free_blocks - makeFragmentationReport(bmap.getExtentIndex()).free_blocks;
+        verified = verified && blocks == (file_bytes + block_size - 1) / block_size + mapBlocksFor(extents.size(), block_size) * (extents.size() > 1);
+        if (!verified)
+            result = 1;
+
+        std::cout << "stream file_mb=" << file_mb << " mode=" << (staged ? "staged" : "streamed")
+                  << " mb_per_s=" << (file_bytes / seconds) / (1024 * 1024)
+                  << " host_bytes_written=" << (staged ? 2 : 1) * file_bytes
+                  << " extents=" << extents.size()
+                  << " blocks=" << blocks
+                  << " verified=" << (verified ? "yes" : "no") << std::endl;
+        image.close();
+        unlink(image_name);
+    }
+    return result;
+}
+
+// files/s of small-file imports for several group-commit windows, with the metadata journal
+// and without it (window 0: one commit after the last file)
+int benchGroupCommit(size_t small_files)
+{
+    std::vector<import_corpus> corpora = makeImportCorpora(small_files, 0);
+    const import_corpus &c = corpora[0];
+    int result = 0;
+    for (size_t journal_bytes : {DEFAULT_JOURNAL_SIZE, (size_t)0})
+    {
+        for (size_t window : {1, 8, 64, 512, 0})
+        {
+            for (unsigned int n_threads : {1, 4})
+            {
+                std::string label = "journal=" + std::to_string(journal_bytes != 0) + " window=" + std::to_string(window) +
+                                    " threads=" + std::to_string(n_threads);
+                bool ok = timeImport(c, label, [&](import_context &context, batch_stats &stats) {
+                    context.commit_window = window;
+                    importFiles(context, c.files, n_threads, stats);
+                    return true;
+                }, DEFAULT_BLOCK_SIZE, journal_bytes);
+                if (!ok)
+                    result = 1;
+            }
+        }
+    }
+    removeImportCorpora(corpora);
+    return result;
+}
+
+// the same corpora through each block I/O backend, buffered and with O_DIRECT
+int benchBlockIO(size_t small_files, size_t large_mb)
+{
+    const struct
+    {
+        const char *name;
+        block_io_backend backend;
+    } backends[] = {{"posix", BLOCK_IO_POSIX}, {"io_uring", BLOCK_IO_URING}};
+    std::vector<import_corpus> corpora = makeImportCorpora(small_files, large_mb);
+    int result = 0;
+    for (const import_corpus &c : corpora)
+    {
+        for (auto &b : backends)
+        {
+            for (int direct = 0; direct <= 1; direct++)
+            {
+                std::string label = std::string("backend=") + b.name + " direct=" + std::to_string(direct);
+                bool ok = timeImport(c, label, [&](import_context &context, batch_stats &stats) {
+                    std::unique_ptr<BlockIO> io = openBlockIO(context.image_name, b.backend, direct, context.image.blockSize());
+                    if (!io)
+                        return false;
+                    importFilesBlockIO(context, c.files, *io, stats);
+                    return true;
+                });
+                if (!ok)
+                    result = 1;
+            }
+        }
+    }
+    removeImportCorpora(corpora);
+    return result;
+}
+
+// how the block size chosen at format time moves the costs: bitmap size and scan time for
+// one image size, the blocks a 1 MiB request needs, and import throughput and slack
+int benchBlockSize(size_t image_mb, size_t small_files, size_t large_mb)
+{
+    std::mt19937_64 rng(42);
+    std::vector<import_corpus> corpora = makeImportCorpora(small_files, large_mb);
+    int result = 0;
+    for (size_t block_size : {MIN_BLOCK_SIZE, (size_t)4 << 10, (size_t)16 << 10, (size_t)64 << 10, (size_t)256 << 10, MAX_BLOCK_SIZE})
+    {
+        // free runs of 256 KiB on average whatever the block size, so every row sees the same holes
+        size_t total_blocks = (image_mb << 20) / block_size;
+        size_t mean_run = std::max((size_t)1, (size_t)(256 << 10) / block_size);
+        BitMap bmap = makeFragmentedBitMap(total_blocks, 0.9, mean_run, rng, block_size);
+        size_t request = std::max((size_t)1, (size_t)(1 << 20) / block_size);
+
+        const size_t iterations = 20;
+        size_t found = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++)
+            found += bmap.getFirstBlock(request);
+        double scan_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+        start = std::chrono::steady_clock::now();
+        bmap.buildExtentIndex();
+        double build_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++)
+            found -= bmap.getFirstBlock(request);
+        double index_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+        std::cout << "block-size block_size=" << block_size << " image_mb=" << image_mb << " total_blocks=" << total_blocks
+                  << " bitmap_bytes=" << bmap.getSizeInBytes() << " request_blocks=" << request
+                  << " scan_first_fit_ns=" << scan_ns << " index_build_us=" << build_us << " index_first_fit_ns=" << index_ns
+                  << (found ? " (results differ)" : "") << std::endl;
+
+        for (const import_corpus &c : corpora)
+        {
+            size_t allocated = (c.file_size + block_size - 1) / block_size * block_size;
+            std::string label = "block_size=" + std::to_string(block_size) + " slack_pct=" +
+                                std::to_string(c.file_size ? 100 * (allocated - c.file_size) / allocated : 0);
+            bool ok = timeImport(c, label, [&](import_context &context, batch_stats &stats) {
+                importFiles(context, c.files, 1, stats);
+                return true;
+            }, block_size);
+            if (!ok)
+                result = 1;
+        }
+    }
+    removeImportCorpora(corpora);
+    return result;
+}
+
+// one step of an allocation trace: allocate `blocks` blocks for file `id`, or free file `id`
+typedef struct trace_op
+{
+    bool allocate;
+    size_t id;
+    size_t blocks;
+} trace_op;
+
+// a long create/delete trace that holds the image around fill_ratio full: mostly small files
+// with some large ones, deletions picked at random among the live files
+std::vector<trace_op> makeAllocationTrace(size_t data_blocks, size_t operations, double fill_ratio, std::mt19937_64 &rng)
+{
+    std::geometric_distribution<size_t> small_blocks(1.0 / 4);
+    std::geometric_distribution<size_t> large_blocks(1.0 / 512);
+    std::vector<trace_op> trace;
+    std::vector<std::pair<size_t, size_t>> live; // (id, blocks)
+    size_t live_blocks = 0;
+    size_t next_id = 0;
+    for (size_t i = 0; i < operations; i++)
+    {
+        if (!live.empty() && live_blocks >= fill_ratio * data_blocks)
+        {
+            size_t victim = rng() % live.size();
+            trace.push_back({false, live[victim].first, live[victim].second});
+            live_blocks -= live[victim].second;
+            live[victim] = live.back();
+            live.pop_back();
+            continue;
+        }
+        size_t blocks = 1 + (rng() % 5 == 0 ? std::min(large_blocks(rng), data_blocks / 64) : small_blocks(rng));
+        trace.push_back({true, next_id, blocks});
+        live.push_back({next_id++, blocks});
+        live_blocks += blocks;
+    }
+    return trace;
+}
+
+// replays the same trace on an empty bitmap with every policy: allocation latency, failed
+// requests, and the free space layout at each quarter of the trace
+int benchAllocPolicy(size_t total_blocks, size_t operations)
+{
+    std::mt19937_64 rng(42);
+    boot_record b_record = makeBootRecord(total_blocks * DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_SIZE);
+    size_t data_start = 1 + b_record.bitmap_size_in_blocks + rootDirBlocks(b_record);
+    std::vector<trace_op> trace = makeAllocationTrace(total_blocks - data_start, operations, 0.8, rng);
+
+    for (int p = 0; p < ALLOC_POLICY_COUNT; p++)
+    {
+        b_record.next_fit_block = data_start;
+        BitMap bmap(b_record);
+        formatBitMap(bmap, b_record);
+        bmap.buildExtentIndex();
+        bmap.setPolicy((alloc_policy)p);
+
+        std::vector<std::pair<size_t, size_t>> placed(trace.size(), {OUT_OF_FREE_SPACE, 0});
+        std::vector<double> latencies;
+        size_t failed = 0;
+        for (size_t i = 0; i < trace.size(); i++)
+        {
+            const trace_op &op = trace[i];
+            if (op.allocate)
+            {
+                auto start = std::chrono::steady_clock::now();
+                size_t first_block = bmap.getFreeBlock(op.blocks);
+                latencies.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+                if (first_block == OUT_OF_FREE_SPACE)
+                    failed++;
+                else
+                {
+                    bmap.writeBits(first_block, op.blocks, 1);
+                    placed[op.id] = {first_block, op.blocks};
+                }
+            }
+            else if (placed[op.id].first != OUT_OF_FREE_SPACE)
+            {
+                bmap.writeBits(placed[op.id].first, placed[op.id].second, 0);
+                placed[op.id].first = OUT_OF_FREE_SPACE;
+            }
+
+            if ((i + 1) % (trace.size() / 4) == 0 || i + 1 == trace.size())
+            {
+                fragmentation_report report = makeFragmentationReport(bmap.getExtentIndex());
+                std::cout << "alloc-policy policy=" << ALLOC_POLICY_NAMES[p] << " ops=" << i + 1
+                          << " free_extents=" << report.free_extents << " largest_free=" << report.largest_extent
+                          << " fragmentation_pct=" << 100 * externalFragmentation(report) << " failed=" << failed << std::endl;
+            }
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        double total_ns = 0;
+        for (double ns : latencies)
+            total_ns += ns;
+        std::cout << "alloc-policy policy=" << ALLOC_POLICY_NAMES[p] << " allocations=" << latencies.size()
+                  << " mean_ns=" << total_ns / std::max((size_t)1, latencies.size())
+                  << " p99_ns=" << (latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100]) << std::endl;
+    }
+    return 0;
+}
+
+// skewed random 4 KiB reads and writes over the data area of an image: pread/pwrite on every
+// access against the block cache at several budgets, with its hit ratio
+int benchBlockCache(size_t image_mb, size_t operations)
+{
+    const char *image_name = "cab_bench_image.tmp";
+    const size_t io_size = 4 << 10;
+    int image_fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (image_fd < 0 || ftruncate(image_fd, image_mb << 20) < 0 || !formatImage(image_name, FORMAT_FAST, 1))
+    {
+        std::cout << "could not create " << image_name << std::endl;
+        return 1;
+    }
+    close(image_fd);
+    CabImage image;
+    image.open(image_name, true);
+
+    // 80% of the accesses go to 20% of the image
+    std::mt19937_64 rng(42);
+    size_t data_start = image.metadataEnd();
+    size_t slots = (image.size() - data_start) / io_size;
+    std::vector<size_t> offsets(operations);
+    for (size_t &offset : offsets)
+        offset = data_start + (rng() % 5 != 0 ? rng() % (slots / 5) : rng() % slots) * io_size;
+    std::vector<char> data(io_size, 1);
+
+    for (int writing = 0; writing <= 1; writing++)
+    {
+        const char *mode = writing ? "write" : "read";
+        auto start = std::chrono::steady_clock::now();
+        for (size_t offset : offsets)
+        {
+            if (writing)
+                pwrite(image.fd(), data.data(), io_size, offset);
+            else
+                pread(image.fd(), data.data(), io_size, offset);
+        }
+        fdatasync(image.fd());
+        double direct_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / operations;
+        std::cout << "block-cache mode=" << mode << " budget_mb=0 ns_per_op=" << direct_ns << std::endl;
+
+        for (size_t budget_mb : {1, 8, 64})
+        {
+            BlockCache cache(image, budget_mb << 20);
+            start = std::chrono::steady_clock::now();
+            for (size_t offset : offsets)
+            {
+                if (writing)
+                    cache.write(offset, data.data(), io_size);
+                else
+                    cache.read(offset, data.data(), io_size);
+            }
+            cache.flush();
+            double cached_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / operations;
+            std::cout << "block-cache mode=" << mode << " budget_mb=" << budget_mb << " ns_per_op=" << cached_ns
+                      << " hit_ratio=" << (double)cache.hits / (cache.hits + cache.misses) << " evictions=" << cache.evictions
+                      << " writebacks=" << cache.writebacks << " speedup=" << direct_ns / cached_ns << std::endl;
+        }
+    }
+    image.close();
+    unlink(image_name);
+    return 0;
+}
+
+// what a one-shot tool pays before its first request: map the image, build the extent
+// index and the root directory index, resolve one path
+double cliOpenMicroseconds(const char *image_name, size_t repetitions)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repetitions; i++)
+    {
+        CabImage image;
+        image.open(image_name, false);
+        BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+        bmap.buildExtentIndex();
+        DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+        PathResolver resolver(image, dir_index);
+        resolver.lookup("c0/k0");
+    }
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / repetitions;
+}
+
+// load generator for cabd: an in-process server, `clients` connections each issuing half
+// puts and half gets of object_bytes objects over its own 64 keys, with 1 and with 16
+// requests in flight per connection; ops/s and latency percentiles from send to response
+int benchDaemon(size_t clients, size_t operations, size_t object_bytes)
+{
+    const char *image_name = "cab_bench_image.tmp";
+    const char *socket_path = "cab_bench.sock";
+    const size_t keys = 64;
+    int image_fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    size_t image_bytes = std::max((size_t)64 << 20, clients * keys * object_bytes * 4);
+    if (image_fd < 0 || ftruncate(image_fd, image_bytes) < 0 || !formatImage(image_name, FORMAT_FAST, 1))
+    {
+        std::cout << "could not create " << image_name << std::endl;
+        return 1;
+    }
+    close(image_fd);
+
+    CabServer server;
+    if (!server.listen(socket_path))
+    {
+        std::cout << "could not listen on " << socket_path << std::endl;
+        return 1;
+    }
+    std::thread server_thread([&]() { server.run(); });
+
+    std::vector<char> object(object_bytes, 'x');
+    bool failed = false;
+    for (size_t depth : {1, 16})
+    {
+        std::vector<std::vector<double>> latencies(clients);
+        std::atomic<bool> client_failed(false);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (size_t c = 0; c < clients; c++)
+        {
+            workers.emplace_back([&, c]() {
+                CabClient client;
+                uint32_t image = 0;
+                if (!client.connect(socket_path) || !client.openImage(image_name, image))
+                {
+                    client_failed = true;
+                    return;
+                }
+                std::mt19937_64 rng(c);
+                std::string prefix = "c" + std::to_string(c) + "/k";
+                std::deque<std::chrono::steady_clock::time_point> sent;
+                response_header response;
+                std::vector<char> reply;
+                // every key exists before gets are timed
+                for (size_t k = 0; k < keys; k++)
+                {
+                    if (!client.call(CAB_OP_PUT, image, prefix + std::to_string(k), object.data(), object.size(), response, reply))
+                        client_failed = true;
+                }
+                size_t per_client = operations / clients;
+                for (size_t done = 0; done < per_client;)
+                {
+                    while (sent.size() < depth && done + sent.size() < per_client)
+                    {
+                        std::string key = prefix + std::to_string(rng() % keys);
+                        bool put = rng() % 2 == 0;
+                        sent.push_back(std::chrono::steady_clock::now());
+                        if (!client.send(put ? CAB_OP_PUT : CAB_OP_GET, image, key, object.data(), put ? object.size() : 0))
+                        {
+                            client_failed = true;
+                            return;
+                        }
+                    }
+                    if (!client.receive(response, reply) || response.status != CAB_OK)
+                    {
+                        client_failed = true;
+                        return;
+                    }
+                    latencies[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent.front()).count());
+                    sent.pop_front();
+                    done++;
+                }
+            });
+        }
+        for (std::thread &worker : workers)
+            worker.join();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (client_failed)
+        {
+            failed = true;
+            break;
+        }
+
+        std::vector<double> all;
+        for (auto &client_latencies : latencies)
+            all.insert(all.end(), client_latencies.begin(), client_latencies.end());
+        std::sort(all.begin(), all.end());
+        auto percentile = [&](double p) { return all.empty() ? 0.0 : all[std::min(all.size() - 1, (size_t)(p * all.size()))]; };
+        std::cout << "daemon-load clients=" << clients << " depth=" << depth << " object_bytes=" << object_bytes
+                  << " ops=" << all.size() << " ops_per_s=" << all.size() / elapsed << " p50_us=" << percentile(0.50)
+                  << " p99_us=" << percentile(0.99) << " p999_us=" << percentile(0.999) << std::endl;
+    }
+    std::cout << "daemon-load requests=" << server.requests << " commits=" << server.commits
+              << " cli_open_us=" << cliOpenMicroseconds(image_name, 20) << std::endl;
+
+    server.stop();
+    server_thread.join();
+    server.close();
+    unlink(image_name);
+    if (failed)
+        std::cout << "a client lost its connection or got an error" << std::endl;
+    return failed ? 1 : 0;
+}
+
+void printUsage(const char *program)
+{
+    std::cout << "usage: " << program << " [--json] <benchmark> [arguments]\n"
+              << "       " << program << " first-block [total_blocks] [iterations]\n"
+              << "       " << program << " extent-index [total_blocks] [operations]\n"
+              << "       " << program << " copy [file_mb]\n"
+              << "       " << program << " format [max_image_mb]\n"
+              << "       " << program << " dir-lookup [lookups]\n"
+              << "       " << program << " path-lookup [lookups]\n"
+              << "       " << program << " import [small_files] [large_mb]\n"
+              << "       " << program << " block-io [small_files] [large_mb]\n"
+              << "       " << program << " group-commit [small_files]\n"
+              << "       " << program << " block-size [image_mb] [small_files] [large_mb]\n"
+              << "       " << program << " alloc-policy [total_blocks] [operations]\n"
+              << "       " << program << " block-cache [image_mb] [operations]\n"
+              << "       " << program << " daemon-load [clients] [operations] [object_bytes]\n"
+              << "       " << program << " extract [small_files] [large_mb]\n"
+              << "       " << program << " compress [files] [file_kb]\n"
+              << "       " << program << " dedup [files] [file_kb] [duplicate_percent]\n"
+              << "       " << program << " pack [files] [max_file_bytes] [block_size]\n"
+              << "       " << program << " split [image_mb] [file_mb]\n"
+              << "       " << program << " range-read [file_mb] [reads]\n"
+              << "       " << program << " stream [file_mb]\n"
+              << "       " << program << " suite\n"
+              << "  --json   print the results as one JSON document instead of text lines\n";
+}
+
+// the benchmarks of `suite`: format, import, allocation, lookup, extraction, compression, dedup,
+// packing, split files and range reads, at sizes that finish in a minute or two
+int runSuite()
+{
+    int result = 0;
+    result |= benchFormat(1024);
+    result |= benchImport(2000, 256);
+    result |= benchFirstBlock(1 << 22, 20);
+    result |= benchDirLookup(100000);
+    result |= benchPathLookup(20000);
+    result |= benchExtract(2000, 256);
+    if (compressionAvailable())
+        result |= benchCompress(64, 1024);
+    result |= benchDedup(2000, 64, 50);
+    result |= benchPack(20000, DEFAULT_BLOCK_SIZE / 4, DEFAULT_BLOCK_SIZE);
+    result |= benchSplit(256, 8);
+    result |= benchRangeRead(64, 20000);
+    result |= benchStream(256);
+    return result;
+}
+
+// runs the benchmark named by argv[1] with the arguments after it; -1 for an unknown name
+int runBenchmark(int argc, const char **argv)
+{
+    std::string benchmark = argv[1];
+    // every argument after the name is a size or a count, std::stoull below cannot throw
+    for (int i = 2; i < argc; i++)
+    {
+        uint64_t value;
+        if (!parseNumber(argv[i], value))
+            return -1;
+    }
+    if (benchmark == "first-block")
+    {
+        size_t total_blocks = argc > 2 ? std::stoull(argv[2]) : 1 << 22;
+        size_t iterations = argc > 3 ? std::stoull(argv[3]) : 20;
+        return benchFirstBlock(total_blocks, iterations);
+    }
+    if (benchmark == "extent-index")
+    {
+        size_t total_blocks = argc > 2 ? std::stoull(argv[2]) : 1 << 22;
+        size_t operations = argc > 3 ? std::stoull(argv[3]) : 20000;
+        return benchExtentIndex(total_blocks, operations);
+    }
+    if (benchmark == "copy")
+        return benchCopy(argc > 2 ? std::stoull(argv[2]) : 256);
+    if (benchmark == "format")
+        return benchFormat(argc > 2 ? std::stoull(argv[2]) : 1024);
+    if (benchmark == "dir-lookup")
+        return benchDirLookup(argc > 2 ? std::stoull(argv[2]) : 100000);
+    if (benchmark == "path-lookup")
+        return benchPathLookup(argc > 2 ? std::stoull(argv[2]) : 20000);
+    if (benchmark == "import")
+        return benchImport(argc > 2 ? std::stoull(argv[2]) : 2000, argc > 3 ? std::stoull(argv[3]) : 256);
+    if (benchmark == "block-io")
+        return benchBlockIO(argc > 2 ? std::stoull(argv[2]) : 2000, argc > 3 ? std::stoull(argv[3]) : 256);
+    if (benchmark == "group-commit")
+        return benchGroupCommit(argc > 2 ? std::stoull(argv[2]) : 2000);
+    if (benchmark == "block-size")
+        return benchBlockSize(argc > 2 ? std::stoull(argv[2]) : 4096, argc > 3 ? std::stoull(argv[3]) : 2000,
+                              argc > 4 ? std::stoull(argv[4]) : 256);
+    if (benchmark == "alloc-policy")
+        return benchAllocPolicy(argc > 2 ? std::stoull(argv[2]) : 1 << 20, argc > 3 ? std::stoull(argv[3]) : 200000);
+    if (benchmark == "block-cache")
+        return benchBlockCache(argc > 2 ? std::stoull(argv[2]) : 256, argc > 3 ? std::stoull(argv[3]) : 200000);
+    if (benchmark == "daemon-load")
+        return benchDaemon(argc > 2 ? std::stoull(argv[2]) : 4, argc > 3 ? std::stoull(argv[3]) : 40000,
+                           argc > 4 ? std::stoull(argv[4]) : 4096);
+    if (benchmark == "extract")
+        return benchExtract(argc > 2 ? std::stoull(argv[2]) : 2000, argc > 3 ? std::stoull(argv[3]) : 256);
+    if (benchmark == "compress")
+        return benchCompress(argc > 2 ? std::stoull(argv[2]) : 64, argc > 3 ? std::stoull(argv[3]) : 1024);
+    if (benchmark == "dedup")
+        return benchDedup(argc > 2 ? std::stoull(argv[2]) : 2000, argc > 3 ? std::stoull(argv[3]) : 64,
+                          argc > 4 ? std::stoull(argv[4]) : 50);
+    if (benchmark == "pack")
+        return benchPack(argc > 2 ? std::stoull(argv[2]) : 1000000, argc > 3 ? std::stoull(argv[3]) : DEFAULT_BLOCK_SIZE / 4,
+                         argc > 4 ? std::stoull(argv[4]) : DEFAULT_BLOCK_SIZE);
+    if (benchmark == "split")
+        return benchSplit(argc > 2 ? std::stoull(argv[2]) : 256, argc > 3 ? std::stoull(argv[3]) : 8);
+    if (benchmark == "range-read")
+        return benchRangeRead(argc > 2 ? std::stoull(argv[2]) : 256, argc > 3 ? std::stoull(argv[3]) : 100000);
+    if (benchmark == "stream")
+        return benchStream(argc > 2 ? std::stoull(argv[2]) : 1024);
+    if (benchmark == "suite")
+        return runSuite();
+    return -1;
+}
+
+std::string jsonString(const std::string &text)
+{
+    std::string quoted = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else
+            quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// a value that parses as a finite number in full is written as a JSON number, anything
+// else as a string
+std::string jsonValue(const std::string &value)
+{
+    char *end = nullptr;
+    double number = strtod(value.c_str(), &end);
+    if (value.empty() || *end != '\0' || !std::isfinite(number))
+        return jsonString(value);
+    std::ostringstream out;
+    out << std::setprecision(15) << number;
+    return out.str();
+}
+
+// the text output of a run as JSON: each "name key=value ..." line becomes a result object
+// (a bare word becomes a true flag), every other line (errors, MISMATCH reports) a message
+void printJson(const std::string &benchmark, int status, const std::string &output)
+{
+    std::vector<std::string> results, messages;
+    std::istringstream lines(output);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        std::istringstream words(line);
+        std::string name, word;
+        if (!(words >> name))
+            continue;
+        std::string result = "{\"benchmark\":" + jsonString(name);
+        bool has_values = false;
+        while (words >> word)
+        {
+            size_t equals = word.find('=');
+            if (equals == std::string::npos || equals == 0)
+                result += "," + jsonString(word) + ":true";
+            else
+            {
+                result += "," + jsonString(word.substr(0, equals)) + ":" + jsonValue(word.substr(equals + 1));
+                has_values = true;
+            }
+        }
+        if (has_values && name.find('=') == std::string::npos && name != "MISMATCH")
+            results.push_back(result + "}");
+        else
+            messages.push_back(jsonString(line));
+    }
+
+    std::cout << "{\"benchmark\":" << jsonString(benchmark) << ",\"status\":" << status << ",\n \"results\":[";
+    for (size_t i = 0; i < results.size(); i++)
+        std::cout << (i == 0 ? "\n  " : ",\n  ") << results[i];
+    std::cout << "],\n \"messages\":[";
+    for (size_t i = 0; i < messages.size(); i++)
+        std::cout << (i == 0 ? "" : ",") << messages[i];
+    std::cout << "]}" << std::endl;
+}
+
+int main(int argc, const char **argv)
+{
+    const char *program = argv[0];
+    bool json = argc > 1 && std::string(argv[1]) == "--json";
+    if (json)
+    {
+        argc--;
+        argv++;
+    }
+    if (argc < 2)
+    {
+        printUsage(program);
+        return 1;
+    }
+
+    // in JSON mode the benchmark's text lines are collected and converted at the end
+    std::ostringstream captured;
+    std::streambuf *console = json ? std::cout.rdbuf(captured.rdbuf()) : nullptr;
+    int status = runBenchmark(argc, argv);
+    if (json)
+        std::cout.rdbuf(console);
+
+    if (status < 0)
+    {
+        printUsage(program);
+        return 1;
+    }
+    if (json)
+        printJson(argv[1], status, captured.str());
+    return status;
+}
@@ -0,0 +1,391 @@
+#ifndef CAB_BLOCKIO_HPP
+#define CAB_BLOCKIO_HPP
+
+// block I/O backends for the image data area: plain pread/pwrite, or io_uring with the
+// copies of many files batched into one submission. The metadata stays on the mapping
+
+#include <memory>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "cab_fs.hpp"
+#include "cab_copy.hpp"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define CAB_HAVE_IO_URING 1
+#endif
+#endif
+
+const size_t BLOCK_IO_BUFFERS = 64;
+const size_t BLOCK_IO_BUFFER_SIZE = 256 << 10;
+
+enum block_io_backend
+{
+    BLOCK_IO_POSIX, // one pread and one pwrite per chunk, as they are queued
+    BLOCK_IO_URING  // linked read + write per chunk, submitted together on wait()
+};
+
+// a set of aligned buffers and the image opened for writing, optionally with O_DIRECT.
+// Queued copies may run at any time until wait() returns; a buffer given to a copy can
+// only be reused after that, and a failed copy clears the caller's status flag
+class BlockIO
+{
+public:
+    BlockIO() {}
+
+    virtual ~BlockIO()
+    {
+        free(buffers);
+        if (image_fd >= 0)
+            ::close(image_fd);
+        if (buffered_fd >= 0 && buffered_fd != image_fd)
+            ::close(buffered_fd);
+    }
+
+    BlockIO(const BlockIO &) = delete;
+    BlockIO &operator=(const BlockIO &) = delete;
+
+    virtual const char *name() = 0;
+
+    // a buffer holds at least one block, so every chunk but a file's last is whole blocks
+    bool open(const std::string &image_name, bool direct, size_t block_size)
+    {
+        this->direct = direct;
+        this->block_size = block_size;
+        buffer_size = std::max(BLOCK_IO_BUFFER_SIZE, block_size);
+        buffered_fd = ::open(image_name.c_str(), O_WRONLY);
+        image_fd = direct ? ::open(image_name.c_str(), O_WRONLY | O_DIRECT) : buffered_fd;
+        if (posix_memalign((void **)&buffers, COPY_BUFFER_ALIGNMENT, BLOCK_IO_BUFFERS * buffer_size) != 0)
+            buffers = nullptr;
+        return buffered_fd >= 0 && image_fd >= 0 && buffers != nullptr && setup();
+    }
+
+    size_t bufferCount()
+    {
+        return BLOCK_IO_BUFFERS;
+    }
+
+    size_t bufferSize()
+    {
+        return buffer_size;
+    }
+
+    bool isDirect()
+    {
+        return direct;
+    }
+
+    // queues length (<= bufferSize()) bytes of in_fd at in_offset into the image at image_offset
+    virtual void copyIn(int in_fd, off_t in_offset, off_t image_offset, size_t length, size_t buffer_index, bool *status) = 0;
+
+    // returns once every queued copy has finished
+    virtual void wait() = 0;
+
+protected:
+    int image_fd = -1;
+    int buffered_fd = -1;
+    bool direct = false;
+    size_t block_size = 1;
+    size_t buffer_size = BLOCK_IO_BUFFER_SIZE;
+    char *buffers = nullptr;
+
+    virtual bool setup()
+    {
+        return true;
+    }
+
+    char *buffer(size_t index)
+    {
+        return buffers + index * buffer_size;
+    }
+
+    // bytes actually written for a chunk. With O_DIRECT only a file's last chunk can end
+    // inside a block: it is padded with zeros to the end of that block, which is still the
+    // file's own, and never past the buffer
+    size_t writeLength(size_t length, size_t buffer_index)
+    {
+        if (!direct || length % block_size == 0)
+            return length;
+        size_t rounded = std::min((length + block_size - 1) / block_size * block_size, buffer_size);
+        memset(buffer(buffer_index) + length, 0, rounded - length);
+        return rounded;
+    }
+
+    // the rest of a write the direct descriptor refused (unaligned for this file system) or
+    // cut short, finished through the page cache
+    bool finishWrite(const char *data, size_t length, off_t offset, size_t done)
+    {
+        return writeAll(buffered_fd, data + done, length - done, offset + done);
+    }
+};
+
+class PosixBlockIO : public BlockIO
+{
+public:
+    const char *name()
+    {
+        return "posix";
+    }
+
+    void copyIn(int in_fd, off_t in_offset, off_t image_offset, size_t length, size_t buffer_index, bool *status)
+    {
+        char *data = buffer(buffer_index);
+        size_t done = 0;
+        while (done < length)
+        {
+            ssize_t n = pread(in_fd, data + done, length - done, in_offset + done);
+            CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                *status = false;
+                return;
+            }
+            CAB_STAT_COUNT(STAT_BYTES_READ, n);
+            done += n;
+        }
+        size_t write_length = writeLength(length, buffer_index);
+        if (!writeAll(image_fd, data, write_length, image_offset) && !finishWrite(data, length, image_offset, 0))
+            *status = false;
+    }
+
+    void wait() {}
+};
+
+#if defined(CAB_HAVE_IO_URING)
+
+class UringBlockIO : public BlockIO
+{
+public:
+    ~UringBlockIO()
+    {
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_size);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        if (ring_fd >= 0)
+            ::close(ring_fd);
+    }
+
+    const char *name()
+    {
+        return "io_uring";
+    }
+
+    void copyIn(int in_fd, off_t in_offset, off_t image_offset, size_t length, size_t buffer_index, bool *status)
+    {
+        // both halves of the pair have to be in the same submission for the link to hold
+        while (params.sq_entries - queued() < 2 || free_ops.size() < 2)
+            submit(in_flight > pending_submit ? 1 : 0);
+
+        size_t read_op = newOp(false, buffer(buffer_index), length, image_offset, status);
+        io_uring_sqe *read_sqe = nextSqe();
+        prepare(read_sqe, IORING_OP_READ_FIXED, in_fd, buffer_index, length, in_offset, read_op);
+        read_sqe->flags |= IOSQE_IO_LINK;
+
+        size_t write_length = writeLength(length, buffer_index);
+        size_t write_op = newOp(true, buffer(buffer_index), length, image_offset, status);
+        prepare(nextSqe(), IORING_OP_WRITE_FIXED, image_fd, buffer_index, write_length, image_offset, write_op);
+    }
+
+    void wait()
+    {
+        while (in_flight > 0)
+            submit(1);
+    }
+
+protected:
+    bool setup()
+    {
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, 2 * BLOCK_IO_BUFFERS, &params);
+        if (ring_fd < 0)
+            return false;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+            return false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ring = sq_ring;
+        else
+            cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+            return false;
+
+        sq_head = (unsigned *)((char *)sq_ring + params.sq_off.head);
+        sq_tail = (unsigned *)((char *)sq_ring + params.sq_off.tail);
+        sq_array = (unsigned *)((char *)sq_ring + params.sq_off.array);
+        cq_head = (unsigned *)((char *)cq_ring + params.cq_off.head);
+        cq_tail = (unsigned *)((char *)cq_ring + params.cq_off.tail);
+        cqes = (io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+        ops.resize(params.sq_entries);
+        for (size_t i = 0; i < ops.size(); i++)
+            free_ops.push_back(i);
+
+        // the buffers are pinned once so the kernel does not map them on every request
+        std::vector<iovec> iovecs(BLOCK_IO_BUFFERS);
+        for (size_t i = 0; i < iovecs.size(); i++)
+            iovecs[i] = {buffer(i), buffer_size};
+        return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), iovecs.size()) == 0;
+    }
+
+private:
+    typedef struct pending_op
+    {
+        bool is_write;
+        char *data;
+        size_t length;
+        off_t offset;
+        bool *status;
+    } pending_op;
+
+    int ring_fd = -1;
+    io_uring_params params;
+    void *sq_ring = MAP_FAILED;
+    void *cq_ring = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    std::vector<pending_op> ops;
+    std::vector<size_t> free_ops;
+    unsigned pending_submit = 0; // in the submission ring, not yet handed to the kernel
+    unsigned in_flight = 0;      // queued and not yet completed
+
+    unsigned queued()
+    {
+        return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    size_t newOp(bool is_write, char *data, size_t length, off_t offset, bool *status)
+    {
+        size_t op = free_ops.back();
+        free_ops.pop_back();
+        ops[op] = {is_write, data, length, offset, status};
+        return op;
+    }
+
+    io_uring_sqe *nextSqe()
+    {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *(unsigned *)((char *)sq_ring + params.sq_off.ring_mask);
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        pending_submit++;
+        in_flight++;
+        return &((io_uring_sqe *)sqes)[index];
+    }
+
+    void prepare(io_uring_sqe *sqe, unsigned char opcode, int fd, size_t buffer_index, size_t length, off_t offset, size_t op)
+    {
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long)buffer(buffer_index);
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->buf_index = buffer_index;
+        sqe->user_data = op;
+    }
+
+    // hands the queued requests to the kernel, waits for at least min_complete, then reaps
+    void submit(unsigned min_complete)
+    {
+        for (;;)
+        {
+            long n = syscall(__NR_io_uring_enter, ring_fd, pending_submit, min_complete,
+                             min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+            if (n >= 0)
+            {
+                pending_submit -= n;
+                break;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                // the ring is unusable: fail what is left instead of waiting forever
+                reap();
+                for (size_t op = 0; op < ops.size(); op++)
+                {
+                    if (std::find(free_ops.begin(), free_ops.end(), op) == free_ops.end())
+                    {
+                        *ops[op].status = false;
+                        free_ops.push_back(op);
+                    }
+                }
+                in_flight = pending_submit = 0;
+                return;
+            }
+        }
+        reap();
+    }
+
+    void reap()
+    {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned mask = *(unsigned *)((char *)cq_ring + params.cq_off.ring_mask);
+        for (; head != tail; head++)
+        {
+            const io_uring_cqe &cqe = cqes[head & mask];
+            complete(ops[cqe.user_data], cqe.res);
+            free_ops.push_back(cqe.user_data);
+            in_flight--;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    void complete(const pending_op &op, int result)
+    {
+        if (!op.is_write)
+        {
+            if (result != (int)op.length)
+                *op.status = false;
+            CAB_STAT_COUNT(STAT_BYTES_READ, result > 0 ? result : 0);
+            return;
+        }
+        // a write cancelled by its failed read already has the status cleared
+        if (result == -ECANCELED)
+            return;
+        size_t done = result > 0 ? std::min((size_t)result, op.length) : 0;
+        CAB_STAT_COUNT(STAT_BYTES_WRITTEN, done);
+        if (done < op.length && !finishWrite(op.data, op.length, op.offset, done))
+            *op.status = false;
+    }
+};
+
+#endif
+
+// nullptr when the backend is not available on this system (or this kernel)
+inline std::unique_ptr<BlockIO> openBlockIO(const std::string &image_name, block_io_backend backend, bool direct, size_t block_size)
+{
+    std::unique_ptr<BlockIO> io;
+    if (backend == BLOCK_IO_POSIX)
+        io.reset(new PosixBlockIO());
+#if defined(CAB_HAVE_IO_URING)
+    else if (backend == BLOCK_IO_URING)
+        io.reset(new UringBlockIO());
+#endif
+    if (io && !io->open(image_name, direct, block_size))
+        io.reset();
+    return io;
+}
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef CAB_CACHE_HPP
+#define CAB_CACHE_HPP
+
+// write-back cache of image blocks for long-lived handles. The metadata is read once through
+// the mapping; this caches file data read and written with pread/pwrite on the image, within
+// a fixed memory budget. Writes stay in memory until evicted or flushed
+
+#include <list>
+#include <unordered_map>
+
+#include "cab_fs.hpp"
+#include "cab_image.hpp"
+#include "cab_copy.hpp"
+
+const size_t DEFAULT_BLOCK_CACHE_BUDGET = 64 << 20;
+
+class BlockCache
+{
+public:
+    // budget_bytes is rounded down to whole blocks, at least one
+    BlockCache(CabImage &image, size_t budget_bytes = DEFAULT_BLOCK_CACHE_BUDGET)
+        : image(image), block_size(image.blockSize())
+    {
+        capacity = std::max((size_t)1, budget_bytes / block_size);
+        slab.resize(capacity * block_size);
+        for (size_t slot = capacity; slot > 0; slot--)
+            free_slots.push_back(slot - 1);
+    }
+
+    ~BlockCache()
+    {
+        flush();
+    }
+
+    BlockCache(const BlockCache &) = delete;
+    BlockCache &operator=(const BlockCache &) = delete;
+
+    // bytes [offset, offset + length) of the image, block by block through the cache
+    bool read(size_t offset, void *data, size_t length)
+    {
+        if (offset + length > image.size())
+            return false;
+        for (size_t done = 0; done < length;)
+        {
+            size_t block = (offset + done) / block_size;
+            size_t in_block = (offset + done) % block_size;
+            size_t chunk = std::min(block_size - in_block, length - done);
+            char *cached = blockData(block, true);
+            if (cached == nullptr)
+                return false;
+            memcpy((char *)data + done, cached + in_block, chunk);
+            done += chunk;
+        }
+        return true;
+    }
+
+    // whole blocks are overwritten without being read first
+    bool write(size_t offset, const void *data, size_t length)
+    {
+        if (offset + length > image.size())
+            return false;
+        for (size_t done = 0; done < length;)
+        {
+            size_t block = (offset + done) / block_size;
+            size_t in_block = (offset + done) % block_size;
+            size_t chunk = std::min(block_size - in_block, length - done);
+            char *cached = blockData(block, chunk != block_size);
+            if (cached == nullptr)
+                return false;
+            memcpy(cached + in_block, (const char *)data + done, chunk);
+            by_block[block]->dirty = true;
+            done += chunk;
+        }
+        return true;
+    }
+
+    // writes the dirty blocks back in address order and syncs the image, unless the caller
+    // syncs it next anyway
+    bool flush(bool sync = true)
+    {
+        std::vector<std::pair<size_t, cache_entry *>> dirty;
+        for (cache_entry &entry : recent)
+        {
+            if (entry.dirty)
+                dirty.push_back({entry.block, &entry});
+        }
+        if (dirty.empty())
+            return true;
+        std::sort(dirty.begin(), dirty.end());
+        bool ok = true;
+        for (auto &d : dirty)
+            ok = writeBack(*d.second) && ok;
+        if (sync)
+            CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+        return (!sync || fdatasync(image.fd()) == 0) && ok;
+    }
+
+    // forgets [first_block, first_block + blocks) without writing it back: freed or moved blocks
+    void invalidate(size_t first_block, size_t blocks)
+    {
+        if (blocks > by_block.size())
+        {
+            for (auto it = recent.begin(); it != recent.end();)
+                it = it->block >= first_block && it->block < first_block + blocks ? drop(it) : std::next(it);
+            return;
+        }
+        for (size_t block = first_block; block < first_block + blocks; block++)
+        {
+            auto it = by_block.find(block);
+            if (it != by_block.end())
+                drop(it->second);
+        }
+    }
+
+    size_t capacityBlocks()
+    {
+        return capacity;
+    }
+
+    size_t cachedBlocks()
+    {
+        return by_block.size();
+    }
+
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t writebacks = 0;
+
+private:
+    typedef struct cache_entry
+    {
+        size_t block;
+        size_t slot;
+        bool dirty;
+    } cache_entry;
+
+    CabImage &image;
+    size_t block_size;
+    size_t capacity;
+    std::vector<char> slab;
+    std::vector<size_t> free_slots;
+    std::list<cache_entry> recent; // most recently used first
+    std::unordered_map<size_t, std::list<cache_entry>::iterator> by_block;
+
+    char *slotData(size_t slot)
+    {
+        return slab.data() + slot * block_size;
+    }
+
+    bool writeBack(cache_entry &entry)
+    {
+        CAB_STAT_PHASE(PHASE_COPY_DATA);
+        size_t length = std::min(block_size, image.size() - entry.block * block_size);
+        if (!writeAll(image.fd(), slotData(entry.slot), length, entry.block * block_size))
+            return false;
+        entry.dirty = false;
+        writebacks++;
+        return true;
+    }
+
+    std::list<cache_entry>::iterator drop(std::list<cache_entry>::iterator it)
+    {
+        free_slots.push_back(it->slot);
+        by_block.erase(it->block);
+        return recent.erase(it);
+    }
+
+    // the cached copy of block, loaded from the image on a miss if fill; nullptr if the block
+    // cannot be read, or a dirty victim cannot be written back
+    char *blockData(size_t block, bool fill)
+    {
+        auto it = by_block.find(block);
+        if (it != by_block.end())
+        {
+            hits++;
+            CAB_STAT_COUNT(STAT_CACHE_HITS, 1);
+            recent.splice(recent.begin(), recent, it->second);
+            return slotData(it->second->slot);
+        }
+        misses++;
+        CAB_STAT_COUNT(STAT_CACHE_MISSES, 1);
+
+        if (free_slots.empty())
+        {
+            cache_entry &victim = recent.back();
+            if (victim.dirty && !writeBack(victim))
+                return nullptr;
+            evictions++;
+            drop(std::prev(recent.end()));
+        }
+        size_t slot = free_slots.back();
+        if (fill)
+        {
+            CAB_STAT_PHASE(PHASE_COPY_DATA);
+            size_t length = std::min(block_size, image.size() - block * block_size);
+            for (size_t done = 0; done < length;)
+            {
+                ssize_t n = pread(image.fd(), slotData(slot) + done, length - done, block * block_size + done);
+                CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return nullptr;
+                CAB_STAT_COUNT(STAT_BYTES_READ, n);
+                done += n;
+            }
+        }
+        free_slots.pop_back();
+        recent.push_front({block, slot, false});
+        by_block[block] = recent.begin();
+        return slotData(slot);
+    }
+};
+
+#endif
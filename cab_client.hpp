@@ -0,0 +1,115 @@
+#ifndef CAB_CLIENT_HPP
+#define CAB_CLIENT_HPP
+
+// client side of the cabd protocol. send* only queue a request, receive reads the oldest
+// outstanding response, so callers keep several requests in flight; call does one round trip
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <sys/sendfile.h>
+
+#include "cab_proto.hpp"
+
+class CabClient
+{
+public:
+    CabClient() {}
+
+    ~CabClient()
+    {
+        close();
+    }
+
+    CabClient(const CabClient &) = delete;
+    CabClient &operator=(const CabClient &) = delete;
+
+    bool connect(const std::string &socket_path)
+    {
+        close();
+        sockaddr_un address;
+        if (!socketAddress(socket_path, address))
+            return false;
+        socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socket_fd < 0 || ::connect(socket_fd, (sockaddr *)&address, sizeof(address)) < 0)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (socket_fd >= 0)
+            ::close(socket_fd);
+        socket_fd = -1;
+    }
+
+    // id of image_name in the daemon, which opens the image if it is not serving it yet.
+    // The name is made absolute here, the daemon runs in another directory
+    bool openImage(const std::string &image_name, uint32_t &image)
+    {
+        char resolved[PATH_MAX];
+        std::string absolute_name = realpath(image_name.c_str(), resolved) != nullptr ? resolved : image_name;
+        response_header response;
+        std::vector<char> payload;
+        if (!call(CAB_OP_OPEN, 0, absolute_name, nullptr, 0, response, payload))
+            return false;
+        if (response.status != CAB_OK || payload.size() != sizeof(uint32_t))
+            return false;
+        memcpy(&image, payload.data(), sizeof(uint32_t));
+        return true;
+    }
+
+    bool send(uint8_t op, uint32_t image, const std::string &path, const void *payload, size_t length)
+    {
+        return sendHeader(op, image, path, length) && sendAll(socket_fd, payload, length);
+    }
+
+    // a put whose payload is length bytes of file_fd from offset 0, sent by the kernel
+    bool sendFile(uint32_t image, const std::string &path, int file_fd, size_t length)
+    {
+        if (!sendHeader(CAB_OP_PUT, image, path, length))
+            return false;
+        off_t offset = 0;
+        while ((size_t)offset < length)
+        {
+            ssize_t n = sendfile(socket_fd, file_fd, &offset, length - offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+        }
+        return true;
+    }
+
+    bool receive(response_header &response, std::vector<char> &payload)
+    {
+        if (!receiveAll(socket_fd, &response, sizeof(response)) || response.payload_length > CAB_PROTO_MAX_PAYLOAD)
+            return false;
+        payload.resize(response.payload_length);
+        return receiveAll(socket_fd, payload.data(), payload.size());
+    }
+
+    bool call(uint8_t op, uint32_t image, const std::string &path, const void *payload, size_t length,
+              response_header &response, std::vector<char> &reply)
+    {
+        return send(op, image, path, payload, length) && receive(response, reply);
+    }
+
+private:
+    int socket_fd = -1;
+    uint32_t next_request = 0;
+
+    bool sendHeader(uint8_t op, uint32_t image, const std::string &path, size_t length)
+    {
+        if (socket_fd < 0 || path.size() > CAB_PROTO_MAX_PATH || length > CAB_PROTO_MAX_PAYLOAD)
+            return false;
+        request_header header = {next_request++, op, 0, (uint16_t)path.size(), image, length};
+        return sendAll(socket_fd, &header, sizeof(header)) && sendAll(socket_fd, path.data(), path.size());
+    }
+};
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef CAB_COMPRESS_HPP
+#define CAB_COMPRESS_HPP
+
+// compressed files (COMPRESSED_TYPE): the extent holds a compressed_header, a table of chunk
+// offsets and the chunks, each deflated on its own so a read only inflates the chunks it
+// touches. A chunk that does not shrink is stored as is. The entry's file_size_in_bytes is
+// the stored size like for any extent, the original size is in the header
+
+#include <atomic>
+#include <thread>
+#include <sys/mman.h>
+
+#include "cab_fs.hpp"
+#include "cab_copy.hpp"
+
+#if __has_include(<zlib.h>) && !defined(CAB_NO_ZLIB)
+#include <zlib.h>
+#define CAB_HAVE_ZLIB
+#endif
+
+const uint32_t COMPRESSED_MAGIC = 0x5a424143; // "CABZ"
+const size_t DEFAULT_COMPRESSION_CHUNK = 64 << 10;
+const size_t MAX_COMPRESSION_CHUNK = 16 << 20;
+
+// first bytes of a compressed extent, followed by n_chunks + 1 offsets from the start of the
+// extent: chunk i is stored in [offset[i], offset[i + 1])
+typedef struct compressed_header
+{
+    uint32_t magic;
+    uint32_t chunk_size;
+    uint64_t file_size; // before compression
+    uint64_t n_chunks;
+} __attribute__((packed)) compressed_header;
+
+inline bool compressionAvailable()
+{
+#if defined(CAB_HAVE_ZLIB)
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline size_t compressedTableBytes(uint64_t n_chunks)
+{
+    return sizeof(compressed_header) + (n_chunks + 1) * sizeof(uint64_t);
+}
+
+// bytes of chunk i once inflated
+inline size_t chunkLength(const compressed_header &header, size_t chunk)
+{
+    return std::min((uint64_t)header.chunk_size, header.file_size - chunk * header.chunk_size);
+}
+
+// deflates size bytes of data in chunk_size chunks, n_threads chunks at a time, into the
+// stored layout above
+inline bool compressBuffer(const char *data, size_t size, size_t chunk_size, unsigned int n_threads, std::vector<char> &stored)
+{
+#if defined(CAB_HAVE_ZLIB)
+    CAB_STAT_PHASE(PHASE_COMPRESS);
+    size_t n_chunks = (size + chunk_size - 1) / chunk_size;
+    std::vector<std::vector<char>> chunks(n_chunks);
+    std::atomic<size_t> next_chunk(0);
+    std::atomic<bool> ok(true);
+    auto deflateChunks = [&]() {
+        for (size_t i = next_chunk++; i < n_chunks; i = next_chunk++)
+        {
+            size_t length = std::min(chunk_size, size - i * chunk_size);
+            uLongf deflated = compressBound(length);
+            chunks[i].resize(deflated);
+            int result = compress2((Bytef *)chunks[i].data(), &deflated, (const Bytef *)data + i * chunk_size, length, Z_BEST_SPEED);
+            if (result == Z_OK && deflated < length)
+                chunks[i].resize(deflated);
+            else if (result == Z_OK || result == Z_BUF_ERROR)
+                chunks[i].assign(data + i * chunk_size, data + i * chunk_size + length);
+            else
+                ok = false;
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < std::min((size_t)n_threads, n_chunks); t++)
+        workers.emplace_back(deflateChunks);
+    deflateChunks();
+    for (std::thread &worker : workers)
+        worker.join();
+    if (!ok)
+        return false;
+
+    compressed_header header = {COMPRESSED_MAGIC, (uint32_t)chunk_size, size, n_chunks};
+    std::vector<uint64_t> offsets(n_chunks + 1);
+    offsets[0] = compressedTableBytes(n_chunks);
+    for (size_t i = 0; i < n_chunks; i++)
+        offsets[i + 1] = offsets[i] + chunks[i].size();
+    stored.resize(offsets[n_chunks]);
+    memcpy(stored.data(), &header, sizeof(header));
+    memcpy(stored.data() + sizeof(header), offsets.data(), offsets.size() * sizeof(uint64_t));
+    for (size_t i = 0; i < n_chunks; i++)
+        memcpy(stored.data() + offsets[i], chunks[i].data(), chunks[i].size());
+    return true;
+#else
+    (void)data, (void)size, (void)chunk_size, (void)n_threads, (void)stored;
+    return false;
+#endif
+}
+
+// compressBuffer over a host file, read through a private mapping
+inline bool compressFile(const std::string &file_name, size_t chunk_size, unsigned int n_threads, std::vector<char> &stored)
+{
+    int file_fd = open(file_name.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (file_fd < 0 || fstat(file_fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+    {
+        if (file_fd >= 0)
+            close(file_fd);
+        return false;
+    }
+    CAB_STAT_COUNT(STAT_SYSCALLS, 3);
+    size_t size = file_stat.st_size;
+    void *data = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file_fd, 0) : nullptr;
+    close(file_fd);
+    if (data == MAP_FAILED)
+        return false;
+    CAB_STAT_COUNT(STAT_BYTES_READ, size);
+    bool compressed = compressBuffer((const char *)data, size, chunk_size, n_threads, stored);
+    if (data != nullptr)
+        munmap(data, size);
+    return compressed;
+}
+
+// header and offsets of a stored compressed file, checked against its stored size
+inline bool readCompressedTable(const char *stored, size_t stored_size, compressed_header &header, std::vector<uint64_t> &offsets)
+{
+    if (stored_size < sizeof(header))
+        return false;
+    memcpy(&header, stored, sizeof(header));
+    if (header.magic != COMPRESSED_MAGIC || header.chunk_size == 0 || header.chunk_size > MAX_COMPRESSION_CHUNK ||
+        header.n_chunks != (header.file_size + header.chunk_size - 1) / header.chunk_size ||
+        header.n_chunks > stored_size / sizeof(uint64_t) || compressedTableBytes(header.n_chunks) > stored_size)
+        return false;
+    offsets.resize(header.n_chunks + 1);
+    memcpy(offsets.data(), stored + sizeof(header), offsets.size() * sizeof(uint64_t));
+    if (offsets[0] != compressedTableBytes(header.n_chunks) || offsets[header.n_chunks] > stored_size)
+        return false;
+    for (size_t i = 0; i < header.n_chunks; i++)
+    {
+        if (offsets[i + 1] <= offsets[i] || offsets[i + 1] - offsets[i] > chunkLength(header, i))
+            return false;
+    }
+    return true;
+}
+
+// inflates chunk i into out, which has room for chunkLength(header, i) bytes
+inline bool inflateChunk(const char *stored, const compressed_header &header, const std::vector<uint64_t> &offsets, size_t chunk, char *out)
+{
+    CAB_STAT_PHASE(PHASE_COMPRESS);
+    size_t length = chunkLength(header, chunk);
+    size_t stored_length = offsets[chunk + 1] - offsets[chunk];
+    if (stored_length == length)
+    {
+        memcpy(out, stored + offsets[chunk], length);
+        return true;
+    }
+#if defined(CAB_HAVE_ZLIB)
+    uLongf inflated = length;
+    return uncompress((Bytef *)out, &inflated, (const Bytef *)stored + offsets[chunk], stored_length) == Z_OK && inflated == length;
+#else
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef CAB_COPY_HPP
+#define CAB_COPY_HPP
+
+// positional, constant-memory copies between a host file and the image
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "cab_stats.hpp"
+
+const size_t DEFAULT_COPY_BUFFER_SIZE = 1 << 20;
+const size_t COPY_BUFFER_ALIGNMENT = 4096;
+
+enum copy_method
+{
+    COPY_AUTO,          // copy_file_range, then sendfile, then buffered
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_BUFFERED
+};
+
+// aligned bounce buffer, allocated once and reused for every file of a run
+class CopyBuffer
+{
+public:
+    CopyBuffer(size_t size = DEFAULT_COPY_BUFFER_SIZE)
+        : size(size)
+    {
+        if (posix_memalign((void **)&data, COPY_BUFFER_ALIGNMENT, size) != 0)
+            data = nullptr;
+    }
+
+    ~CopyBuffer()
+    {
+        free(data);
+    }
+
+    CopyBuffer(const CopyBuffer &) = delete;
+    CopyBuffer &operator=(const CopyBuffer &) = delete;
+
+    char *getData()
+    {
+        return data;
+    }
+
+    size_t getSize()
+    {
+        return size;
+    }
+
+private:
+    char *data = nullptr;
+    size_t size;
+};
+
+// writes length bytes from memory (a buffer or a span of the image mapping) at offset
+inline bool writeAll(int fd, const void *data, size_t length, off_t offset)
+{
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t n = pwrite(fd, (const char *)data + written, length - written, offset + written);
+        CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        CAB_STAT_COUNT(STAT_BYTES_WRITTEN, n);
+        written += n;
+    }
+    return true;
+}
+
+// the kernel refuses the zero-copy calls for some file pairs (different file systems,
+// pipes, old kernels); those errors mean "use the next method", anything else is real
+inline bool copyUnsupported(int error)
+{
+    return error == EXDEV || error == ENOSYS || error == EINVAL || error == EOPNOTSUPP || error == ENOTSUP;
+}
+
+// returns how many bytes were moved before the method gave up (length on success)
+inline size_t copyWithFileRange(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t length)
+{
+    size_t copied = 0;
+    while (copied < length)
+    {
+        ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, length - copied, 0);
+        CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+        if (n <= 0)
+            break;
+        CAB_STAT_COUNT(STAT_BYTES_READ, n);
+        CAB_STAT_COUNT(STAT_BYTES_WRITTEN, n);
+        copied += n;
+    }
+    return copied;
+}
+
+inline size_t copyWithSendfile(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t length)
+{
+    // sendfile writes at the current position of out_fd
+    CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+    if (lseek(out_fd, out_offset, SEEK_SET) < 0)
+        return 0;
+    size_t copied = 0;
+    while (copied < length)
+    {
+        ssize_t n = sendfile(out_fd, in_fd, &in_offset, length - copied);
+        CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+        if (n <= 0)
+            break;
+        CAB_STAT_COUNT(STAT_BYTES_READ, n);
+        CAB_STAT_COUNT(STAT_BYTES_WRITTEN, n);
+        copied += n;
+    }
+    return copied;
+}
+
+inline size_t copyBuffered(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t length, CopyBuffer &buffer)
+{
+    size_t copied = 0;
+    while (copied < length)
+    {
+        size_t chunk = std::min(buffer.getSize(), length - copied);
+        ssize_t n = pread(in_fd, buffer.getData(), chunk, in_offset + copied);
+        CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        CAB_STAT_COUNT(STAT_BYTES_READ, n);
+        size_t written = 0;
+        while (written < (size_t)n)
+        {
+            ssize_t w = pwrite(out_fd, buffer.getData() + written, n - written, out_offset + copied + written);
+            CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return copied + written;
+            CAB_STAT_COUNT(STAT_BYTES_WRITTEN, w);
+            written += w;
+        }
+        copied += n;
+    }
+    return copied;
+}
+
+// copies length bytes from in_fd at in_offset to out_fd at out_offset without ever holding
+// more than one buffer of data in user space; false if the bytes could not all be moved
+inline bool copyRange(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t length, CopyBuffer &buffer, copy_method method = COPY_AUTO)
+{
+    size_t copied = 0;
+
+    if (method == COPY_AUTO || method == COPY_FILE_RANGE)
+    {
+        errno = 0;
+        copied += copyWithFileRange(in_fd, in_offset, out_fd, out_offset, length);
+        if (copied == length)
+            return true;
+        if (method == COPY_FILE_RANGE || (errno != 0 && !copyUnsupported(errno)))
+            return false;
+    }
+
+    if (method == COPY_AUTO || method == COPY_SENDFILE)
+    {
+        errno = 0;
+        copied += copyWithSendfile(in_fd, in_offset + copied, out_fd, out_offset + copied, length - copied);
+        if (copied == length)
+            return true;
+        if (method == COPY_SENDFILE || (errno != 0 && !copyUnsupported(errno)))
+            return false;
+    }
+
+    if (buffer.getData() == nullptr)
+        return false;
+    copied += copyBuffered(in_fd, in_offset + copied, out_fd, out_offset + copied, length - copied, buffer);
+    return copied == length;
+}
+
+#endif
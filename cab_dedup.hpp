@@ -0,0 +1,462 @@
+#ifndef CAB_DEDUP_HPP
+#define CAB_DEDUP_HPP
+
+// whole-file deduplication (cab_file_writer --dedup). A file's stored bytes are hashed in
+// DEDUP_CHUNK_SIZE chunks and the chunk digests hashed again into a fingerprint; a file whose
+// fingerprint, stored size and type match an indexed extent, and whose bytes compare equal,
+// gets an entry pointing at that extent instead of blocks of its own. The index is a table of
+// dedup_records in an extent named by the boot record, each with the number of entries that
+// point at its extent: the blocks go back to the bitmap only when the last one is removed.
+// An extent without a record has exactly one entry, as in an image that never used dedup
+
+#include <atomic>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <sys/mman.h>
+
+#include "cab_fs.hpp"
+#include "cab_image.hpp"
+#include "cab_stats.hpp"
+
+const size_t DEDUP_CHUNK_SIZE = 64 << 10;
+
+typedef struct file_digest
+{
+    uint64_t hash[2];
+} file_digest;
+
+typedef struct dedup_record
+{
+    uint64_t hash[2];
+    uint64_t first_block;
+    uint64_t file_size; // stored bytes, as in the entries
+    uint32_t references;
+    uint8_t file_type;
+    uint8_t reserved[3];
+} __attribute__((packed)) dedup_record;
+
+static_assert(sizeof(dedup_record) == 40, "dedup records are 40 bytes");
+
+// chunk hash: four 64-bit lanes, each taking one word of every 32-byte stripe as
+// acc += lo32(word ^ key) * hi32(word ^ key) + word, scrambled every HASH_SCRAMBLE_STRIPES
+// stripes. Only 32x32-bit products are used, so the AVX2 kernel (_mm256_mul_epu32) computes
+// the same digest as the scalar one
+const size_t HASH_STRIPE = 32;
+const size_t HASH_SCRAMBLE_STRIPES = 16;
+const uint64_t HASH_KEYS[4] = {0xbe4ba423396cfeb8, 0x1cad21f72c81017c, 0xdb979083e96dd4de, 0x1f67b3b7a4a44072};
+const uint64_t HASH_PRIME32 = 0x9e3779b1;
+const uint64_t HASH_PRIME64 = 0xc2b2ae3d27d4eb4f;
+
+inline bool vectorizedHashing()
+{
+#if defined(__AVX2__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline uint64_t hashAvalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= HASH_PRIME64;
+    h ^= h >> 29;
+    h *= 0x165667b19e3779f9;
+    return h ^ (h >> 32);
+}
+
+inline uint64_t hashRotate(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline void hashStripesScalar(uint64_t acc[4], const char *data, size_t n_stripes, bool scramble)
+{
+    for (size_t s = 0; s < n_stripes; s++)
+    {
+        for (int lane = 0; lane < 4; lane++)
+        {
+            uint64_t word;
+            memcpy(&word, data + s * HASH_STRIPE + 8 * lane, 8);
+            uint64_t key = word ^ HASH_KEYS[lane];
+            acc[lane] += (key & 0xffffffff) * (key >> 32) + word;
+        }
+    }
+    if (scramble)
+    {
+        for (int lane = 0; lane < 4; lane++)
+            acc[lane] = (acc[lane] ^ (acc[lane] >> 47) ^ HASH_KEYS[lane]) * HASH_PRIME32;
+    }
+}
+
+#if defined(__AVX2__)
+inline void hashStripesAVX2(uint64_t acc[4], const char *data, size_t n_stripes, bool scramble)
+{
+    const __m256i keys = _mm256_loadu_si256((const __m256i *)HASH_KEYS);
+    __m256i lanes = _mm256_loadu_si256((const __m256i *)acc);
+    for (size_t s = 0; s < n_stripes; s++)
+    {
+        __m256i words = _mm256_loadu_si256((const __m256i *)(data + s * HASH_STRIPE));
+        __m256i key = _mm256_xor_si256(words, keys);
+        __m256i product = _mm256_mul_epu32(key, _mm256_srli_epi64(key, 32));
+        lanes = _mm256_add_epi64(lanes, _mm256_add_epi64(product, words));
+    }
+    if (scramble)
+    {
+        // a 64x32-bit product from two 32x32-bit ones
+        const __m256i prime = _mm256_set1_epi64x(HASH_PRIME32);
+        lanes = _mm256_xor_si256(_mm256_xor_si256(lanes, _mm256_srli_epi64(lanes, 47)), keys);
+        __m256i low = _mm256_mul_epu32(lanes, prime);
+        __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(lanes, 32), prime);
+        lanes = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    }
+    _mm256_storeu_si256((__m256i *)acc, lanes);
+}
+#endif
+
+// digest of length bytes; vectorized picks the AVX2 kernel when the build has it
+inline file_digest hashChunk(const char *data, size_t length, bool vectorized = true)
+{
+    auto hashStripes = hashStripesScalar;
+#if defined(__AVX2__)
+    if (vectorized)
+        hashStripes = hashStripesAVX2;
+#else
+    (void)vectorized;
+#endif
+    uint64_t acc[4] = {HASH_KEYS[0] ^ length, HASH_KEYS[1], HASH_KEYS[2], HASH_KEYS[3]};
+    const size_t block = HASH_STRIPE * HASH_SCRAMBLE_STRIPES;
+    size_t done = 0;
+    for (; done + block <= length; done += block)
+        hashStripes(acc, data + done, HASH_SCRAMBLE_STRIPES, true);
+    size_t full_stripes = (length - done) / HASH_STRIPE;
+    hashStripes(acc, data + done, full_stripes, false);
+    done += full_stripes * HASH_STRIPE;
+    if (done < length)
+    {
+        // the tail, zero padded to a stripe; the length in acc[0] tells the padding apart
+        char last[HASH_STRIPE] = {};
+        memcpy(last, data + done, length - done);
+        hashStripes(acc, last, 1, false);
+    }
+
+    file_digest digest;
+    digest.hash[0] = hashAvalanche(acc[0] ^ hashRotate(acc[1], 21) ^ hashRotate(acc[2], 42) ^ acc[3] * HASH_PRIME32);
+    digest.hash[1] = hashAvalanche(acc[3] ^ hashRotate(acc[2], 21) ^ hashRotate(acc[1], 42) ^ (acc[0] + length) * HASH_PRIME64);
+    return digest;
+}
+
+// fingerprint of size bytes: the DEDUP_CHUNK_SIZE chunks are hashed n_threads at a time, then
+// their digests are hashed together
+inline file_digest digestBuffer(const char *data, size_t size, unsigned int n_threads)
+{
+    CAB_STAT_PHASE(PHASE_DEDUP);
+    size_t n_chunks = (size + DEDUP_CHUNK_SIZE - 1) / DEDUP_CHUNK_SIZE;
+    std::vector<file_digest> chunks(n_chunks);
+    std::atomic<size_t> next_chunk(0);
+    auto hashChunks = [&]() {
+        for (size_t i = next_chunk++; i < n_chunks; i = next_chunk++)
+            chunks[i] = hashChunk(data + i * DEDUP_CHUNK_SIZE, std::min(DEDUP_CHUNK_SIZE, size - i * DEDUP_CHUNK_SIZE));
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < std::min((size_t)n_threads, n_chunks); t++)
+        workers.emplace_back(hashChunks);
+    hashChunks();
+    for (std::thread &worker : workers)
+        worker.join();
+    return hashChunk((const char *)chunks.data(), chunks.size() * sizeof(file_digest));
+}
+
+// digestBuffer over a host file, read through a private mapping
+inline bool digestFile(const std::string &file_name, unsigned int n_threads, file_digest &digest)
+{
+    int file_fd = open(file_name.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (file_fd < 0 || fstat(file_fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+    {
+        if (file_fd >= 0)
+            close(file_fd);
+        return false;
+    }
+    CAB_STAT_COUNT(STAT_SYSCALLS, 3);
+    size_t size = file_stat.st_size;
+    void *data = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file_fd, 0) : nullptr;
+    close(file_fd);
+    if (data == MAP_FAILED)
+        return false;
+    CAB_STAT_COUNT(STAT_BYTES_READ, size);
+    digest = digestBuffer((const char *)data, size, n_threads);
+    if (data != nullptr)
+        munmap(data, size);
+    return true;
+}
+
+typedef struct dedup_totals
+{
+    size_t extents;       // indexed extents
+    size_t references;    // entries pointing at them
+    size_t stored_bytes;  // their bytes, once each
+    size_t logical_bytes; // their bytes, once per entry
+} dedup_totals;
+
+// the fingerprint table of an image, loaded into memory and written back by store()
+class DedupIndex
+{
+public:
+    // reads the table the boot record names (none: an empty index); false when it does not
+    // fit the image
+    bool load(CabImage &image)
+    {
+        const boot_record &b_record = *image.bootRecord();
+        records.clear();
+        by_hash.clear();
+        by_block.clear();
+        dirty_blocks.clear();
+        retired.clear();
+        dirty = false;
+        moved = false;
+        table_first = b_record.dedup_first_block;
+        table_blocks = b_record.dedup_blocks;
+        block_size = image.blockSize();
+        if (table_blocks == 0)
+            return b_record.dedup_records == 0;
+        if (table_first * block_size < image.metadataEnd() || table_first >= b_record.total_blocks ||
+            table_blocks > b_record.total_blocks - table_first || b_record.dedup_records > table_blocks * block_size / sizeof(dedup_record))
+            return false;
+        records.resize(b_record.dedup_records);
+        memcpy(records.data(), image.blockData(table_first), records.size() * sizeof(dedup_record));
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            if (records[i].references == 0 || records[i].first_block >= b_record.total_blocks || by_block.count(records[i].first_block))
+                return false;
+            addToMaps(i);
+        }
+        return true;
+    }
+
+    // first block of an indexed extent with this content, OUT_OF_FREE_SPACE if there is none
+    size_t find(const file_digest &digest, uint64_t file_size, unsigned char file_type)
+    {
+        auto range = by_hash.equal_range(digest.hash[0]);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            const dedup_record &record = records[it->second];
+            if (record.hash[1] == digest.hash[1] && record.file_size == file_size && record.file_type == file_type)
+                return record.first_block;
+        }
+        return OUT_OF_FREE_SPACE;
+    }
+
+    // room in the table for one more record, taken from bmap now so no later reservation can
+    // claim it; false when the image has no space left for a bigger table
+    bool reserve(BitMap &bmap)
+    {
+        size_t needed = tableBlocksFor(records.size() + 1);
+        if (needed <= table_blocks)
+            return true;
+        // twice what is needed, so the table moves a logarithmic number of times
+        size_t new_blocks = 2 * needed;
+        size_t first = bmap.getFreeBlock(new_blocks);
+        if (first == OUT_OF_FREE_SPACE)
+            first = bmap.getFreeBlock(new_blocks = needed);
+        if (first == OUT_OF_FREE_SPACE)
+            return false;
+        bmap.writeBits(first, new_blocks, 1);
+        // the old table stays allocated until the boot record stops naming it
+        if (table_blocks != 0)
+            retired.push_back({table_first, table_blocks});
+        table_first = first;
+        table_blocks = new_blocks;
+        moved = true;
+        for (size_t block = 0; block < tableBlocksFor(records.size()); block++)
+            dirty_blocks.insert(block);
+        dirty = true;
+        return true;
+    }
+
+    // a new extent, with one reference; reserve() must have succeeded first
+    void insert(const file_digest &digest, uint64_t file_size, unsigned char file_type, size_t first_block)
+    {
+        if (by_block.count(first_block))
+            return;
+        dedup_record record;
+        memset(&record, 0, sizeof(record));
+        record.hash[0] = digest.hash[0];
+        record.hash[1] = digest.hash[1];
+        record.first_block = first_block;
+        record.file_size = file_size;
+        record.references = 1;
+        record.file_type = file_type;
+        records.push_back(record);
+        addToMaps(records.size() - 1);
+        markDirty(records.size() - 1);
+    }
+
+    void addReference(size_t first_block)
+    {
+        auto it = by_block.find(first_block);
+        if (it == by_block.end())
+            return;
+        records[it->second].references++;
+        markDirty(it->second);
+    }
+
+    // drops the reference of a removed entry; true when none is left and the caller frees the blocks
+    bool release(size_t first_block)
+    {
+        auto it = by_block.find(first_block);
+        if (it == by_block.end())
+            return true;
+        size_t i = it->second;
+        if (--records[i].references > 0)
+        {
+            markDirty(i);
+            return false;
+        }
+        erase(i);
+        return true;
+    }
+
+    // an extent moved by defrag
+    void relocate(size_t from, size_t to)
+    {
+        auto it = by_block.find(from);
+        if (it == by_block.end())
+            return;
+        size_t i = it->second;
+        by_block.erase(it);
+        records[i].first_block = to;
+        by_block[to] = i;
+        markDirty(i);
+    }
+
+    // entries pointing at the extent at first_block (1 for an extent the index does not know)
+    size_t references(size_t first_block)
+    {
+        auto it = by_block.find(first_block);
+        return it == by_block.end() ? 1 : records[it->second].references;
+    }
+
+    // writes the changed records into the table and its place into the boot record, and frees
+    // tables it has outgrown; the blocks to commit are added to blocks, those of a table that
+    // moved since the last call (nothing committed points at them yet) to fresh
+    void store(CabImage &image, BitMap &bmap, std::set<size_t> &blocks, std::set<size_t> &fresh)
+    {
+        if (!dirty)
+            return;
+        boot_record &b_record = *image.bootRecord();
+        size_t table_bytes = records.size() * sizeof(dedup_record);
+        for (size_t block : dirty_blocks)
+        {
+            if (block * block_size >= table_bytes)
+                continue;
+            size_t length = std::min(block_size, table_bytes - block * block_size);
+            memcpy(image.blockData(table_first + block), (const char *)records.data() + block * block_size, length);
+            (moved ? fresh : blocks).insert(table_first + block);
+        }
+        for (const std::pair<size_t, size_t> &table : retired)
+            bmap.writeBits(table.first, table.second, 0);
+        b_record.dedup_first_block = table_first;
+        b_record.dedup_blocks = table_blocks;
+        b_record.dedup_records = records.size();
+        blocks.insert(0);
+        dirty_blocks.clear();
+        retired.clear();
+        dirty = false;
+        moved = false;
+    }
+
+    // blocks the next store() adds to a commit, the boot record aside
+    size_t dirtyBlockCount() const
+    {
+        return moved ? 0 : dirty_blocks.size();
+    }
+
+    dedup_totals totals()
+    {
+        dedup_totals totals = {records.size(), 0, 0, 0};
+        for (const dedup_record &record : records)
+        {
+            totals.references += record.references;
+            totals.stored_bytes += record.file_size;
+            totals.logical_bytes += record.file_size * record.references;
+        }
+        return totals;
+    }
+
+    size_t tableFirstBlock()
+    {
+        return table_first;
+    }
+
+    size_t tableBlocks()
+    {
+        return table_blocks;
+    }
+
+private:
+    std::vector<dedup_record> records;
+    std::unordered_multimap<uint64_t, size_t> by_hash; // hash[0] -> record
+    std::unordered_map<uint64_t, size_t> by_block;     // first block -> record
+    std::set<size_t> dirty_blocks;                      // table blocks to write, relative to table_first
+    std::vector<std::pair<size_t, size_t>> retired;     // outgrown tables, freed by store()
+    size_t table_first = 0;
+    size_t table_blocks = 0;
+    size_t block_size = 0;
+    bool dirty = false;
+    bool moved = false; // the table is at a new place since the last store()
+
+    size_t tableBlocksFor(size_t n_records)
+    {
+        return (n_records * sizeof(dedup_record) + block_size - 1) / block_size;
+    }
+
+    void addToMaps(size_t i)
+    {
+        // copies: the record is packed
+        uint64_t hash = records[i].hash[0], first_block = records[i].first_block;
+        by_hash.insert({hash, i});
+        by_block[first_block] = i;
+    }
+
+    void removeFromMaps(size_t i)
+    {
+        uint64_t hash = records[i].hash[0], first_block = records[i].first_block;
+        auto range = by_hash.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (it->second == i)
+            {
+                by_hash.erase(it);
+                break;
+            }
+        }
+        by_block.erase(first_block);
+    }
+
+    void markDirty(size_t i)
+    {
+        dirty_blocks.insert(i * sizeof(dedup_record) / block_size);
+        dirty_blocks.insert(((i + 1) * sizeof(dedup_record) - 1) / block_size);
+        dirty = true;
+    }
+
+    // the last record takes the place of the erased one
+    void erase(size_t i)
+    {
+        size_t last = records.size() - 1;
+        removeFromMaps(i);
+        if (i != last)
+        {
+            removeFromMaps(last);
+            records[i] = records[last];
+            addToMaps(i);
+            markDirty(i);
+        }
+        records.pop_back();
+        dirty = true;
+    }
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include <chrono>
+
+#include "cab_defrag.hpp"
+
+void printUsage(const char *program)
+{
+    std::cout << "usage: " << program << " <image> [--target BYTES] [--dry-run] [--stats]\n"
+              << "  --target BYTES  stop once a free extent of at least BYTES exists\n"
+              << "  --dry-run       print the moves of the first pass without doing them\n"
+              << "  --stats         print time per phase and I/O counters as JSON\n";
+}
+
+int main(int argc, const char **argv)
+{
+    if (argc < 2)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    size_t target_bytes = 0;
+    bool dry_run = false;
+    bool show_stats = false;
+    for (int i = 2; i < argc; i++)
+    {
+        std::string option = argv[i];
+        if (option == "--target" && i + 1 < argc && parseNumber(argv[i + 1], target_bytes))
+            i++;
+        else if (option == "--dry-run")
+            dry_run = true;
+        else if (option == "--stats")
+            show_stats = true;
+        else
+        {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    CabImage image;
+    if (!image.open(argv[1], !dry_run) || !image.isFormatted())
+    {
+        std::cout << "could not open image " << argv[1] << std::endl;
+        return 1;
+    }
+    size_t block_size = image.blockSize();
+
+    auto start = std::chrono::steady_clock::now();
+    defrag_stats stats;
+    bool ok = defragImage(image, (target_bytes + block_size - 1) / block_size, dry_run, stats);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << (dry_run ? "planned " : "moved ") << stats.moves << " files, " << stats.bytes_moved << " bytes in "
+              << stats.passes << " passes, " << elapsed << " s\n"
+              << "largest free extent " << stats.largest_before * block_size << " -> " << stats.largest_after * block_size
+              << " bytes (+" << (stats.largest_after - stats.largest_before) * block_size << ")\n"
+              << "free extents " << stats.extents_before << " -> " << stats.extents_after << std::endl;
+    if (show_stats)
+        printStats("cab_defrag");
+    if (target_bytes > 0 && stats.largest_after * block_size < target_bytes)
+    {
+        std::cout << "could not reach the target of " << target_bytes << " bytes" << std::endl;
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,362 @@
+#ifndef CAB_DEFRAG_HPP
+#define CAB_DEFRAG_HPP
+
+// compaction of cab_defrag, kept in a header so cab_bench can drive it.
+// Free space is coalesced by emptying one window of the data area: the window that needs the
+// fewest blocks moved is chosen, and the files and subdirectory tables in it are moved to
+// holes outside it. Sources and destinations never overlap, so every move is a plain copy
+// into free blocks, and the old copy stays valid until the entries and the bitmap are committed.
+// An extent several entries share (cab_file_writer --dedup) is pinned like the blocks of the
+// dedup table itself
+
+#include "cab_fs.hpp"
+#include "cab_image.hpp"
+#include "cab_copy.hpp"
+#include "cab_stat.hpp"
+#include "cab_dedup.hpp"
+
+const size_t DEFRAG_MAX_PASSES = 8;
+// windows tried, cheapest first, before a target size is declared out of reach
+const size_t DEFRAG_WINDOW_CANDIDATES = 32;
+
+enum segment_kind
+{
+    SEGMENT_FREE,
+    SEGMENT_FILE,  // a file's or a subdirectory table's extent, can be moved
+    SEGMENT_PINNED // blocks no entry owns, never moved
+};
+
+// an extent and where the entry that points at it lives: tables move too, so entries are
+// found again through (table, slot) rather than kept as pointers
+typedef struct defrag_file
+{
+    size_t first_block;
+    size_t blocks;
+    size_t table_block; // directory table holding the entry
+    size_t slot;
+    bool is_directory;
+} defrag_file;
+
+typedef struct defrag_segment
+{
+    size_t first_block;
+    size_t blocks;
+    segment_kind kind;
+    size_t file; // index in the file list for SEGMENT_FILE
+} defrag_segment;
+
+typedef struct defrag_move
+{
+    size_t file;
+    size_t from;
+    size_t to;
+} defrag_move;
+
+typedef struct defrag_stats
+{
+    size_t passes;
+    size_t moves;
+    size_t bytes_moved;
+    size_t largest_before;
+    size_t largest_after;
+    size_t extents_before;
+    size_t extents_after;
+} defrag_stats;
+
+inline dir_entry *entryOf(CabImage &image, const defrag_file &file)
+{
+    return (dir_entry *)image.blockData(file.table_block) + file.slot;
+}
+
+// every file and subdirectory table below the directory table at table_block
+inline void collectExtents(CabImage &image, size_t table_block, size_t n_entries, std::vector<defrag_file> &files, size_t depth = 0)
+{
+    size_t block_size = image.blockSize();
+    dir_entry *entries = (dir_entry *)image.blockData(table_block);
+    for (size_t i = 0; i < n_entries; i++)
+    {
+        dir_entry &entry = entries[i];
+        // packed files own no blocks and split files no single extent: their pack blocks, pieces
+        // and maps are pinned like any unowned block
+        if (entry.file_type == 0xff || entry.first_block == 0 || entry.file_type == PACKED_TYPE || entry.file_type == EXTENTS_TYPE)
+            continue;
+        size_t blocks = (entry.file_size_in_bytes + block_size - 1) / block_size;
+        if (entry.file_type == DIRECTORY_TYPE)
+        {
+            if (strcmp(entry.file_name, "ponto") == 0 || strcmp(entry.file_name, "pontoponto") == 0 || depth > 64)
+                continue;
+            if ((entry.first_block + blocks) * block_size > image.size())
+                continue;
+            files.push_back({entry.first_block, blocks, table_block, i, true});
+            collectExtents(image, entry.first_block, entry.file_size_in_bytes / ENTRY_SIZE, files, depth + 1);
+            continue;
+        }
+        if (blocks > 0)
+            files.push_back({entry.first_block, blocks, table_block, i, false});
+    }
+}
+
+// the data area as contiguous segments in address order; used blocks no file accounts for are pinned
+inline std::vector<defrag_segment> buildSegments(const std::vector<defrag_file> &files, FreeExtentIndex &free_index, size_t data_start, size_t total_blocks)
+{
+    std::vector<defrag_segment> known;
+    for (size_t f = 0; f < files.size(); f++)
+        known.push_back({files[f].first_block, files[f].blocks, SEGMENT_FILE, f});
+    for (auto &extent : free_index.extentsByAddress())
+        known.push_back({extent.first, extent.second, SEGMENT_FREE, 0});
+    std::sort(known.begin(), known.end(), [](const defrag_segment &a, const defrag_segment &b) { return a.first_block < b.first_block; });
+
+    std::vector<defrag_segment> segments;
+    size_t position = data_start;
+    for (const defrag_segment &segment : known)
+    {
+        if (segment.first_block < position)
+        {
+            // overlapping claims, shared extents among them: whatever overlaps stays where it is
+            if (segments.empty())
+                continue;
+            segments.back().kind = SEGMENT_PINNED;
+            if (segment.first_block + segment.blocks > position)
+            {
+                segments.back().blocks = segment.first_block + segment.blocks - segments.back().first_block;
+                position = segment.first_block + segment.blocks;
+            }
+            continue;
+        }
+        if (segment.first_block > position)
+            segments.push_back({position, segment.first_block - position, SEGMENT_PINNED, 0});
+        segments.push_back(segment);
+        position = segment.first_block + segment.blocks;
+    }
+    if (position < total_blocks)
+        segments.push_back({position, total_blocks - position, SEGMENT_PINNED, 0});
+    return segments;
+}
+
+// moves that leave [window, window + size) free: files inside go best-fit, largest first, to
+// holes outside the window; false if they do not all fit
+inline bool planWindow(const std::vector<defrag_segment> &segments, const std::vector<defrag_file> &files, FreeExtentIndex free_index,
+                       size_t window, size_t size, std::vector<defrag_move> &moves)
+{
+    moves.clear();
+    free_index.removeRange(window, size);
+    std::vector<size_t> inside;
+    for (const defrag_segment &segment : segments)
+    {
+        if (segment.kind == SEGMENT_FILE && segment.first_block < window + size && segment.first_block + segment.blocks > window)
+            inside.push_back(segment.file);
+    }
+    std::sort(inside.begin(), inside.end(), [&](size_t a, size_t b) { return files[a].blocks > files[b].blocks; });
+    for (size_t f : inside)
+    {
+        size_t to = free_index.bestFit(files[f].blocks);
+        if (to == OUT_OF_FREE_SPACE)
+            return false;
+        free_index.removeRange(to, files[f].blocks);
+        moves.push_back({f, files[f].first_block, to});
+    }
+    return true;
+}
+
+// cheapest plan that leaves a free extent of `size` blocks. Windows start at a segment start
+// (sliding one back to there never moves more), are checked cheapest first, and may not hold
+// pinned blocks; the window is found with two pointers over the segments
+inline bool planCompaction(const std::vector<defrag_segment> &segments, const std::vector<defrag_file> &files, FreeExtentIndex &free_index,
+                           size_t size, size_t total_blocks, std::vector<defrag_move> &moves)
+{
+    std::vector<std::pair<size_t, size_t>> candidates; // (blocks to move, window start)
+    size_t j = 0, moved_blocks = 0, pinned_segments = 0;
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        size_t window_end = segments[i].first_block + size;
+        for (; j < segments.size() && segments[j].first_block < window_end; j++)
+        {
+            moved_blocks += segments[j].kind == SEGMENT_FILE ? segments[j].blocks : 0;
+            pinned_segments += segments[j].kind == SEGMENT_PINNED ? 1 : 0;
+        }
+        if (window_end <= total_blocks && pinned_segments == 0)
+            candidates.push_back({moved_blocks, segments[i].first_block});
+        moved_blocks -= segments[i].kind == SEGMENT_FILE ? segments[i].blocks : 0;
+        pinned_segments -= segments[i].kind == SEGMENT_PINNED ? 1 : 0;
+    }
+
+    size_t tries = std::min(candidates.size(), DEFRAG_WINDOW_CANDIDATES);
+    std::partial_sort(candidates.begin(), candidates.begin() + tries, candidates.end());
+    for (size_t c = 0; c < tries; c++)
+    {
+        if (planWindow(segments, files, free_index, candidates[c].second, size, moves))
+            return true;
+    }
+    return false;
+}
+
+// copies every move to its destination, then commits the entries and the bitmap
+inline bool executeMoves(CabImage &image, BitMap &bmap, DedupIndex &dedup, const std::vector<defrag_file> &files, const std::vector<defrag_move> &moves,
+                         defrag_stats &stats)
+{
+    size_t block_size = image.blockSize();
+    size_t root_block = 1 + image.bootRecord()->bitmap_size_in_blocks;
+    CopyBuffer copy_buffer;
+    for (const defrag_move &move : moves)
+    {
+        const defrag_file &file = files[move.file];
+        if (file.is_directory)
+            continue;
+        size_t file_size = entryOf(image, file)->file_size_in_bytes;
+        CAB_STAT_PHASE(PHASE_COPY_DATA);
+        if (!copyRange(image.fd(), move.from * block_size, image.fd(), move.to * block_size, file_size, copy_buffer))
+        {
+            std::cout << "could not move " << entryOf(image, file)->file_name << std::endl;
+            return false;
+        }
+        stats.bytes_moved += file_size;
+    }
+    // the new copies are on disk before any entry points at them
+    CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+    if (fsync(image.fd()) != 0)
+        return false;
+
+    // every entry pointing at a moved extent is rewritten while all tables are still in place:
+    // the parent's entry, a moved table's own ponto and its subdirectories' pontoponto...
+    std::map<size_t, size_t> relocated;
+    for (const defrag_move &move : moves)
+        relocated[move.from] = move.to;
+    for (const defrag_move &move : moves)
+    {
+        entryOf(image, files[move.file])->first_block = move.to;
+        if (files[move.file].is_directory)
+            ((dir_entry *)image.blockData(move.from))[0].first_block = move.to;
+    }
+    for (const defrag_file &file : files)
+    {
+        if (file.is_directory && relocated.count(file.table_block))
+            ((dir_entry *)image.blockData(file.first_block))[1].first_block = relocated[file.table_block];
+    }
+
+    // ...then the moved tables are copied, already up to date
+    for (const defrag_move &move : moves)
+    {
+        if (!files[move.file].is_directory)
+            continue;
+        memcpy(image.blockData(move.to), image.blockData(move.from), files[move.file].blocks * block_size);
+        stats.bytes_moved += files[move.file].blocks * block_size;
+    }
+
+    // tables touched, at their final place (the root is written with the rest of the metadata)
+    std::map<size_t, size_t> table_blocks;
+    for (const defrag_file &file : files)
+    {
+        if (file.is_directory)
+            table_blocks[relocated.count(file.first_block) ? relocated[file.first_block] : file.first_block] = file.blocks;
+    }
+    std::set<size_t> touched;
+    for (const defrag_move &move : moves)
+    {
+        const defrag_file &file = files[move.file];
+        touched.insert(relocated.count(file.table_block) ? relocated[file.table_block] : file.table_block);
+        if (file.is_directory)
+            touched.insert(move.to);
+    }
+    for (const defrag_file &file : files)
+    {
+        if (file.is_directory && relocated.count(file.table_block))
+            touched.insert(relocated.count(file.first_block) ? relocated[file.first_block] : file.first_block);
+    }
+
+    for (const defrag_move &move : moves)
+        bmap.writeBits(move.to, files[move.file].blocks, 1);
+    for (const defrag_move &move : moves)
+        bmap.writeBits(move.from, files[move.file].blocks, 0);
+    for (const defrag_move &move : moves)
+        dedup.relocate(move.from, move.to);
+    stats.moves += moves.size();
+
+    // the touched tables, bitmap and boot record in one commit (one transaction with a journal);
+    // a moved table is new to the image and goes out with the data instead
+    std::set<size_t> moved_tables;
+    for (const defrag_move &move : moves)
+    {
+        if (files[move.file].is_directory)
+            moved_tables.insert(move.to);
+    }
+    std::set<size_t> blocks = {0}, fresh;
+    for (size_t table : touched)
+    {
+        size_t n_blocks = table == root_block ? rootDirBlocks(*image.bootRecord()) : table_blocks[table];
+        for (size_t block = table; block < table + n_blocks; block++)
+            (moved_tables.count(table) ? fresh : blocks).insert(block);
+    }
+    dedup.store(image, bmap, blocks, fresh);
+    bmap.takeDirtyBlocks(blocks);
+    return image.commit(blocks, fresh);
+}
+
+// compacts until a free extent of target_blocks exists (0: as large as possible) or a pass
+// gains nothing; with dry_run the first pass is only printed
+inline bool defragImage(CabImage &image, size_t target_blocks, bool dry_run, defrag_stats &stats)
+{
+    const boot_record &b_record = *image.bootRecord();
+    size_t data_start = 1 + b_record.bitmap_size_in_blocks + rootDirBlocks(b_record);
+    BitMap bmap(b_record, image.bitmapBytes());
+    bmap.buildExtentIndex();
+    FreeExtentIndex &free_index = bmap.getExtentIndex();
+
+    fragmentation_report report = makeFragmentationReport(free_index);
+    stats = {0, 0, 0, report.largest_extent, report.largest_extent, report.free_extents, report.free_extents};
+    size_t goal = target_blocks == 0 ? report.free_blocks : std::min(target_blocks, report.free_blocks);
+    DedupIndex dedup;
+    if (!dedup.load(image))
+    {
+        std::cout << "could not read the dedup index" << std::endl;
+        return false;
+    }
+
+    for (stats.passes = 0; stats.passes < DEFRAG_MAX_PASSES && free_index.largestExtent() < goal; stats.passes++)
+    {
+        std::vector<defrag_file> files;
+        collectExtents(image, data_start - rootDirBlocks(b_record), b_record.n_root_entries, files);
+        std::vector<defrag_segment> segments = buildSegments(files, free_index, data_start, b_record.total_blocks);
+
+        // largest reachable hole this pass, by binary search on its size
+        std::vector<defrag_move> moves, best_moves;
+        size_t low = free_index.largestExtent(), high = goal;
+        if (planCompaction(segments, files, free_index, high, b_record.total_blocks, moves))
+        {
+            best_moves = moves;
+            low = high;
+        }
+        while (low < high)
+        {
+            size_t middle = low + (high - low + 1) / 2;
+            if (planCompaction(segments, files, free_index, middle, b_record.total_blocks, moves))
+            {
+                best_moves = moves;
+                low = middle;
+            }
+            else
+                high = middle - 1;
+        }
+        if (best_moves.empty())
+            break;
+
+        if (dry_run)
+        {
+            for (const defrag_move &move : best_moves)
+                std::cout << "move " << entryOf(image, files[move.file])->file_name << " (" << files[move.file].blocks << " blocks) "
+                          << move.from << " -> " << move.to << std::endl;
+            stats.moves = best_moves.size();
+            stats.largest_after = low;
+            stats.passes++;
+            return true;
+        }
+        if (!executeMoves(image, bmap, dedup, files, best_moves, stats))
+            return false;
+    }
+
+    report = makeFragmentationReport(free_index);
+    stats.largest_after = report.largest_extent;
+    stats.extents_after = report.free_extents;
+    return true;
+}
+
+#endif
@@ -0,0 +1,530 @@
+#ifndef CAB_DIR_HPP
+#define CAB_DIR_HPP
+
+// directories: name lookups and free slots over an array of dir_entry (DirIndex), and
+// subdirectories with path resolution through an LRU cache of resolved directories
+
+#include <list>
+#include <unordered_map>
+
+#include "cab_fs.hpp"
+#include "cab_image.hpp"
+
+const size_t ENTRY_NOT_FOUND = (size_t)-1;
+const unsigned int FILE_NAME_SIZE = sizeof(((dir_entry *)nullptr)->file_name);
+// a subdirectory is a fixed table of entries in data blocks, "ponto" and "pontoponto" first
+const unsigned int SUBDIR_ENTRIES = 128;
+const size_t DEFAULT_DENTRY_CACHE_SIZE = 4096;
+// longest name that still leaves room for the terminating NUL
+const unsigned int MAX_NAME_LENGTH = FILE_NAME_SIZE - 1;
+
+inline bool isFreeEntry(const dir_entry &entry)
+{
+    return entry.file_type == 0xff || entry.first_block == 0x0;
+}
+
+// file names are NUL terminated unless they use all FILE_NAME_SIZE (47) bytes of dir_entry
+inline size_t entryNameLength(const dir_entry &entry)
+{
+    return strnlen(entry.file_name, FILE_NAME_SIZE);
+}
+
+// open-addressing (linear probing) hash of the entry names plus a list of free slots, built
+// once over the directory; lookups, inserts and free-slot requests are then O(1)
+class DirIndex
+{
+public:
+    DirIndex(dir_entry *entries, size_t n_entries)
+        : entries(entries), n_entries(n_entries)
+    {
+        build();
+    }
+
+    void build()
+    {
+        CAB_STAT_PHASE(PHASE_LOAD_METADATA);
+        size_t capacity = 16;
+        while (capacity < 2 * n_entries)
+            capacity *= 2;
+        table.assign(capacity, EMPTY);
+        tombstones = 0;
+        free_slots.clear();
+
+        // lowest index first, so the first of two equal names wins like in a linear scan;
+        // free slots are stacked highest first so they are handed out lowest first
+        for (size_t i = 0; i < n_entries; i++)
+        {
+            if (!isFreeEntry(entries[i]) && find(entries[i].file_name, entryNameLength(entries[i])) == ENTRY_NOT_FOUND)
+                hashInsert(i);
+        }
+        for (size_t i = n_entries; i-- > 0;)
+        {
+            if (isFreeEntry(entries[i]))
+                free_slots.push_back(i);
+        }
+    }
+
+    size_t find(const char *name, size_t length)
+    {
+        if (length > FILE_NAME_SIZE)
+            return ENTRY_NOT_FOUND;
+        size_t mask = table.size() - 1;
+        for (size_t probe = hashName(name, length) & mask;; probe = (probe + 1) & mask)
+        {
+            uint32_t slot = table[probe];
+            if (slot == EMPTY)
+                return ENTRY_NOT_FOUND;
+            if (slot != TOMBSTONE && entryNameLength(entries[slot]) == length && memcmp(entries[slot].file_name, name, length) == 0)
+                return slot;
+        }
+    }
+
+    size_t find(const std::string &name)
+    {
+        return find(name.c_str(), name.size());
+    }
+
+    // lowest free slot (or the last one released), ENTRY_NOT_FOUND when the directory is full
+    size_t takeFreeSlot()
+    {
+        while (!free_slots.empty())
+        {
+            size_t slot = free_slots.back();
+            free_slots.pop_back();
+            if (isFreeEntry(entries[slot]))
+                return slot;
+        }
+        return ENTRY_NOT_FOUND;
+    }
+
+    // gives back a slot taken with takeFreeSlot that ended up unused
+    void releaseSlot(size_t slot)
+    {
+        free_slots.push_back(slot);
+    }
+
+    size_t freeSlotCount()
+    {
+        return free_slots.size();
+    }
+
+    // stores entry at slot (normally one returned by takeFreeSlot) and indexes its name
+    void insert(size_t slot, const dir_entry &entry)
+    {
+        entries[slot] = entry;
+        if (find(entry.file_name, entryNameLength(entry)) == ENTRY_NOT_FOUND)
+            hashInsert(slot);
+    }
+
+    // marks the slot free again; another entry with the same name becomes visible
+    void remove(size_t slot)
+    {
+        dir_entry removed = entries[slot];
+        size_t mask = table.size() - 1;
+        for (size_t probe = hashName(removed.file_name, entryNameLength(removed)) & mask; table[probe] != EMPTY; probe = (probe + 1) & mask)
+        {
+            if (table[probe] == slot)
+            {
+                table[probe] = TOMBSTONE;
+                tombstones++;
+                break;
+            }
+        }
+        memset(&entries[slot], 0, sizeof(dir_entry));
+        free_slots.push_back(slot);
+
+        // probes only stop at EMPTY, so do not let deleted markers take over the table
+        if (tombstones > table.size() / 4)
+        {
+            build();
+            return;
+        }
+
+        if (find(removed.file_name, entryNameLength(removed)) != ENTRY_NOT_FOUND)
+            return;
+        for (size_t i = 0; i < n_entries; i++)
+        {
+            if (!isFreeEntry(entries[i]) && entryNameLength(entries[i]) == entryNameLength(removed) &&
+                memcmp(entries[i].file_name, removed.file_name, entryNameLength(removed)) == 0)
+            {
+                hashInsert(i);
+                break;
+            }
+        }
+    }
+
+private:
+    static constexpr uint32_t EMPTY = 0xffffffff;
+    static constexpr uint32_t TOMBSTONE = 0xfffffffe;
+
+    dir_entry *entries;
+    size_t n_entries;
+    std::vector<uint32_t> table;
+    size_t tombstones = 0;
+    std::vector<size_t> free_slots;
+
+    // FNV-1a over the name bytes
+    static size_t hashName(const char *name, size_t length)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < length; i++)
+        {
+            hash ^= (unsigned char)name[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    void hashInsert(size_t slot)
+    {
+        size_t mask = table.size() - 1;
+        size_t probe = hashName(entries[slot].file_name, entryNameLength(entries[slot])) & mask;
+        while (table[probe] != EMPTY && table[probe] != TOMBSTONE)
+            probe = (probe + 1) & mask;
+        if (table[probe] == TOMBSTONE)
+            tombstones--;
+        table[probe] = slot;
+    }
+};
+
+// where a directory's entry table lives
+typedef struct dir_location
+{
+    size_t first_block;
+    size_t n_entries;
+} dir_location;
+
+// LRU map from a directory path ("a/b") to its entry table
+class DentryCache
+{
+public:
+    DentryCache(size_t capacity = DEFAULT_DENTRY_CACHE_SIZE)
+        : capacity(capacity)
+    {
+    }
+
+    bool get(const std::string &path, dir_location &location)
+    {
+        auto it = by_path.find(path);
+        if (it == by_path.end())
+        {
+            misses++;
+            return false;
+        }
+        hits++;
+        recent.splice(recent.begin(), recent, it->second);
+        location = it->second->second;
+        return true;
+    }
+
+    void put(const std::string &path, dir_location location)
+    {
+        if (capacity == 0)
+            return;
+        auto it = by_path.find(path);
+        if (it != by_path.end())
+        {
+            it->second->second = location;
+            recent.splice(recent.begin(), recent, it->second);
+            return;
+        }
+        recent.push_front({path, location});
+        by_path[path] = recent.begin();
+        if (recent.size() > capacity)
+        {
+            by_path.erase(recent.back().first);
+            recent.pop_back();
+        }
+    }
+
+    // directory tables moved or went away
+    void clear()
+    {
+        recent.clear();
+        by_path.clear();
+    }
+
+    size_t hits = 0;
+    size_t misses = 0;
+
+private:
+    size_t capacity;
+    std::list<std::pair<std::string, dir_location>> recent;
+    std::unordered_map<std::string, std::list<std::pair<std::string, dir_location>>::iterator> by_path;
+};
+
+// resolves "a/b/c.bin" over the mapped image; the root directory goes through its DirIndex,
+// subdirectories (at most SUBDIR_ENTRIES entries) are scanned
+class PathResolver
+{
+public:
+    PathResolver(CabImage &image, DirIndex &root_index, size_t cache_capacity = DEFAULT_DENTRY_CACHE_SIZE)
+        : image(image), root_index(root_index), cache(cache_capacity)
+    {
+    }
+
+    dir_location root()
+    {
+        return {1 + image.bootRecord()->bitmap_size_in_blocks, image.bootRecord()->n_root_entries};
+    }
+
+    bool isRoot(dir_location location)
+    {
+        return location.first_block == root().first_block;
+    }
+
+    dir_entry *entries(dir_location location)
+    {
+        return (dir_entry *)image.blockData(location.first_block);
+    }
+
+    size_t findInDir(dir_location location, const char *name, size_t length)
+    {
+        if (isRoot(location))
+            return root_index.find(name, length);
+        dir_entry *table = entries(location);
+        for (size_t i = 0; i < location.n_entries; i++)
+        {
+            if (!isFreeEntry(table[i]) && entryNameLength(table[i]) == length && memcmp(table[i].file_name, name, length) == 0)
+                return i;
+        }
+        return ENTRY_NOT_FOUND;
+    }
+
+    // "/a//b/./c" -> {"a", "b", "c"}; ".." is the "pontoponto" entry of each directory
+    static std::vector<std::string> splitPath(const std::string &path)
+    {
+        std::vector<std::string> components;
+        size_t start = 0;
+        while (start <= path.size())
+        {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos)
+                end = path.size();
+            std::string component = path.substr(start, end - start);
+            if (component == "..")
+                components.push_back("pontoponto");
+            else if (!component.empty() && component != ".")
+                components.push_back(component);
+            start = end + 1;
+        }
+        return components;
+    }
+
+    static std::string joinPath(const std::vector<std::string> &components, size_t count)
+    {
+        std::string path;
+        for (size_t i = 0; i < count; i++)
+            path += (i ? "/" : "") + components[i];
+        return path;
+    }
+
+    // directory named by the first `depth` components; starts from the longest cached prefix
+    bool resolveDir(const std::vector<std::string> &components, size_t depth, dir_location &location)
+    {
+        size_t resolved = depth;
+        while (resolved > 0 && !cache.get(joinPath(components, resolved), location))
+            resolved--;
+        if (resolved == 0)
+            location = root();
+
+        for (; resolved < depth; resolved++)
+        {
+            const std::string &name = components[resolved];
+            size_t slot = findInDir(location, name.c_str(), name.size());
+            if (slot == ENTRY_NOT_FOUND || entries(location)[slot].file_type != DIRECTORY_TYPE)
+                return false;
+            location = locationOf(entries(location)[slot]);
+            cache.put(joinPath(components, resolved + 1), location);
+        }
+        return true;
+    }
+
+    // directory and slot of the entry named by path, false if any component is missing
+    bool locate(const std::string &path, dir_location &parent, size_t &slot)
+    {
+        std::vector<std::string> components = splitPath(path);
+        if (components.empty())
+            return false;
+        if (!resolveDir(components, components.size() - 1, parent))
+            return false;
+        const std::string &name = components.back();
+        slot = findInDir(parent, name.c_str(), name.size());
+        return slot != ENTRY_NOT_FOUND;
+    }
+
+    // entry named by path, nullptr if any component is missing
+    dir_entry *lookup(const std::string &path)
+    {
+        dir_location parent;
+        size_t slot = ENTRY_NOT_FOUND;
+        if (!locate(path, parent, slot))
+            return nullptr;
+        return &entries(parent)[slot];
+    }
+
+    size_t takeFreeSlot(dir_location location)
+    {
+        if (isRoot(location))
+            return root_index.takeFreeSlot();
+        dir_entry *table = entries(location);
+        for (size_t i = 0; i < location.n_entries; i++)
+        {
+            if (isFreeEntry(table[i]))
+                return i;
+        }
+        return ENTRY_NOT_FOUND;
+    }
+
+    void releaseSlot(dir_location location, size_t slot)
+    {
+        if (isRoot(location))
+            root_index.releaseSlot(slot);
+    }
+
+    void insertEntry(dir_location location, size_t slot, const dir_entry &entry)
+    {
+        if (isRoot(location))
+        {
+            root_index.insert(slot, entry);
+            markDirty(rootBlockOf(slot));
+        }
+        else
+        {
+            entries(location)[slot] = entry;
+            markDirty(location);
+        }
+    }
+
+    void removeEntry(dir_location location, size_t slot)
+    {
+        if (isRoot(location))
+        {
+            root_index.remove(slot);
+            markDirty(rootBlockOf(slot));
+        }
+        else
+        {
+            memset(&entries(location)[slot], 0, sizeof(dir_entry));
+            markDirty(location);
+        }
+    }
+
+    // creates every missing directory of the first `depth` components (mkdir -p)
+    bool makeDirs(const std::vector<std::string> &components, size_t depth, BitMap &bmap, dir_location &location)
+    {
+        location = root();
+        for (size_t level = 0; level < depth; level++)
+        {
+            if (components[level].size() > MAX_NAME_LENGTH)
+                return false;
+            if (resolveDir(components, level + 1, location))
+                continue;
+            dir_location parent;
+            resolveDir(components, level, parent);
+            if (findInDir(parent, components[level].c_str(), components[level].size()) != ENTRY_NOT_FOUND)
+                return false; // exists but is not a directory
+            if (!createDir(parent, components[level], bmap, location))
+                return false;
+            cache.put(joinPath(components, level + 1), location);
+        }
+        return true;
+    }
+
+    // writes back the subdirectory tables changed since the last call
+    bool flushDirty()
+    {
+        bool ok = true;
+        size_t block_size = image.blockSize();
+        for (size_t block : dirty_blocks)
+            ok = image.flushRange(block * block_size, block_size) && ok;
+        dirty_blocks.clear();
+        return ok;
+    }
+
+    // image blocks of the directory tables changed since the last call, added to blocks
+    void takeDirtyBlocks(std::set<size_t> &blocks)
+    {
+        blocks.insert(dirty_blocks.begin(), dirty_blocks.end());
+        dirty_blocks.clear();
+    }
+
+    size_t dirtyBlockCount() const
+    {
+        return dirty_blocks.size();
+    }
+
+    DentryCache &getCache()
+    {
+        return cache;
+    }
+
+private:
+    CabImage &image;
+    DirIndex &root_index;
+    DentryCache cache;
+    std::set<size_t> dirty_blocks; // image blocks of the tables changed since takeDirtyBlocks
+
+    void markDirty(dir_location location)
+    {
+        size_t block_size = image.blockSize();
+        size_t table_blocks = (location.n_entries * ENTRY_SIZE + block_size - 1) / block_size;
+        for (size_t block = location.first_block; block < location.first_block + table_blocks; block++)
+            dirty_blocks.insert(block);
+    }
+
+    // the root directory block holding slot, as a location of its own
+    dir_location rootBlockOf(size_t slot)
+    {
+        size_t block_size = image.blockSize();
+        return {root().first_block + slot * ENTRY_SIZE / block_size, block_size / ENTRY_SIZE};
+    }
+
+    static dir_location locationOf(const dir_entry &entry)
+    {
+        return {entry.first_block, entry.file_size_in_bytes / ENTRY_SIZE};
+    }
+
+    bool createDir(dir_location parent, const std::string &name, BitMap &bmap, dir_location &location)
+    {
+        size_t block_size = image.blockSize();
+        size_t dir_blocks = (SUBDIR_ENTRIES * ENTRY_SIZE + block_size - 1) / block_size;
+        size_t first_block = bmap.getFreeBlock(dir_blocks);
+        size_t slot = takeFreeSlot(parent);
+        if (first_block == OUT_OF_FREE_SPACE || slot == ENTRY_NOT_FOUND)
+        {
+            if (slot != ENTRY_NOT_FOUND)
+                releaseSlot(parent, slot);
+            return false;
+        }
+        bmap.writeBits(first_block, dir_blocks, 1);
+
+        location = {first_block, SUBDIR_ENTRIES};
+        memset(entries(location), 0, dir_blocks * block_size);
+        dir_entry ponto, pontoponto;
+        memset(&ponto, 0, sizeof(ponto));
+        memset(&pontoponto, 0, sizeof(pontoponto));
+        ponto.first_block = location.first_block;
+        ponto.file_size_in_bytes = location.n_entries * ENTRY_SIZE;
+        ponto.file_type = DIRECTORY_TYPE;
+        strcpy(ponto.file_name, "ponto");
+        pontoponto.first_block = parent.first_block;
+        pontoponto.file_size_in_bytes = parent.n_entries * ENTRY_SIZE;
+        pontoponto.file_type = DIRECTORY_TYPE;
+        strcpy(pontoponto.file_name, "pontoponto");
+        entries(location)[0] = ponto;
+        entries(location)[1] = pontoponto;
+        markDirty(location);
+
+        dir_entry dir;
+        memset(&dir, 0, sizeof(dir));
+        dir.first_block = location.first_block;
+        dir.file_size_in_bytes = location.n_entries * ENTRY_SIZE;
+        dir.file_type = DIRECTORY_TYPE;
+        strncpy(dir.file_name, name.c_str(), FILE_NAME_SIZE - 1);
+        insertEntry(parent, slot, dir);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef CAB_EXTENT_HPP
+#define CAB_EXTENT_HPP
+
+// files split over several extents: when no free run holds a whole raw file, the import
+// takes the largest free runs instead (few, long pieces) and the entry (EXTENTS_TYPE) points
+// at an extent map listing them in file order. The map is a chain of blocks, each starting
+// with an extent_map_header; a file in a single run keeps a plain BINARY_TYPE entry, so the
+// map only costs anything for files that could not have been stored before
+
+#include "cab_fs.hpp"
+#include "cab_copy.hpp"
+
+const uint32_t EXTENT_MAP_MAGIC = 0x4d424143; // "CABM"
+
+// pieces one file may be split into; bounds the map chain a lookup has to follow
+const size_t MAX_FILE_EXTENTS = 4096;
+
+typedef struct extent_map_header
+{
+    uint32_t magic;
+    uint32_t n_extents;      // records in this map block
+    uint64_t next_map_block; // 0: last block of the map
+} __attribute__((packed)) extent_map_header;
+
+typedef struct file_extent
+{
+    uint64_t first_block;
+    uint64_t blocks;
+} __attribute__((packed)) file_extent;
+
+inline size_t extentsPerMapBlock(size_t block_size)
+{
+    return (block_size - sizeof(extent_map_header)) / sizeof(file_extent);
+}
+
+inline size_t mapBlocksFor(size_t n_extents, size_t block_size)
+{
+    return (n_extents + extentsPerMapBlock(block_size) - 1) / extentsPerMapBlock(block_size);
+}
+
+// calls range(image_offset, file_offset, length) for every piece of a file_size byte file, in
+// file order; stops at the first false
+template <typename Range>
+bool forEachExtentRange(const std::vector<file_extent> &extents, size_t block_size, uint64_t file_size, Range range)
+{
+    uint64_t file_offset = 0;
+    for (const file_extent &extent : extents)
+    {
+        if (file_offset >= file_size)
+            break;
+        uint64_t length = std::min((uint64_t)extent.blocks * block_size, file_size - file_offset);
+        if (!range((off_t)(extent.first_block * block_size), (off_t)file_offset, (size_t)length))
+            return false;
+        file_offset += length;
+    }
+    return file_offset == file_size;
+}
+
+// gives a split file's pieces and map blocks back to the bitmap
+inline void releaseExtents(BitMap &bmap, const std::vector<file_extent> &extents, const std::vector<size_t> &map_blocks)
+{
+    for (const file_extent &extent : extents)
+        bmap.writeBits(extent.first_block, extent.blocks, 0);
+    for (size_t block : map_blocks)
+        bmap.writeBits(block, 1, 0);
+}
+
+// marks the blocks of the map of an n_extents piece file, each in the best-fitting free run;
+// nothing is marked when they do not fit
+inline bool allocateMapBlocks(BitMap &bmap, size_t block_size, size_t n_extents, std::vector<size_t> &map_blocks)
+{
+    FreeExtentIndex &index = bmap.getExtentIndex();
+    map_blocks.clear();
+    for (size_t m = 0; m < mapBlocksFor(n_extents, block_size); m++)
+    {
+        size_t block = index.bestFit(1);
+        if (block == OUT_OF_FREE_SPACE)
+        {
+            for (size_t taken : map_blocks)
+                bmap.writeBits(taken, 1, 0);
+            map_blocks.clear();
+            return false;
+        }
+        bmap.writeBits(block, 1, 1);
+        map_blocks.push_back(block);
+    }
+    return true;
+}
+
+// marks blocks_for_file blocks in at most max_extents free runs, largest first so the file
+// ends up in as few pieces as the free space allows, the last piece in the best-fitting run;
+// then the blocks of the map. Nothing is marked when it does not fit
+inline bool allocateExtents(BitMap &bmap, size_t block_size, size_t blocks_for_file, size_t max_extents,
+                            std::vector<file_extent> &extents, std::vector<size_t> &map_blocks)
+{
+    CAB_STAT_PHASE(PHASE_ALLOCATE);
+    if (!bmap.hasExtentIndex())
+        bmap.buildExtentIndex();
+    FreeExtentIndex &index = bmap.getExtentIndex();
+    extents.clear();
+    map_blocks.clear();
+    size_t remaining = blocks_for_file;
+    bool fits = true;
+    while (remaining > 0 && fits)
+    {
+        size_t first = index.bestFit(remaining);
+        size_t blocks = remaining;
+        if (first == OUT_OF_FREE_SPACE)
+        {
+            first = index.largestExtentStart();
+            blocks = index.largestExtent();
+        }
+        fits = first != OUT_OF_FREE_SPACE && extents.size() < max_extents;
+        if (fits)
+        {
+            bmap.writeBits(first, blocks, 1);
+            extents.push_back({first, blocks});
+            remaining -= blocks;
+        }
+    }
+    if (fits && allocateMapBlocks(bmap, block_size, extents.size(), map_blocks))
+        return true;
+    releaseExtents(bmap, extents, map_blocks);
+    extents.clear();
+    map_blocks.clear();
+    return false;
+}
+
+// the map blocks as they go to disk, one buffer of block_size bytes per block
+inline std::vector<std::vector<char>> encodeExtentMap(const std::vector<file_extent> &extents, const std::vector<size_t> &map_blocks,
+                                                      size_t block_size)
+{
+    std::vector<std::vector<char>> blocks(map_blocks.size(), std::vector<char>(block_size, 0));
+    size_t per_block = extentsPerMapBlock(block_size);
+    for (size_t m = 0; m < map_blocks.size(); m++)
+    {
+        size_t first = m * per_block;
+        size_t count = std::min(per_block, extents.size() - first);
+        extent_map_header header = {EXTENT_MAP_MAGIC, (uint32_t)count, m + 1 < map_blocks.size() ? map_blocks[m + 1] : 0};
+        memcpy(blocks[m].data(), &header, sizeof(header));
+        memcpy(blocks[m].data() + sizeof(header), extents.data() + first, count * sizeof(file_extent));
+    }
+    return blocks;
+}
+
+inline bool writeExtentMap(int image_fd, const std::vector<file_extent> &extents, const std::vector<size_t> &map_blocks, size_t block_size)
+{
+    std::vector<std::vector<char>> blocks = encodeExtentMap(extents, map_blocks, block_size);
+    for (size_t m = 0; m < blocks.size(); m++)
+    {
+        if (!writeAll(image_fd, blocks[m].data(), block_size, (off_t)map_blocks[m] * block_size))
+            return false;
+    }
+    return true;
+}
+
+// follows the map of a split entry, with read(offset, buffer, length) fetching image bytes
+// (pread, or cabd's block cache); false when a map block or a piece is out of the image or the
+// pieces do not cover the file
+template <typename Read>
+bool readExtentMap(const dir_entry &entry, size_t block_size, size_t total_blocks, Read read, std::vector<file_extent> &extents,
+                   std::vector<size_t> *map_blocks = nullptr)
+{
+    extents.clear();
+    std::vector<char> block(block_size);
+    uint64_t covered = 0;
+    size_t map_block = entry.first_block;
+    for (size_t hops = 0; map_block != 0; hops++)
+    {
+        extent_map_header header;
+        if (map_block >= total_blocks || hops >= mapBlocksFor(MAX_FILE_EXTENTS, block_size) ||
+            !read((off_t)map_block * block_size, block.data(), block_size))
+            return false;
+        memcpy(&header, block.data(), sizeof(header));
+        if (header.magic != EXTENT_MAP_MAGIC || header.n_extents > extentsPerMapBlock(block_size))
+            return false;
+        if (map_blocks != nullptr)
+            map_blocks->push_back(map_block);
+        for (size_t e = 0; e < header.n_extents; e++)
+        {
+            file_extent extent;
+            memcpy(&extent, block.data() + sizeof(header) + e * sizeof(file_extent), sizeof(extent));
+            if (extent.first_block >= total_blocks || extent.blocks > total_blocks - extent.first_block)
+                return false;
+            extents.push_back(extent);
+            covered += extent.blocks * block_size;
+        }
+        map_block = header.next_map_block;
+    }
+    return covered >= entry.file_size_in_bytes;
+}
+
+// readExtentMap straight from the image file
+inline bool readExtentMap(int image_fd, const dir_entry &entry, size_t block_size, size_t total_blocks, std::vector<file_extent> &extents,
+                          std::vector<size_t> *map_blocks = nullptr)
+{
+    return readExtentMap(entry, block_size, total_blocks, [&](off_t offset, char *buffer, size_t length) {
+        CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+        return pread(image_fd, buffer, length, offset) == (ssize_t)length;
+    }, extents, map_blocks);
+}
+
+#endif
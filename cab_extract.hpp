@@ -0,0 +1,125 @@
+#ifndef CAB_EXTRACT_HPP
+#define CAB_EXTRACT_HPP
+
+// extracting files from an image, kept in a header so cab_bench can drive it
+
+#include "cab_fs.hpp"
+#include "cab_image.hpp"
+#include "cab_copy.hpp"
+#include "cab_compress.hpp"
+#include "cab_extent.hpp"
+
+// bytes the entry extracts to: the original size for a compressed file
+inline uint64_t extractedSize(CabImage &image, const dir_entry &entry)
+{
+    extent_span span = image.fileData(entry);
+    compressed_header header;
+    if (entry.file_type == COMPRESSED_TYPE && span.data != nullptr && span.size >= sizeof(header))
+    {
+        memcpy(&header, span.data, sizeof(header));
+        return header.file_size;
+    }
+    return entry.file_size_in_bytes;
+}
+
+// inflates a compressed entry into output_name one chunk at a time, straight from the
+// mapping, so no more than a chunk of the file is ever held in memory
+inline bool extractCompressed(CabImage &image, const dir_entry &entry, const std::string &output_name)
+{
+    extent_span span = image.fileData(entry);
+    compressed_header header;
+    std::vector<uint64_t> offsets;
+    if (span.data == nullptr || !readCompressedTable(span.data, span.size, header, offsets))
+    {
+        std::cout << output_name << " is not a valid compressed file" << std::endl;
+        return false;
+    }
+
+    int output_fd = open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0)
+    {
+        std::cout << "could not create " << output_name << std::endl;
+        return false;
+    }
+    if (header.file_size > 0)
+        fallocate(output_fd, 0, 0, header.file_size);
+
+    std::vector<char> chunk(header.chunk_size);
+    bool ok = true;
+    for (size_t i = 0; ok && i < header.n_chunks; i++)
+        ok = inflateChunk(span.data, header, offsets, i, chunk.data()) &&
+             writeAll(output_fd, chunk.data(), chunkLength(header, i), (off_t)i * header.chunk_size);
+    close(output_fd);
+    if (!ok)
+        std::cout << "could not inflate " << output_name << std::endl;
+    return ok;
+}
+
+// writes a split file's pieces out in file order, each one copied as a whole
+inline bool extractSplit(CabImage &image, const dir_entry &entry, const std::string &output_name, CopyBuffer &copy_buffer)
+{
+    size_t block_size = image.blockSize();
+    std::vector<file_extent> extents;
+    if (!readExtentMap(image.fd(), entry, block_size, image.bootRecord()->total_blocks, extents))
+    {
+        std::cout << output_name << " has no valid extent map" << std::endl;
+        return false;
+    }
+
+    int output_fd = open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0)
+    {
+        std::cout << "could not create " << output_name << std::endl;
+        return false;
+    }
+    if (entry.file_size_in_bytes > 0)
+        fallocate(output_fd, 0, 0, entry.file_size_in_bytes);
+
+    bool copied = forEachExtentRange(extents, block_size, entry.file_size_in_bytes, [&](off_t image_offset, off_t file_offset, size_t length) {
+        return copyRange(image.fd(), image_offset, output_fd, file_offset, length, copy_buffer);
+    });
+    close(output_fd);
+    if (!copied)
+        std::cout << "could not write " << output_name << std::endl;
+    return copied;
+}
+
+// copies the entry's bytes into output_name without staging them in user space: the kernel
+// copies image to file (copy_file_range, sendfile), else the mapped extent is written out
+// directly, and only as a last resort the data goes through copy_buffer
+inline bool extractFile(CabImage &image, const dir_entry &entry, const std::string &output_name, CopyBuffer &copy_buffer)
+{
+    CAB_STAT_PHASE(PHASE_COPY_DATA);
+    if (entry.file_type == COMPRESSED_TYPE)
+        return extractCompressed(image, entry, output_name);
+    if (entry.file_type == EXTENTS_TYPE)
+        return extractSplit(image, entry, output_name, copy_buffer);
+    extent_span span = image.fileData(entry);
+    if (span.data == nullptr)
+    {
+        std::cout << output_name << " points past the end of the image" << std::endl;
+        return false;
+    }
+
+    int output_fd = open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0)
+    {
+        std::cout << "could not create " << output_name << std::endl;
+        return false;
+    }
+    // reserve the whole file up front so it is not extended write by write
+    if (span.size > 0)
+        fallocate(output_fd, 0, 0, span.size);
+
+    off_t data_offset = entryDataOffset(entry, image.blockSize());
+    bool copied = copyRange(image.fd(), data_offset, output_fd, 0, span.size, copy_buffer, COPY_FILE_RANGE) ||
+                  copyRange(image.fd(), data_offset, output_fd, 0, span.size, copy_buffer, COPY_SENDFILE) ||
+                  writeAll(output_fd, span.data, span.size, 0) ||
+                  copyRange(image.fd(), data_offset, output_fd, 0, span.size, copy_buffer, COPY_BUFFERED);
+    close(output_fd);
+    if (!copied)
+        std::cout << "could not write " << output_name << std::endl;
+    return copied;
+}
+
+#endif
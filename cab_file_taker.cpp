@@ -1,252 +1,237 @@
-#include <iostream>
-#include <fstream>
-#include <string>
-#include <vector>
-#include <memory>
-#include <cstring>
-#include <cmath>
-
-const unsigned int SECTORS_PER_BLOCK = 1;
-const unsigned int BYTES_PER_SECTOR = 512;
-const unsigned int N_ROOT_ENTRIES = 1024;
-const unsigned char DIRECTORY_TYPE = 1;
-const unsigned char BINARY_TYPE = 0;
-const unsigned int ENTRY_SIZE = 32;
-const unsigned int DIR_SIZE_IN_BLOCKS = (N_ROOT_ENTRIES * ENTRY_SIZE) / (SECTORS_PER_BLOCK * BYTES_PER_SECTOR);
-const size_t OUT_OF_FREE_SPACE = 0;
-
-typedef struct boot_record
-{
-    unsigned int sectors_per_block;
-    unsigned int bytes_per_sector;
-    unsigned int total_blocks;
-    unsigned int bitmap_size_in_blocks;
-    unsigned int n_root_entries;
+#include <chrono>
 
-    unsigned char padding[492];
-} __attribute__((packed)) boot_record;
+#include "cab_fs.hpp"
+#include "cab_image.hpp"
+#include "cab_dir.hpp"
+#include "cab_extract.hpp"
+#include "cab_range.hpp"
+#include "cab_client.hpp"
 
-typedef struct dir_entry
-{
-    unsigned int first_block;
-    unsigned int file_size_in_bytes;
-    unsigned char file_type;
-    char file_name[23];
-} __attribute__((packed)) dir_entry;
+// gets kept in flight per connection when the files come from cabd
+const size_t DAEMON_WINDOW = 16;
 
-class BitMap
-{
-public:
-    BitMap(const boot_record b_record)
-        : b_record(b_record)
-    {
-        bit_map.resize(b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector);
-        addressable_bits = b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector * 8;
-    }
+// file_name may be a path ("logs/a.txt"); entries are read straight from the mapping
+dir_entry searchFile(PathResolver &resolver, std::string file_name){
+    dir_entry entrada;
+    
+    dir_entry* found = resolver.lookup(file_name);
 
-    BitMap(std::ifstream &disk)
+    //retorna estrutura vazia
+    if(found == nullptr || !isFileEntry(*found)) return dir_entry();
+    else
     {
-        boot_record temp_b_record;
-        disk.seekg(0);
-        disk.read((char *)(&temp_b_record), 512);
-        b_record = temp_b_record;
+        entrada = *found;
+        return entrada;
+    }
+}
 
-        bit_map.resize(b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector);
-        addressable_bits = b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector * 8;
+void printExtracted(size_t files_extracted, size_t bytes_extracted, double elapsed)
+{
+    std::cout << "extracted " << files_extracted << " files, " << bytes_extracted << " bytes in " << elapsed << " s";
+    if (elapsed > 0)
+        std::cout << " (" << (bytes_extracted / elapsed) / (1024 * 1024) << " MB/s)";
+    std::cout << std::endl;
+}
 
-        loadBufferFromImage(disk);
+// thin client: every file is a get from the daemon serving image_name
+bool extractThroughDaemon(const std::string &socket_path, const std::string &image_name, const std::vector<std::string> &file_names,
+                          size_t &files_extracted, size_t &bytes_extracted)
+{
+    CabClient client;
+    uint32_t image;
+    if (!client.connect(socket_path) || !client.openImage(image_name, image))
+    {
+        std::cout << "could not reach cabd on " << socket_path << " for " << image_name << std::endl;
+        return false;
     }
 
-    void format()
+    bool ok = true;
+    size_t sent = 0;
+    for (size_t received = 0; received < file_names.size(); received++)
     {
-        fillReservedBlocks();
-        fillNonReachableBlocks();
-        defaultUsableToZero();
+        for (; sent < file_names.size() && sent < received + DAEMON_WINDOW; sent++)
+        {
+            if (!client.send(CAB_OP_GET, image, file_names[sent], nullptr, 0))
+                return false;
+        }
+        response_header response;
+        std::vector<char> data;
+        if (!client.receive(response, data))
+            return false;
+        if (response.status != CAB_OK)
+        {
+            std::cout << file_names[received] << ": " << statusName(response.status) << std::endl;
+            ok = false;
+            continue;
+        }
+        std::string output_name = PathResolver::splitPath(file_names[received]).back();
+        int output_fd = open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output_fd < 0 || !writeAll(output_fd, data.data(), data.size(), 0))
+        {
+            std::cout << "could not write " << output_name << std::endl;
+            ok = false;
+        }
+        else
+        {
+            files_extracted++;
+            bytes_extracted += data.size();
+        }
+        if (output_fd >= 0)
+            close(output_fd);
     }
+    return ok;
+}
 
-    std::vector<unsigned char> getBuffer()
+// read mode: the byte ranges (offset, length pairs) of one file written to stdout in the order
+// asked, without extracting the file; all the ranges go to the image as one batch
+int readRanges(const std::string &image_name, const std::string &file_name, const std::vector<std::pair<uint64_t, uint64_t>> &ranges)
+{
+    CabImage image;
+    if (!image.open(image_name, false) || !image.isFormatted())
     {
-        return bit_map;
+        std::cerr << "could not open image " << image_name << std::endl;
+        return 1;
     }
-
-    unsigned char getBit(size_t bit_index)
+    DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+    PathResolver resolver(image, dir_index);
+    dir_entry *entry = resolver.lookup(file_name);
+    RangeReader reader;
+    if (entry == nullptr || !reader.open(image, *entry))
     {
-
-        size_t byte_index = bit_index / 8;
-        unsigned char offset = bit_index % 8;
-        unsigned char mask = 0b10000000 >> offset;
-
-        return (bit_map[byte_index] & mask) >> (7 - offset);
+        std::cerr << file_name << (entry == nullptr ? " not found" : " cannot be read") << std::endl;
+        return 1;
     }
 
-    void setBit(size_t bit_index, unsigned char value)
+    std::vector<range_request> requests;
+    size_t total = 0;
+    for (const auto &range : ranges)
     {
-
-        // value is expected to be either 00000001 or 00000000
-        value = value << 7;
-        size_t byte_index = bit_index / 8;
-        unsigned char offset = bit_index % 8;
-        unsigned char mask = value >> offset;
-        // std::cout << "settando o bit \n";
-        // std::cout << "byte index == " << bit_map[byte_index] << std::endl;
-        bit_map[byte_index] = bit_map[byte_index] | mask;
-        // std::cout << "settei o bit\n";
+        uint64_t offset = range.first;
+        // nothing past the end of the file is buffered
+        size_t length = offset >= reader.size() ? 0 : std::min(range.second, reader.size() - offset);
+        requests.push_back({offset, length, nullptr, 0});
+        total += length;
     }
-
-    size_t getAdressableBits()
+    std::vector<char> data(total);
+    for (size_t r = 0, at = 0; r < requests.size(); at += requests[r++].length)
+        requests[r].buffer = data.data() + at;
+    if (reader.readBatch(requests) != 0)
     {
-        return addressable_bits;
+        std::cerr << "could not read " << file_name << std::endl;
+        return 1;
     }
+    std::cout.write(data.data(), data.size());
+    std::cout.flush();
+    return std::cout.good() ? 0 : 1;
+}
+
+void printUsage(const char *program)
+{
+    std::cout << "usage: " << program << " [--daemon SOCKET] [--stats] <image> <file> [file ...]\n"
+              << "       " << program << " [--stats] read <image> <file> <offset> <length> [<offset> <length> ...]\n"
+              << "  read: the byte ranges of the file to stdout, without extracting it\n";
+}
+
+int main(int argc, char** argv){
 
-    void writeBits(size_t first_bit, size_t size, unsigned char bit_to_write)
+    const char *program = argv[0];
+    std::string daemon_socket;
+    bool show_stats = false;
+    for (;;)
     {
-        // bit to write is expected to be either 00000001 or 00000000
-        for (size_t i = first_bit; i < first_bit + size; i++)
+        if (argc > 2 && std::string(argv[1]) == "--daemon")
         {
-            // std::cout << "iteração n " << i << std::endl;
-            setBit(i, bit_to_write);
+            daemon_socket = argv[2];
+            argc -= 2;
+            argv += 2;
         }
-    }
-
-    size_t getFirstBlock(size_t block_amount)
-    {
-        size_t address_first_block = OUT_OF_FREE_SPACE;
-        size_t first_current = 0;
-        size_t contiguous_blocks_found = 0;
-        for (size_t i = 0; i < addressable_bits; i++)
+        else if (argc > 1 && std::string(argv[1]) == "--stats")
         {
-            unsigned char bit = getBit(i);
-
-            if (first_current == 0)
-            {
-                first_current = i;
-            }
-
-            if (bit == 0)
-            {
-                contiguous_blocks_found++;
-            }
-            else
-            {
-                contiguous_blocks_found = 0;
-                first_current = 0;
-            }
-
-            if (contiguous_blocks_found == block_amount)
-            {
-                address_first_block = first_current;
-                break;
-            }
+            show_stats = true;
+            argc--;
+            argv++;
         }
-
-        return address_first_block;
+        else
+            break;
     }
-
-private:
-    boot_record b_record;
-    size_t addressable_bits;
-    std::vector<unsigned char> bit_map;
-
-    void fillReservedBlocks()
+    if (argc > 1 && std::string(argv[1]) == "read")
     {
-
-        // 1 because of the boot record block
-        size_t reserved_blocks = 1 + b_record.bitmap_size_in_blocks;
-        for (size_t i = 0; i < reserved_blocks; i++)
+        // whole offset/length pairs only, a missing length is not read as something else
+        bool valid = argc >= 6 && argc % 2 == 0 && daemon_socket.empty();
+        std::vector<std::pair<uint64_t, uint64_t>> ranges(valid ? (argc - 4) / 2 : 0);
+        for (size_t r = 0; valid && r < ranges.size(); r++)
+            valid = parseNumber(argv[4 + 2 * r], ranges[r].first) && parseNumber(argv[5 + 2 * r], ranges[r].second);
+        if (!valid)
         {
-            this->setBit(i, 1);
+            printUsage(program);
+            return 1;
         }
+        int status = readRanges(argv[2], argv[3], ranges);
+        if (show_stats)
+            printStats("cab_file_taker");
+        return status;
     }
-
-    void fillNonReachableBlocks()
+    if (argc < 3)
     {
-
-        size_t non_reachable_blocks = addressable_bits - b_record.total_blocks;
-        for (size_t i = addressable_bits - 1; i >= b_record.total_blocks; i--)
-        {
-            this->setBit(i, 1);
-        }
+        printUsage(program);
+        return 1;
     }
 
-    void defaultUsableToZero()
+    std::string file_name_image = argv[1];
+    if (!daemon_socket.empty())
     {
-        size_t reserved_blocks = 1 + b_record.bitmap_size_in_blocks;
-        for (size_t i = reserved_blocks; i < b_record.total_blocks; i++)
-        {
-            this->setBit(i, 0);
-        }
+        auto start = std::chrono::steady_clock::now();
+        size_t files_extracted = 0;
+        size_t bytes_extracted = 0;
+        bool ok = extractThroughDaemon(daemon_socket, file_name_image, std::vector<std::string>(argv + 2, argv + argc),
+                                       files_extracted, bytes_extracted);
+        printExtracted(files_extracted, bytes_extracted, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        if (show_stats)
+            printStats("cab_file_taker");
+        return ok ? 0 : 1;
     }
 
-    void loadBufferFromImage(std::ifstream &readable_file)
+    CabImage image;
+    if (!image.open(file_name_image, false) || !image.isFormatted())
     {
-        size_t bitmap_total_bytes = b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector;
-        // putting the head on the beggining of bitmpap
-        readable_file.seekg(b_record.bytes_per_sector * b_record.sectors_per_block);
-        for (size_t i = 0; i < bitmap_total_bytes; i++)
-        {
-            bit_map[i] = readable_file.get();
-        }
+        std::cout << "could not open image " << file_name_image << std::endl;
+        return 1;
     }
-};
-
-unsigned int getDiskSize(std::ifstream &readable_file)
-{
-
-    readable_file.seekg(0, std::ios::end);
-    auto disk_size = readable_file.tellg();
-    return disk_size;
-}
-
-dir_entry* loadRootDir(std::ifstream& readable_file, boot_record& b_record){
 
-    dir_entry* current_dir = (dir_entry*)malloc(N_ROOT_ENTRIES * sizeof(dir_entry));
-    readable_file.seekg((1 + b_record.bitmap_size_in_blocks) * b_record.bytes_per_sector * b_record.sectors_per_block);
-    readable_file.read((char*)current_dir, N_ROOT_ENTRIES);
-    return current_dir;
-}
+    DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+    PathResolver resolver(image, dir_index);
+    CopyBuffer copy_buffer;
 
-dir_entry searchFile(std::ifstream &readable_file, boot_record &b_record, std::string file_name){
-    dir_entry entrada;
-    
-    dir_entry* entradas_root_dir = loadRootDir(readable_file, b_record);
-
-    size_t index = 0;
-    for(size_t i = 0; i < b_record.n_root_entries; i++){
-        std::string file_name_current(entradas_root_dir[i].file_name);
-        if(file_name_current == file_name){
-            index = i;
-            break;
+    auto start = std::chrono::steady_clock::now();
+    size_t files_extracted = 0;
+    size_t bytes_extracted = 0;
+    int status = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        std::string file_name_to_read = argv[i];
+        dir_entry entry = searchFile(resolver, file_name_to_read);
+        if (entry.first_block == 0)
+        {
+            std::cout << file_name_to_read << " not found" << std::endl;
+            status = 1;
+            continue;
         }
-    }
 
-    //retorna estrutura vazia
-    if(index == 0) return dir_entry();
-    else
-    {
-        entrada = entradas_root_dir[index];
-        return entrada;
+        // será escrito no diretório atual, com o último componente do caminho como nome
+        std::string output_name = PathResolver::splitPath(file_name_to_read).back();
+        if (!extractFile(image, entry, output_name, copy_buffer))
+        {
+            status = 1;
+            continue;
+        }
+        files_extracted++;
+        bytes_extracted += extractedSize(image, entry);
     }
-}
 
-boot_record readBootRecord(std::ifstream &readable_file){
-    boot_record b_record;
-    readable_file.seekg(0);
-    readable_file.read((char*)&b_record, sizeof(boot_record));
+    printExtracted(files_extracted, bytes_extracted, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
 
-    return b_record;
+    image.close();
+    if (show_stats)
+        printStats("cab_file_taker");
+    return status;
 }
-
-int main(int argc, char** argv){
-
-    std::string file_name_image = argv[1];
-    std::ifstream readable_file(file_name_image, std::ios::binary | std::ios::ate);
-    boot_record b_record = readBootRecord(readable_file);
-
-    std::string file_name_to_read = argv[2];
-
-    dir_entry entry = searchFile(readable_file, b_record, file_name_image);
-    
-
-    readable_file.close();
-    return 0;
-}
\ No newline at end of file
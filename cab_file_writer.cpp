@@ -1,292 +1,363 @@
-#include <iostream>
-#include <fstream>
-#include <string>
-#include <vector>
-#include <memory>
-#include <cstring>
-#include <cmath>
+#include <chrono>
 
-const unsigned int SECTORS_PER_BLOCK = 1;
-const unsigned int BYTES_PER_SECTOR = 512;
-const unsigned int N_ROOT_ENTRIES = 1024;
-const unsigned char DIRECTORY_TYPE = 1;
-const unsigned char BINARY_TYPE = 0;
-const unsigned int ENTRY_SIZE = 32;
-const unsigned int DIR_SIZE_IN_BLOCKS = (N_ROOT_ENTRIES * ENTRY_SIZE) / (SECTORS_PER_BLOCK * BYTES_PER_SECTOR);
-const size_t OUT_OF_FREE_SPACE = 0;
+#include <deque>
 
-typedef struct boot_record
-{
-    unsigned int sectors_per_block;
-    unsigned int bytes_per_sector;
-    unsigned int total_blocks;
-    unsigned int bitmap_size_in_blocks;
-    unsigned int n_root_entries;
-
-    unsigned char padding[492];
-} __attribute__((packed)) boot_record;
+#include "cab_import.hpp"
+#include "cab_client.hpp"
 
-typedef struct dir_entry
-{
-    unsigned int first_block;
-    unsigned int file_size_in_bytes;
-    unsigned char file_type;
-    char file_name[23];
-} __attribute__((packed)) dir_entry;
+// puts kept in flight per connection when the files go through cabd
+const size_t DAEMON_WINDOW = 64;
 
-class BitMap
+// one file name per line, blank lines are ignored
+std::vector<std::string> readFileList(std::istream &list)
 {
-public:
-    BitMap(const boot_record b_record)
-        : b_record(b_record)
+    std::vector<std::string> file_names;
+    std::string line;
+    while (std::getline(list, line))
     {
-        bit_map.resize(b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector);
-        addressable_bits = b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector * 8;
-    }
-
-    BitMap(std::ifstream &disk)
-    {
-        boot_record temp_b_record;
-        disk.seekg(0);
-        disk.read((char *)(&temp_b_record), 512);
-        b_record = temp_b_record;
-
-        bit_map.resize(b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector);
-        addressable_bits = b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector * 8;
-
-        loadBufferFromImage(disk);
-    }
-
-    void format()
-    {
-        fillReservedBlocks();
-        fillNonReachableBlocks();
-        defaultUsableToZero();
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            file_names.push_back(line);
     }
+    return file_names;
+}
 
-    std::vector<unsigned char> getBuffer()
+void printBatch(const batch_stats &stats, double elapsed)
+{
+    std::cout << "batch: " << stats.files_written << " files written, " << stats.files_skipped << " skipped, "
+              << stats.bytes_written << " bytes in " << elapsed << " s";
+    if (elapsed > 0)
+        std::cout << " (" << (stats.bytes_written / elapsed) / (1024 * 1024) << " MB/s, "
+                  << stats.files_written / elapsed << " files/s)";
+    std::cout << std::endl;
+    if (stats.files_deduplicated != 0)
     {
-        return bit_map;
+        std::cout << "dedup: " << stats.files_deduplicated << " files (" << stats.bytes_deduplicated << " bytes) point at extents already in the image";
+        if (stats.bytes_written != 0)
+            std::cout << ", ratio " << (double)(stats.bytes_written + stats.bytes_deduplicated) / stats.bytes_written;
+        std::cout << std::endl;
     }
+}
 
-    unsigned char getBit(size_t bit_index)
+// thin client: every file is a put to the daemon serving image_name, DAEMON_WINDOW at a time;
+// the daemon owns the image's metadata and commits it
+bool importThroughDaemon(const std::string &socket_path, const std::string &image_name, const std::vector<std::string> &file_names,
+                         bool verbose, batch_stats &stats)
+{
+    CabClient client;
+    uint32_t image;
+    if (!client.connect(socket_path) || !client.openImage(image_name, image))
     {
-
-        size_t byte_index = bit_index / 8;
-        unsigned char offset = bit_index % 8;
-        unsigned char mask = 0b10000000 >> offset;
-
-        return (bit_map[byte_index] & mask) >> (7 - offset);
+        std::cout << "could not reach cabd on " << socket_path << " for " << image_name << std::endl;
+        return false;
     }
 
-    void setBit(size_t bit_index, unsigned char value)
+    std::deque<std::pair<std::string, size_t>> in_flight;
+    auto collect = [&]() {
+        response_header response;
+        std::vector<char> reply;
+        if (!client.receive(response, reply))
+            return false;
+        auto file = in_flight.front();
+        in_flight.pop_front();
+        if (response.status != CAB_OK)
+        {
+            std::cout << "could not write " << file.first << ": " << statusName(response.status) << std::endl;
+            stats.files_skipped++;
+            return true;
+        }
+        if (verbose)
+            std::cout << file.first << ": " << file.second << " bytes" << std::endl;
+        stats.files_written++;
+        stats.bytes_written += file.second;
+        return true;
+    };
+
+    for (const std::string &file_name : file_names)
     {
-
-        // value is expected to be either 00000001 or 00000000
-        value = value << 7;
-        size_t byte_index = bit_index / 8;
-        unsigned char offset = bit_index % 8;
-        unsigned char mask = value >> offset;
-        // std::cout << "settando o bit \n";
-        // std::cout << "byte index == " << bit_map[byte_index] << std::endl;
-        bit_map[byte_index] = bit_map[byte_index] | mask;
-        // std::cout << "settei o bit\n";
+        int file_fd = open(file_name.c_str(), O_RDONLY);
+        struct stat file_stat;
+        if (file_fd < 0 || fstat(file_fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+        {
+            std::cout << "could not open " << file_name << std::endl;
+            stats.files_skipped++;
+            if (file_fd >= 0)
+                close(file_fd);
+            continue;
+        }
+        // one the protocol cannot carry is skipped here, the connection is still good
+        if ((uint64_t)file_stat.st_size > CAB_PROTO_MAX_PAYLOAD || file_name.size() > CAB_PROTO_MAX_PATH)
+        {
+            cab_status status = file_name.size() > CAB_PROTO_MAX_PATH ? CAB_INVALID : CAB_TOO_LARGE;
+            std::cout << "could not write " << file_name << ": " << statusName(status) << std::endl;
+            stats.files_skipped++;
+            close(file_fd);
+            continue;
+        }
+        bool sent = client.sendFile(image, file_name, file_fd, file_stat.st_size);
+        close(file_fd);
+        if (!sent)
+        {
+            std::cout << "lost the connection to cabd" << std::endl;
+            return false;
+        }
+        in_flight.push_back({file_name, (size_t)file_stat.st_size});
+        if (in_flight.size() >= DAEMON_WINDOW && !collect())
+            return false;
     }
-
-    size_t getAdressableBits()
+    while (!in_flight.empty())
     {
-        return addressable_bits;
+        if (!collect())
+            return false;
     }
+    return true;
+}
 
-    void writeBits(size_t first_bit, size_t size, unsigned char bit_to_write)
-    {
-        // bit to write is expected to be either 00000001 or 00000000
-        for (size_t i = first_bit; i < first_bit + size; i++)
-        {
-            // std::cout << "iteração n " << i << std::endl;
-            setBit(i, bit_to_write);
-        }
-    }
+void printUsage(const char *program)
+{
+    std::cout << "usage: " << program << " [options] <image> <file> [file ...]\n"
+              << "       " << program << " [options] <image> -m <manifest>   (one file name per line)\n"
+              << "       " << program << " [options] <image> -               (file names read from stdin)\n"
+              << "       " << program << " [options] --stdin <name> <image> [file ...]   (stdin stored as <name>)\n"
+              << "  -j N                  copy N files at a time (default 1)\n"
+              << "  -q                    only report errors and the batch summary\n"
+              << "  --io posix|io_uring   copy through a block I/O backend, batching many files\n"
+              << "  --direct              with --io, write the image with O_DIRECT\n"
+              << "  --policy P            best-fit, first-fit, next-fit or size-class for this run\n"
+              << "                        (default: the policy recorded at format time; all but\n"
+              << "                        best-fit search the free extents in address order,\n"
+              << "                        slower as free space fragments)\n"
+              << "  --commit-every N      commit the bitmap and directories every N files\n"
+              << "                        (default: once, after the last file)\n"
+              << "  --compress            store the files deflated, in 64 KiB chunks\n"
+              << "  --dedup               files identical to one already in the image share its extent\n"
+              << "  --pack                files up to a quarter block share pack blocks instead of a block each\n"
+              << "  --contiguous          skip a file no free run can hold instead of splitting it over several\n"
+              << "  --stdin NAME          also store standard input, read to its end, as NAME\n"
+              << "  --daemon SOCKET       send the files to the cabd serving the image instead\n"
+              << "  --stats               print time per phase, I/O counters and allocation latencies as JSON\n";
+}
 
-    size_t getFirstBlock(size_t block_amount)
+int main(int argc, const char **argv)
+{
+    const char *program = argv[0];
+    unsigned int n_threads = 1;
+    bool verbose = true;
+    bool use_block_io = false;
+    block_io_backend backend = BLOCK_IO_POSIX;
+    bool direct = false;
+    bool override_policy = false;
+    alloc_policy policy = ALLOC_BEST_FIT;
+    std::string daemon_socket;
+    size_t commit_window = 0;
+    bool show_stats = false;
+    size_t compression_chunk = 0;
+    bool dedup = false;
+    bool pack = false;
+    size_t max_extents = MAX_FILE_EXTENTS;
+    std::string stdin_name;
+    int arg = 1;
+    for (; arg < argc; arg++)
     {
-        size_t address_first_block = OUT_OF_FREE_SPACE;
-        size_t first_current = 0;
-        size_t contiguous_blocks_found = 0;
-        for (size_t i = 0; i < addressable_bits; i++)
+        std::string option = argv[arg];
+        if ((option == "-j" || option == "--threads") && arg + 1 < argc)
         {
-            unsigned char bit = getBit(i);
-
-            if (first_current == 0)
+            if (!parseNumber(argv[++arg], n_threads))
             {
-                first_current = i;
+                printUsage(program);
+                return 1;
             }
-
-            if (bit == 0)
+            n_threads = std::max(1u, n_threads);
+        }
+        else if (option == "-q")
+            verbose = false;
+        else if (option == "--io" && arg + 1 < argc)
+        {
+            std::string name = argv[++arg];
+            use_block_io = true;
+            if (name == "io_uring" || name == "uring")
+                backend = BLOCK_IO_URING;
+            else if (name != "posix")
             {
-                contiguous_blocks_found++;
+                printUsage(program);
+                return 1;
             }
-            else
+        }
+        else if (option == "--direct")
+            direct = true;
+        else if (option == "--policy" && arg + 1 < argc)
+        {
+            override_policy = true;
+            if (!parsePolicy(argv[++arg], policy))
             {
-                contiguous_blocks_found = 0;
-                first_current = 0;
+                printUsage(program);
+                return 1;
             }
-
-            if (contiguous_blocks_found == block_amount)
+        }
+        else if (option == "--daemon" && arg + 1 < argc)
+            daemon_socket = argv[++arg];
+        else if (option == "--commit-every" && arg + 1 < argc)
+        {
+            if (!parseNumber(argv[++arg], commit_window))
             {
-                address_first_block = first_current;
-                break;
+                printUsage(program);
+                return 1;
             }
         }
-
-        return address_first_block;
+        else if (option == "--stats")
+            show_stats = true;
+        else if (option == "--compress")
+            compression_chunk = DEFAULT_COMPRESSION_CHUNK;
+        else if (option == "--dedup")
+            dedup = true;
+        else if (option == "--pack")
+            pack = true;
+        else if (option == "--contiguous")
+            max_extents = 1;
+        else if (option == "--stdin" && arg + 1 < argc)
+            stdin_name = argv[++arg];
+        else
+            break;
     }
+    argc -= arg - 1;
+    argv += arg - 1;
 
-private:
-    boot_record b_record;
-    size_t addressable_bits;
-    std::vector<unsigned char> bit_map;
-
-    void fillReservedBlocks()
+    if (argc < 3 && (argc < 2 || stdin_name.empty()))
     {
+        printUsage(program);
+        return 1;
+    }
+    if (compression_chunk != 0 && (use_block_io || !daemon_socket.empty() || !compressionAvailable()))
+    {
+        std::cout << (compressionAvailable() ? "--compress cannot be combined with --io or --daemon"
+                                             : "built without zlib, --compress is not available") << std::endl;
+        return 1;
+    }
+    if ((dedup || pack) && (use_block_io || !daemon_socket.empty()))
+    {
+        std::cout << (dedup ? "--dedup" : "--pack") << " cannot be combined with --io or --daemon" << std::endl;
+        return 1;
+    }
+    if (max_extents == 1 && !daemon_socket.empty())
+    {
+        std::cout << "--contiguous cannot be combined with --daemon" << std::endl;
+        return 1;
+    }
+    if (!stdin_name.empty() && (!daemon_socket.empty() || (argc == 3 && std::string(argv[2]) == "-")))
+    {
+        std::cout << "--stdin cannot be combined with --daemon or a file list on stdin" << std::endl;
+        return 1;
+    }
 
-        // 1 because of the boot record block
-        size_t reserved_blocks = 1 + b_record.bitmap_size_in_blocks;
-        for (size_t i = 0; i < reserved_blocks; i++)
+    std::string file_name_image = argv[1];
+    std::vector<std::string> files_to_write;
+    std::string first_arg = argc > 2 ? argv[2] : "";
+    if (first_arg == "-m" && argc == 4)
+    {
+        std::ifstream manifest(argv[3]);
+        if (!manifest.is_open())
         {
-            this->setBit(i, 1);
+            std::cout << "could not open manifest " << argv[3] << std::endl;
+            return 1;
         }
+        files_to_write = readFileList(manifest);
+    }
+    else if (first_arg == "-" && argc == 3)
+    {
+        files_to_write = readFileList(std::cin);
+    }
+    else
+    {
+        for (int i = 2; i < argc; i++)
+            files_to_write.push_back(argv[i]);
     }
 
-    void fillNonReachableBlocks()
+    auto batch_start = std::chrono::steady_clock::now();
+    batch_stats stats = {0, 0, 0, 0, 0, 0};
+    if (!daemon_socket.empty())
     {
+        bool served = importThroughDaemon(daemon_socket, file_name_image, files_to_write, verbose, stats);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count();
+        printBatch(stats, elapsed);
+        if (show_stats)
+            printStats("cab_file_writer");
+        return served && stats.files_skipped == 0 ? 0 : 1;
+    }
 
-        size_t non_reachable_blocks = addressable_bits - b_record.total_blocks;
-        for (size_t i = addressable_bits - 1; i >= b_record.total_blocks; i--)
-        {
-            this->setBit(i, 1);
-        }
+    CabImage image;
+    if (!image.open(file_name_image, true) || !image.isFormatted())
+    {
+        std::cout << "could not open image " << file_name_image << std::endl;
+        return 1;
     }
 
-    void defaultUsableToZero()
+    // the bitmap is used in place over the mapping, only the extent index is built...
+    BitMap bmap(*image.bootRecord(), image.bitmapBytes());
+    bmap.buildExtentIndex();
+    if (override_policy)
+        bmap.setPolicy(policy);
+    DirIndex dir_index(image.rootDir(), image.bootRecord()->n_root_entries);
+    PathResolver resolver(image, dir_index);
+
+    DedupIndex dedup_index;
+    if (dedup && !dedup_index.load(image))
     {
-        size_t reserved_blocks = 1 + b_record.bitmap_size_in_blocks;
-        for (size_t i = reserved_blocks; i < b_record.total_blocks; i++)
-        {
-            this->setBit(i, 0);
-        }
+        std::cout << "could not read the dedup index of " << file_name_image << std::endl;
+        return 1;
+    }
+    // pipes have no size to reserve up front, they are streamed in after the other files
+    std::vector<std::string> regular_files, stream_files;
+    for (const std::string &file_name : files_to_write)
+    {
+        struct stat file_stat;
+        if (stat(file_name.c_str(), &file_stat) == 0 && S_ISFIFO(file_stat.st_mode))
+            stream_files.push_back(file_name);
+        else
+            regular_files.push_back(file_name);
     }
 
-    void loadBufferFromImage(std::ifstream &readable_file)
+    PackWriter packer(image, bmap);
+    import_context context = {file_name_image, image, bmap, resolver, verbose, commit_window, compression_chunk,
+                              dedup ? &dedup_index : nullptr, pack ? &packer : nullptr, max_extents};
+    if (use_block_io)
     {
-        size_t bitmap_total_bytes = b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector;
-        // putting the head on the beggining of bitmpap
-        readable_file.seekg(b_record.bytes_per_sector * b_record.sectors_per_block);
-        for (size_t i = 0; i < bitmap_total_bytes; i++)
+        std::unique_ptr<BlockIO> io = openBlockIO(file_name_image, backend, direct, image.blockSize());
+        if (!io)
         {
-            bit_map[i] = readable_file.get();
+            std::cout << "could not set up the block I/O backend" << std::endl;
+            return 1;
         }
+        importFilesBlockIO(context, regular_files, *io, stats);
     }
-};
-
-unsigned int getDiskSize(std::ifstream &readable_file)
-{
-
-    readable_file.seekg(0, std::ios::end);
-    auto disk_size = readable_file.tellg();
-    return disk_size;
-}
+    else
+        importFiles(context, regular_files, n_threads, stats);
 
-dir_entry* loadRootDir(std::ifstream& readable_file, boot_record b_record){
-
-    dir_entry* current_dir = (dir_entry*)malloc(N_ROOT_ENTRIES * sizeof(dir_entry));
-    readable_file.seekg((1 + b_record.bitmap_size_in_blocks) * b_record.bytes_per_sector * b_record.sectors_per_block);
-    readable_file.read((char*)current_dir, N_ROOT_ENTRIES);
-    return current_dir;
-}
-
-void writeToCAB(std::ifstream &readable_file, std::ofstream &writable_file, boot_record &b_record, std::string file_name)
-{
-    std::ifstream file_to_write(file_name, std::ios::binary | std::ios::ate);
-    BitMap bmap(readable_file);
-    char buf = ' ';
-    // obtaining file's size in order to calculate how many blocks it needs
-    unsigned int file_size = getDiskSize(file_to_write);
-    std::cout << "file size == " << file_size << std::endl;
-
-    unsigned int blocks_for_file = ceil(((double)file_size / (b_record.sectors_per_block * b_record.bytes_per_sector)));
-    size_t first_block = bmap.getFirstBlock(blocks_for_file);
-    std::cout << "blocks_for_file == " << blocks_for_file << std::endl;
-    std::cout << "first block == " << first_block << std::endl;
-
-    //if there is a big enough contiguous block
-    if(first_block){
-
-        // first write file's binary entry in the directory required
-        dir_entry file_entry;
-        file_entry.first_block = first_block;
-        file_entry.file_size_in_bytes = file_size;
-        file_entry.file_type = 0;
-        strcpy(file_entry.file_name, &*file_name.begin());
-
-        // getting all the dir entries in an array
-        dir_entry* current_dir = loadRootDir(readable_file, b_record);
-        
-        //finding an empty root dir entry
-        size_t available_entry_index;
-        for(size_t i = 0; i < b_record.n_root_entries; i++){
-            if(current_dir[i].file_type == 0xff || current_dir[i].first_block == 0x0){
-                available_entry_index = i;
-                break;
-            }
+    CopyBuffer copy_buffer;
+    for (const std::string &file_name : stream_files)
+    {
+        int input_fd = open(file_name.c_str(), O_RDONLY);
+        if (input_fd < 0)
+        {
+            std::cout << "could not open " << file_name << std::endl;
+            stats.files_skipped++;
+            continue;
         }
-        std::cout << "available_entry_index = " << available_entry_index << std::endl;
-
-        //writing dir_entry in disk
-        writable_file.seekp(0);
-        writable_file.seekp((ENTRY_SIZE * available_entry_index) + (1 + b_record.bitmap_size_in_blocks) * b_record.bytes_per_sector * b_record.sectors_per_block);
-        writable_file.write((const char*)&file_entry, ENTRY_SIZE);
-
-        //write file
-        
-        writable_file.seekp(file_entry.first_block * b_record.sectors_per_block * b_record.bytes_per_sector);
-        //for now, it is loading the entire file on memory instead of buffering to write on the filesystem
-        file_to_write.seekg(0);
-        std::string file_buffer_string((std::istreambuf_iterator<char>(file_to_write)), std::istreambuf_iterator<char>());
-        std::cout << "file buffer = \n" << file_buffer_string.c_str() << std::endl;
-        writable_file.write((const char*)&*file_buffer_string.begin(), file_size);
-
-        bmap.writeBits(first_block, blocks_for_file, 1);
-
-        writable_file.seekp(b_record.bytes_per_sector * b_record.sectors_per_block);
-        writable_file.write((const char*)&*(bmap.getBuffer().begin()), b_record.bitmap_size_in_blocks * b_record.sectors_per_block * b_record.bytes_per_sector);
-        free((void*)current_dir);
+        streamToCAB(context, input_fd, file_name, copy_buffer, stats);
+        close(input_fd);
     }
-}
-
-boot_record readBootRecord(std::ifstream &readable_file){
-    boot_record b_record;
-    readable_file.seekg(0);
-    readable_file.read((char*)&b_record, sizeof(boot_record));
-
-    return b_record;
-}
-
-int main(int argc, const char **argv)
-{
-    std::string file_name_image = argv[1];
-    std::ifstream readable_file(file_name_image, std::ios::binary | std::ios::ate);
-    std::ofstream writable_file(file_name_image, std::ios::in | std::ios::out);
-    boot_record b_record;
-    std::string file_name_to_write = argv[2];
+    if (!stdin_name.empty())
+        streamToCAB(context, STDIN_FILENO, stdin_name, copy_buffer, stats);
 
-    //it must be either 0 for generic binary files or 1 to directorie files
-    b_record = readBootRecord(readable_file);
+    // ...and the metadata is committed at the end (and every commit_window files before)
+    commitImports(context, stats);
 
-    writeToCAB(readable_file, writable_file, b_record, file_name_to_write);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count();
+    printBatch(stats, elapsed);
 
-    readable_file.close();
-    writable_file.close();
+    image.close();
+    if (show_stats)
+        printStats("cab_file_writer");
 
-    return 0;
-}
\ No newline at end of file
+    return stats.files_skipped == 0 ? 0 : 1;
+}
@@ -0,0 +1,216 @@
+#ifndef CAB_FORMAT_HPP
+#define CAB_FORMAT_HPP
+
+// formatting routines of cab_format, kept in a header so cab_bench can time them
+
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cab_fs.hpp"
+#include "cab_image.hpp"
+#include "cab_copy.hpp"
+
+const size_t ZERO_WRITE_CHUNK = 4 << 20;
+
+enum format_mode
+{
+    FORMAT_FAST,        // holes/zero ranges, falling back to threaded zero writes
+    FORMAT_WRITE_ZEROS, // always write the zeros, in large chunks on several threads
+    FORMAT_LEGACY       // one 512 byte write per block, as the formatter always did
+};
+
+// a power of two between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE
+inline bool isValidBlockSize(size_t block_size)
+{
+    return block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE && (block_size & (block_size - 1)) == 0;
+}
+
+inline boot_record makeBootRecord(size_t disk_size, size_t block_size)
+{
+    boot_record b_record;
+    memset(&b_record, 0, sizeof(b_record));
+
+    b_record.magic = CAB_MAGIC;
+    b_record.version = CAB_FORMAT_VERSION;
+    b_record.sectors_per_block = block_size / BYTES_PER_SECTOR;
+    b_record.bytes_per_sector = BYTES_PER_SECTOR;
+    b_record.total_blocks = disk_size / blockSizeOf(b_record);
+    // one bitmap block covers 8 bits per byte of the block, rounded up so every block is addressable
+    size_t bits_per_block = 8 * blockSizeOf(b_record);
+    b_record.bitmap_size_in_blocks = (b_record.total_blocks + bits_per_block - 1) / bits_per_block;
+    b_record.n_root_entries = N_ROOT_ENTRIES;
+
+    return b_record;
+}
+
+// zeroes [offset, offset + length) without writing it: a punched hole or a zero range reads
+// back as zeros, and so does a regular file's tail after cutting it off and growing it back
+inline bool zeroRangeSparse(int fd, off_t offset, off_t length)
+{
+    if (length <= 0)
+        return true;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+        return true;
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, length) == 0)
+        return true;
+
+    struct stat image_stat;
+    if (fstat(fd, &image_stat) == 0 && S_ISREG(image_stat.st_mode) && offset + length == image_stat.st_size)
+        return ftruncate(fd, offset) == 0 && ftruncate(fd, image_stat.st_size) == 0;
+    return false;
+}
+
+// real zeroing, split in contiguous slices written by n_threads threads from one zero buffer
+inline bool zeroRangeThreaded(int fd, off_t offset, off_t length, unsigned int n_threads)
+{
+    if (length <= 0)
+        return true;
+    n_threads = std::max(1u, n_threads);
+    std::vector<char> zeros(std::min((off_t)ZERO_WRITE_CHUNK, length), 0);
+
+    off_t slice = (length / n_threads + ZERO_WRITE_CHUNK - 1) / ZERO_WRITE_CHUNK * ZERO_WRITE_CHUNK;
+    std::vector<std::thread> writers;
+    std::vector<char> slice_ok(n_threads, 1);
+    for (unsigned int t = 0; t < n_threads; t++)
+    {
+        off_t slice_start = offset + t * slice;
+        off_t slice_end = std::min(offset + length, slice_start + slice);
+        if (slice_start >= slice_end)
+            break;
+        writers.emplace_back([&, t, slice_start, slice_end]() {
+            for (off_t position = slice_start; position < slice_end; position += zeros.size())
+            {
+                size_t chunk = std::min((off_t)zeros.size(), slice_end - position);
+                if (!writeAll(fd, zeros.data(), chunk, position))
+                {
+                    slice_ok[t] = 0;
+                    return;
+                }
+            }
+        });
+    }
+    for (std::thread &writer : writers)
+        writer.join();
+    return std::find(slice_ok.begin(), slice_ok.end(), 0) == slice_ok.end();
+}
+
+// the original zeroing loop, kept for comparison in cab_bench
+inline bool zeroRangeLegacy(const std::string &image_name, off_t offset, size_t blocks, size_t block_size)
+{
+    std::ofstream writable_file(image_name, std::ios::in | std::ios::out);
+    writable_file.seekp(offset);
+    // making everything == 0 just like my energy rn
+    std::vector<char> zero_vector_block(block_size, 0);
+    for (size_t i = 0; i < blocks; i++)
+    {
+        writable_file.write(zero_vector_block.data(), block_size);
+    }
+    return writable_file.good();
+}
+
+// the bitmap of a fresh image: boot record, bitmap, root directory and journal blocks are in use
+inline void formatBitMap(BitMap &bit_map, const boot_record &b_record)
+{
+    bit_map.format();
+    bit_map.writeBits(1 + b_record.bitmap_size_in_blocks, rootDirBlocks(b_record), 1);
+    if (hasJournal(b_record))
+        bit_map.writeBits(b_record.journal_first_block, b_record.journal_blocks, 1);
+}
+
+// journal region right after the root directory, at most a sixteenth of the image; none for
+// journal_bytes 0 or when the image cannot spare the two blocks a transaction needs
+inline void placeJournal(boot_record &b_record, size_t journal_bytes)
+{
+    size_t block_size = blockSizeOf(b_record);
+    b_record.journal_first_block = 1 + b_record.bitmap_size_in_blocks + rootDirBlocks(b_record);
+    b_record.journal_blocks = std::min(journal_bytes / block_size, (size_t)b_record.total_blocks / 16);
+    if (b_record.journal_blocks < 2)
+    {
+        b_record.journal_first_block = 0;
+        b_record.journal_blocks = 0;
+    }
+}
+
+inline void writeRootDir(CabImage &image, const boot_record &b_record)
+{
+    // written in portuguese just out of a habit
+
+    //. and .. directories
+    dir_entry ponto, pontoponto;
+    memset(&ponto, 0, sizeof(ponto));
+    memset(&pontoponto, 0, sizeof(pontoponto));
+    ponto.first_block = (1 + b_record.bitmap_size_in_blocks);
+    ponto.file_size_in_bytes = 0;
+    ponto.file_type = DIRECTORY_TYPE;
+    strcpy(ponto.file_name, "ponto");
+
+    pontoponto.first_block = (1 + b_record.bitmap_size_in_blocks);
+    pontoponto.file_size_in_bytes = 0;
+    pontoponto.file_type = DIRECTORY_TYPE;
+    strcpy(pontoponto.file_name, "pontoponto");
+
+    image.rootDir()[0] = ponto;
+    image.rootDir()[1] = pontoponto;
+}
+
+// formats image_name in place; the image keeps its size, which decides total_blocks
+inline bool formatImage(const std::string &image_name, format_mode mode, unsigned int n_threads, size_t block_size = DEFAULT_BLOCK_SIZE,
+                        alloc_policy policy = ALLOC_BEST_FIT, size_t journal_bytes = DEFAULT_JOURNAL_SIZE)
+{
+    if (!isValidBlockSize(block_size))
+    {
+        std::cout << "block size must be a power of two from " << MIN_BLOCK_SIZE << " to " << MAX_BLOCK_SIZE << std::endl;
+        return false;
+    }
+
+    CAB_STAT_PHASE(PHASE_FORMAT);
+    CabImage image;
+    if (!image.open(image_name, true))
+    {
+        std::cout << "could not open image " << image_name << std::endl;
+        return false;
+    }
+
+    boot_record b_record = makeBootRecord(image.size(), block_size);
+    b_record.alloc_policy = policy;
+    size_t data_start = 1 + b_record.bitmap_size_in_blocks;
+    if (b_record.total_blocks < data_start + rootDirBlocks(b_record))
+    {
+        std::cout << "image is too small for the boot record, bitmap and root directory" << std::endl;
+        return false;
+    }
+    placeJournal(b_record, journal_bytes);
+    b_record.next_fit_block = data_start + rootDirBlocks(b_record) + b_record.journal_blocks;
+
+    // everything after the bitmap reads as zero: root directory and data area
+    off_t zero_offset = (off_t)data_start * block_size;
+    off_t zero_length = (off_t)(b_record.total_blocks - data_start) * block_size;
+    bool zeroed = false;
+    if (mode == FORMAT_LEGACY)
+        zeroed = zeroRangeLegacy(image_name, zero_offset, b_record.total_blocks - data_start, block_size);
+    else
+    {
+        if (mode == FORMAT_FAST)
+            zeroed = zeroRangeSparse(image.fd(), zero_offset, zero_length);
+        if (!zeroed)
+            zeroed = zeroRangeThreaded(image.fd(), zero_offset, zero_length, n_threads);
+    }
+    if (!zeroed)
+    {
+        std::cout << "could not zero the data area" << std::endl;
+        return false;
+    }
+
+    // the metadata is built directly in the mapping and written back once; the root directory
+    // is cleared there too, a private mapping may still hold a replayed copy of the old one
+    *image.bootRecord() = b_record;
+    memset(image.rootDir(), 0, rootDirBlocks(b_record) * block_size);
+    BitMap bit_map(b_record, image.bitmapBytes());
+    formatBitMap(bit_map, b_record);
+    writeRootDir(image, b_record);
+    return image.flushMetadata();
+}
+
+#endif
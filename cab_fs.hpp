@@ -0,0 +1,735 @@
+#ifndef CAB_FS_HPP
+#define CAB_FS_HPP
+
+// on-disk layout and the block bitmap shared by cab_format, cab_file_writer and cab_file_taker
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+#include <map>
+#include <set>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "cab_stats.hpp"
+
+// version 2 of the layout: 64-bit block numbers and sizes, block size chosen at format time.
+// Version 1 images (32-bit fields, 512 byte blocks) start with sectors_per_block == 1
+// where the magic now is, so they are told apart and refused
+const uint32_t CAB_MAGIC = 0x32424143; // "CAB2"
+const uint32_t CAB_FORMAT_VERSION = 2;
+const unsigned int BYTES_PER_SECTOR = 512;
+const size_t DEFAULT_BLOCK_SIZE = 4096;
+const size_t MIN_BLOCK_SIZE = BYTES_PER_SECTOR;
+const size_t MAX_BLOCK_SIZE = 1 << 20;
+const unsigned int N_ROOT_ENTRIES = 1024;
+const unsigned char DIRECTORY_TYPE = 1;
+const unsigned char BINARY_TYPE = 0;
+const unsigned char COMPRESSED_TYPE = 2; // chunked and deflated, laid out as in cab_compress.hpp
+const unsigned char PACKED_TYPE = 3;     // small file in a shared pack block (cab_pack.hpp), first_block is a byte offset
+const unsigned char EXTENTS_TYPE = 4;    // file split over several extents, first_block is its extent map (cab_extent.hpp)
+const unsigned int ENTRY_SIZE = 64;
+const size_t OUT_OF_FREE_SPACE = 0;
+// requests up to this many bytes are "small" for the size-class policy
+const size_t SIZE_CLASS_SMALL_BYTES = 64 << 10;
+
+// where new extents go; the policy of an image is recorded in its boot record, and zero
+// (what every image formatted before the field existed holds) is the allocator the tools always used.
+// Best-fit is O(log n) in the free extents; first-fit, next-fit and size-class's large requests
+// walk them in address order, O(free extents), so they slow down as free space fragments
+enum alloc_policy
+{
+    ALLOC_BEST_FIT,   // smallest free extent that fits
+    ALLOC_FIRST_FIT,  // lowest addressed free extent that fits
+    ALLOC_NEXT_FIT,   // first fit from where the previous allocation ended, wrapping around
+    ALLOC_SIZE_CLASS, // small requests best-fit, large ones at the top of the highest extent that fits
+    ALLOC_POLICY_COUNT
+};
+
+typedef struct boot_record
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sectors_per_block;
+    uint32_t bytes_per_sector;
+    uint64_t total_blocks;
+    uint64_t bitmap_size_in_blocks;
+    uint32_t n_root_entries;
+    uint32_t alloc_policy;
+    uint64_t next_fit_block; // roving pointer of ALLOC_NEXT_FIT, kept between runs
+    uint64_t journal_first_block; // metadata journal region, none when journal_blocks is 0
+    uint64_t journal_blocks;
+    uint64_t dedup_first_block; // fingerprint table of deduplicated files, none when dedup_blocks is 0
+    uint64_t dedup_blocks;
+    uint64_t dedup_records;
+    uint64_t pack_block; // pack block small files are being appended to, none when 0
+
+    unsigned char padding[416];
+} __attribute__((packed)) boot_record;
+
+typedef struct dir_entry
+{
+    uint64_t first_block;
+    uint64_t file_size_in_bytes;
+    unsigned char file_type;
+    char file_name[47];
+} __attribute__((packed)) dir_entry;
+
+static_assert(sizeof(boot_record) == BYTES_PER_SECTOR, "the boot record fills one sector");
+static_assert(sizeof(dir_entry) == ENTRY_SIZE, "directory entries are ENTRY_SIZE bytes");
+
+// a file of any kind, as opposed to a directory or a free slot
+inline bool isFileEntry(const dir_entry &entry)
+{
+    return entry.file_type == BINARY_TYPE || entry.file_type == COMPRESSED_TYPE || entry.file_type == PACKED_TYPE ||
+           entry.file_type == EXTENTS_TYPE;
+}
+
+inline size_t blockSizeOf(const boot_record &b_record)
+{
+    return (size_t)b_record.sectors_per_block * b_record.bytes_per_sector;
+}
+
+// where a file's bytes start in the image: a packed file's first_block already is a byte offset
+inline uint64_t entryDataOffset(const dir_entry &entry, size_t block_size)
+{
+    return entry.file_type == PACKED_TYPE ? entry.first_block : entry.first_block * block_size;
+}
+
+// data blocks of its own an entry takes (none for a packed file, the extent map of a split
+// file not included)
+inline size_t entryBlocks(const dir_entry &entry, size_t block_size)
+{
+    return entry.file_type == PACKED_TYPE ? 0 : (entry.file_size_in_bytes + block_size - 1) / block_size;
+}
+
+// blocks taken by the root directory right after the bitmap
+inline size_t rootDirBlocks(const boot_record &b_record)
+{
+    return ((size_t)b_record.n_root_entries * ENTRY_SIZE + blockSizeOf(b_record) - 1) / blockSizeOf(b_record);
+}
+
+const char *const ALLOC_POLICY_NAMES[ALLOC_POLICY_COUNT] = {"best-fit", "first-fit", "next-fit", "size-class"};
+
+inline bool parsePolicy(const std::string &name, alloc_policy &policy)
+{
+    for (int p = 0; p < ALLOC_POLICY_COUNT; p++)
+    {
+        if (name == ALLOC_POLICY_NAMES[p])
+        {
+            policy = (alloc_policy)p;
+            return true;
+        }
+    }
+    return false;
+}
+
+// a command line number: the whole of text is an unsigned decimal that fits in value, else
+// false and value is left alone, so the tools can print their usage instead of throwing
+template <typename Number>
+bool parseNumber(const std::string &text, Number &value)
+{
+    if (text.empty() || text[0] < '0' || text[0] > '9')
+        return false;
+    errno = 0;
+    char *end = nullptr;
+    unsigned long long parsed = strtoull(text.c_str(), &end, 10);
+    if (errno == ERANGE || *end != '\0' || parsed > std::numeric_limits<Number>::max())
+        return false;
+    value = (Number)parsed;
+    return true;
+}
+
+// free extents of the bitmap, kept in two views: by address (to coalesce neighbours when
+// blocks are freed) and by (size, address) (to find a fitting hole in logarithmic time)
+class FreeExtentIndex
+{
+public:
+    void clear()
+    {
+        by_address.clear();
+        by_size.clear();
+    }
+
+    // marks [first, first + size) free, merging with overlapping or adjacent extents
+    void insertFree(size_t first, size_t size)
+    {
+        if (size == 0)
+            return;
+        size_t last = first + size;
+        auto it = by_address.upper_bound(first);
+        if (it != by_address.begin() && std::prev(it)->first + std::prev(it)->second >= first)
+            --it;
+        while (it != by_address.end() && it->first <= last)
+        {
+            first = std::min(first, it->first);
+            last = std::max(last, it->first + it->second);
+            by_size.erase({it->second, it->first});
+            it = by_address.erase(it);
+        }
+        by_address[first] = last - first;
+        by_size.insert({last - first, first});
+    }
+
+    // marks [first, first + size) used, splitting the extents it cuts through
+    void removeRange(size_t first, size_t size)
+    {
+        if (size == 0)
+            return;
+        size_t last = first + size;
+        auto it = by_address.upper_bound(first);
+        if (it != by_address.begin() && std::prev(it)->first + std::prev(it)->second > first)
+            --it;
+        while (it != by_address.end() && it->first < last)
+        {
+            size_t extent_first = it->first;
+            size_t extent_last = it->first + it->second;
+            by_size.erase({it->second, it->first});
+            it = by_address.erase(it);
+            if (extent_first < first)
+            {
+                by_address[extent_first] = first - extent_first;
+                by_size.insert({first - extent_first, extent_first});
+            }
+            if (extent_last > last)
+            {
+                it = by_address.emplace(last, extent_last - last).first;
+                by_size.insert({extent_last - last, last});
+                ++it;
+            }
+        }
+    }
+
+    // lowest addressed extent that fits, walking the address view: O(free extents) when the
+    // only fits are high up. The largestExtent() check only spares the walk when none fits
+    size_t firstFit(size_t block_amount)
+    {
+        if (block_amount == 0 || largestExtent() < block_amount)
+            return OUT_OF_FREE_SPACE;
+        for (auto &extent : by_address)
+        {
+            if (extent.second >= block_amount)
+                return extent.first;
+        }
+        return OUT_OF_FREE_SPACE;
+    }
+
+    // first extent that fits at or after `from` (which may be inside an extent), wrapping
+    // around to the lowest addresses; a walk like firstFit's
+    size_t nextFit(size_t block_amount, size_t from)
+    {
+        if (block_amount == 0 || largestExtent() < block_amount)
+            return OUT_OF_FREE_SPACE;
+        auto it = by_address.upper_bound(from);
+        if (it != by_address.begin())
+        {
+            auto holding = std::prev(it);
+            if (holding->first + holding->second >= from + block_amount)
+                return from;
+        }
+        for (; it != by_address.end(); ++it)
+        {
+            if (it->second >= block_amount)
+                return it->first;
+        }
+        return firstFit(block_amount);
+    }
+
+    // the last block_amount blocks of the highest addressed extent that fits; a walk like
+    // firstFit's, from the top
+    size_t lastFit(size_t block_amount)
+    {
+        if (block_amount == 0 || largestExtent() < block_amount)
+            return OUT_OF_FREE_SPACE;
+        for (auto it = by_address.rbegin(); it != by_address.rend(); ++it)
+        {
+            if (it->second >= block_amount)
+                return it->first + it->second - block_amount;
+        }
+        return OUT_OF_FREE_SPACE;
+    }
+
+    // smallest extent that fits (lowest address among equal sizes), O(log n)
+    size_t bestFit(size_t block_amount)
+    {
+        if (block_amount == 0)
+            return OUT_OF_FREE_SPACE;
+        auto it = by_size.lower_bound({block_amount, 0});
+        if (it == by_size.end())
+            return OUT_OF_FREE_SPACE;
+        return it->second;
+    }
+
+    size_t largestExtent()
+    {
+        return by_size.empty() ? 0 : by_size.rbegin()->first;
+    }
+
+    // first block of the largest extent (the highest addressed of equal ones)
+    size_t largestExtentStart()
+    {
+        return by_size.empty() ? OUT_OF_FREE_SPACE : by_size.rbegin()->second;
+    }
+
+    // free blocks from `block` on, 0 when it is in use: how far an extent ending there could
+    // grow in place
+    size_t freeRunAt(size_t block)
+    {
+        auto it = by_address.upper_bound(block);
+        if (it == by_address.begin())
+            return 0;
+        --it;
+        return it->first + it->second > block ? it->first + it->second - block : 0;
+    }
+
+    size_t extentCount()
+    {
+        return by_address.size();
+    }
+
+    const std::map<size_t, size_t> &extentsByAddress()
+    {
+        return by_address;
+    }
+
+private:
+    std::map<size_t, size_t> by_address;           // first block -> length
+    std::set<std::pair<size_t, size_t>> by_size;    // (length, first block)
+};
+
+class BitMap
+{
+public:
+    BitMap(const boot_record b_record)
+        : b_record(b_record)
+    {
+        bit_map.resize(b_record.bitmap_size_in_blocks * blockSizeOf(b_record));
+        addressable_bits = b_record.bitmap_size_in_blocks * blockSizeOf(b_record) * 8;
+        loadPolicy();
+    }
+
+    // works in place on bitmap bytes owned by someone else (the image mapping); nothing is
+    // copied and every change is immediately visible there
+    BitMap(const boot_record b_record, unsigned char *external_bits)
+        : b_record(b_record), external_bits(external_bits)
+    {
+        addressable_bits = b_record.bitmap_size_in_blocks * blockSizeOf(b_record) * 8;
+        loadPolicy();
+    }
+
+    void format()
+    {
+        fillReservedBlocks();
+        fillNonReachableBlocks();
+        defaultUsableToZero();
+    }
+
+    const unsigned char *getData()
+    {
+        return bytes();
+    }
+
+    size_t getSizeInBytes()
+    {
+        return addressable_bits / 8;
+    }
+
+    unsigned char getBit(size_t bit_index)
+    {
+
+        size_t byte_index = bit_index / 8;
+        unsigned char offset = bit_index % 8;
+        unsigned char mask = 0b10000000 >> offset;
+
+        return (bytes()[byte_index] & mask) >> (7 - offset);
+    }
+
+    void setBit(size_t bit_index, unsigned char value)
+    {
+
+        // value is expected to be either 00000001 or 00000000
+        value = value << 7;
+        size_t byte_index = bit_index / 8;
+        unsigned char offset = bit_index % 8;
+        unsigned char mask = value >> offset;
+        // std::cout << "settando o bit \n";
+        // std::cout << "byte index == " << bytes()[byte_index] << std::endl;
+        if (value)
+            bytes()[byte_index] = bytes()[byte_index] | mask;
+        else
+            bytes()[byte_index] = bytes()[byte_index] & ~(0b10000000 >> offset);
+        // std::cout << "settei o bit\n";
+        markDirty(bit_index, 1);
+    }
+
+    size_t getAdressableBits()
+    {
+        return addressable_bits;
+    }
+
+    // image blocks of the bitmap changed since the last call, added to blocks
+    void takeDirtyBlocks(std::set<size_t> &blocks)
+    {
+        for (size_t block : dirty_blocks)
+            blocks.insert(1 + block);
+        dirty_blocks.clear();
+    }
+
+    size_t dirtyBlockCount() const
+    {
+        return dirty_blocks.size();
+    }
+
+    void writeBits(size_t first_bit, size_t size, unsigned char bit_to_write)
+    {
+        // bit to write is expected to be either 00000001 or 00000000
+        // partial bytes at both ends are masked, everything in between is one memset
+        size_t last_bit = first_bit + size;
+        size_t i = first_bit;
+        if (i % 8 != 0 && i < last_bit)
+        {
+            size_t head_end = std::min(last_bit, (i / 8 + 1) * 8);
+            unsigned char mask = (0xff >> (i % 8)) & (0xff << (8 - (head_end - i / 8 * 8)));
+            applyMask(i / 8, mask, bit_to_write);
+            i = head_end;
+        }
+        size_t full_bytes = (last_bit - i) / 8;
+        if (full_bytes > 0)
+        {
+            memset(&bytes()[i / 8], bit_to_write ? 0xff : 0x00, full_bytes);
+            i += full_bytes * 8;
+        }
+        if (i < last_bit)
+            applyMask(i / 8, 0xff << (8 - (last_bit - i)), bit_to_write);
+
+        markDirty(first_bit, size);
+
+        // freed blocks may sit below the words the scan already knows to be full
+        if (bit_to_write == 0 && first_bit / 64 < full_words_prefix)
+            full_words_prefix = first_bit / 64;
+
+        if (has_extent_index)
+        {
+            if (bit_to_write)
+                extent_index.removeRange(first_bit, size);
+            else
+                extent_index.insertFree(first_bit, size);
+        }
+    }
+
+    // builds the free-extent index from the current bits; from then on writeBits keeps it
+    // in sync and the allocation calls below answer from it instead of scanning
+    void buildExtentIndex()
+    {
+        CAB_STAT_PHASE(PHASE_LOAD_METADATA);
+        CAB_STAT_COUNT(STAT_BITS_SCANNED, addressable_bits);
+        extent_index.clear();
+        size_t n_words = (addressable_bits + 63) / 64;
+        size_t run_start = 0;
+        size_t run_length = 0;
+        for (size_t w = 0; w < n_words; w++)
+        {
+            uint64_t word = loadWord(w);
+            unsigned int position = 0;
+            while (position < 64)
+            {
+                uint64_t rest = word << position;
+                unsigned int free_bits = rest == 0 ? 64 - position : __builtin_clzll(rest);
+                if (free_bits > 0)
+                {
+                    if (run_length == 0)
+                        run_start = w * 64 + position;
+                    run_length += free_bits;
+                    position += free_bits;
+                    if (position >= 64)
+                        break;
+                    rest = word << position;
+                }
+                if (run_length > 0)
+                    extent_index.insertFree(run_start, run_length);
+                run_length = 0;
+                position += ~rest == 0 ? 64 - position : __builtin_clzll(~rest);
+            }
+        }
+        if (run_length > 0)
+            extent_index.insertFree(run_start, std::min(run_length, addressable_bits - run_start));
+        has_extent_index = true;
+    }
+
+    bool hasExtentIndex()
+    {
+        return has_extent_index;
+    }
+
+    FreeExtentIndex &getExtentIndex()
+    {
+        return extent_index;
+    }
+
+    // the policy getFreeBlock places files with from now on
+    void setPolicy(alloc_policy policy)
+    {
+        this->policy = policy;
+    }
+
+    alloc_policy getPolicy()
+    {
+        return policy;
+    }
+
+    // where the next ALLOC_NEXT_FIT search starts; callers store it back in the boot record
+    size_t getNextFitBlock()
+    {
+        return next_fit_block;
+    }
+
+    // first block of a free extent of block_amount blocks chosen by the policy, nothing is
+    // marked; every policy but first-fit works on the extent index, built here if missing
+    size_t getFreeBlock(size_t block_amount)
+    {
+        if (policy == ALLOC_FIRST_FIT)
+            return getFirstBlock(block_amount);
+        if (!has_extent_index)
+            buildExtentIndex();
+
+        if (policy == ALLOC_NEXT_FIT)
+        {
+            size_t first_block = extent_index.nextFit(block_amount, next_fit_block);
+            if (first_block != OUT_OF_FREE_SPACE)
+                next_fit_block = first_block + block_amount;
+            return first_block;
+        }
+        if (policy == ALLOC_SIZE_CLASS && block_amount * blockSizeOf(b_record) > SIZE_CLASS_SMALL_BYTES)
+            return extent_index.lastFit(block_amount);
+        return extent_index.bestFit(block_amount);
+    }
+
+    // smallest free run that holds block_amount blocks; needs buildExtentIndex(), falls back
+    // to first-fit without it
+    size_t getBestFitBlock(size_t block_amount)
+    {
+        if (!has_extent_index)
+            return getFirstBlock(block_amount);
+        return extent_index.bestFit(block_amount);
+    }
+
+    // first-fit search, one 64-bit word at a time: full words are skipped in one step and
+    // runs of free blocks inside a word are measured with count-leading-zeros
+    size_t getFirstBlock(size_t block_amount)
+    {
+        // same answer as the reference scan for empty files
+        if (block_amount == 0)
+            return OUT_OF_FREE_SPACE;
+        if (has_extent_index)
+            return extent_index.firstFit(block_amount);
+
+        size_t n_words = (addressable_bits + 63) / 64;
+        size_t run_start = 0;
+        size_t run_length = 0;
+        bool only_full_words = true;
+        size_t first_word = full_words_prefix;
+
+        for (size_t w = full_words_prefix; w < n_words; w++)
+        {
+#if defined(__AVX2__)
+            // outside a run, four full words at a time
+            while (run_length == 0 && w + 4 <= n_words && (w + 4) * 8 <= getSizeInBytes())
+            {
+                __m256i lanes = _mm256_loadu_si256((const __m256i *)&bytes()[w * 8]);
+                if (!_mm256_testc_si256(lanes, _mm256_set1_epi8(-1)))
+                    break;
+                w += 4;
+                if (only_full_words)
+                    full_words_prefix = w;
+            }
+            if (w >= n_words)
+                break;
+#endif
+            uint64_t word = loadWord(w);
+
+            if (word == ~(uint64_t)0)
+            {
+                run_length = 0;
+                if (only_full_words)
+                    full_words_prefix = w + 1;
+                continue;
+            }
+            only_full_words = false;
+
+            if (word == 0)
+            {
+                if (run_length == 0)
+                    run_start = w * 64;
+                run_length += 64;
+                if (run_length >= block_amount)
+                {
+                    CAB_STAT_COUNT(STAT_BITS_SCANNED, (w + 1 - first_word) * 64);
+                    return run_start;
+                }
+                continue;
+            }
+
+            // bit 0 of the block order is the most significant bit of the word
+            unsigned int position = 0;
+            while (position < 64)
+            {
+                uint64_t rest = word << position;
+                unsigned int free_bits = rest == 0 ? 64 - position : __builtin_clzll(rest);
+                if (free_bits > 0)
+                {
+                    if (run_length == 0)
+                        run_start = w * 64 + position;
+                    run_length += free_bits;
+                    if (run_length >= block_amount)
+                    {
+                        CAB_STAT_COUNT(STAT_BITS_SCANNED, (w + 1 - first_word) * 64);
+                        return run_start;
+                    }
+                    position += free_bits;
+                    if (position >= 64)
+                        break;
+                    rest = word << position;
+                }
+                // the zeros shifted in from the right are never reached: rest has a set bit above them
+                unsigned int used_bits = __builtin_clzll(~rest);
+                run_length = 0;
+                position += used_bits;
+            }
+        }
+
+        CAB_STAT_COUNT(STAT_BITS_SCANNED, (n_words - first_word) * 64);
+        return OUT_OF_FREE_SPACE;
+    }
+
+    // original bit-by-bit first-fit, kept as the reference for getFirstBlock
+    size_t getFirstBlockScalar(size_t block_amount)
+    {
+        size_t address_first_block = OUT_OF_FREE_SPACE;
+        size_t first_current = 0;
+        size_t contiguous_blocks_found = 0;
+        for (size_t i = 0; i < addressable_bits; i++)
+        {
+            unsigned char bit = getBit(i);
+
+            if (first_current == 0)
+            {
+                first_current = i;
+            }
+
+            if (bit == 0)
+            {
+                contiguous_blocks_found++;
+            }
+            else
+            {
+                contiguous_blocks_found = 0;
+                first_current = 0;
+            }
+
+            if (contiguous_blocks_found == block_amount)
+            {
+                address_first_block = first_current;
+                break;
+            }
+        }
+
+        return address_first_block;
+    }
+
+private:
+    boot_record b_record;
+    size_t addressable_bits;
+    std::vector<unsigned char> bit_map;
+    unsigned char *external_bits = nullptr;
+    // every word below this index is known to be fully allocated
+    size_t full_words_prefix = 0;
+    FreeExtentIndex extent_index;
+    bool has_extent_index = false;
+    alloc_policy policy = ALLOC_BEST_FIT;
+    size_t next_fit_block = 0;
+    std::set<size_t> dirty_blocks; // bitmap blocks written since takeDirtyBlocks
+
+    void markDirty(size_t first_bit, size_t size)
+    {
+        if (size == 0)
+            return;
+        size_t bits_per_block = 8 * blockSizeOf(b_record);
+        for (size_t block = first_bit / bits_per_block; block <= (first_bit + size - 1) / bits_per_block; block++)
+            dirty_blocks.insert(block);
+    }
+
+    void loadPolicy()
+    {
+        if (b_record.alloc_policy < ALLOC_POLICY_COUNT)
+            policy = (alloc_policy)b_record.alloc_policy;
+        next_fit_block = b_record.next_fit_block;
+    }
+
+    unsigned char *bytes()
+    {
+        return external_bits != nullptr ? external_bits : bit_map.data();
+    }
+
+    void applyMask(size_t byte_index, unsigned char mask, unsigned char bit_to_write)
+    {
+        if (bit_to_write)
+            bytes()[byte_index] |= mask;
+        else
+            bytes()[byte_index] &= ~mask;
+    }
+
+    // 64 bitmap bits in block order (big-endian), bytes past the end read as allocated
+    uint64_t loadWord(size_t word_index)
+    {
+        size_t byte_index = word_index * 8;
+        if (byte_index + 8 <= getSizeInBytes())
+        {
+            uint64_t word;
+            memcpy(&word, &bytes()[byte_index], 8);
+            return __builtin_bswap64(word);
+        }
+        uint64_t word = 0;
+        for (size_t i = 0; i < 8; i++)
+        {
+            unsigned char byte = byte_index + i < getSizeInBytes() ? bytes()[byte_index + i] : 0xff;
+            word = (word << 8) | byte;
+        }
+        return word;
+    }
+
+    void fillReservedBlocks()
+    {
+
+        // 1 because of the boot record block
+        size_t reserved_blocks = 1 + b_record.bitmap_size_in_blocks;
+        this->writeBits(0, std::min(reserved_blocks, addressable_bits), 1);
+    }
+
+    void fillNonReachableBlocks()
+    {
+        if (addressable_bits > b_record.total_blocks)
+            this->writeBits(b_record.total_blocks, addressable_bits - b_record.total_blocks, 1);
+    }
+
+    void defaultUsableToZero()
+    {
+        size_t reserved_blocks = 1 + b_record.bitmap_size_in_blocks;
+        size_t usable_end = std::min((size_t)b_record.total_blocks, addressable_bits);
+        if (usable_end > reserved_blocks)
+            this->writeBits(reserved_blocks, usable_end - reserved_blocks, 0);
+    }
+};
+
+#endif
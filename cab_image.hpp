@@ -0,0 +1,333 @@
+#ifndef CAB_IMAGE_HPP
+#define CAB_IMAGE_HPP
+
+// memory-mapped image handle: boot record, bitmap, root directory and file data are typed
+// views straight over one shared mapping, written back with msync at explicit flush points.
+// An image with a metadata journal is mapped privately instead, so changes reach the file
+// only through flushRange and commit and never by page writeback ahead of the journal
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cab_fs.hpp"
+#include "cab_journal.hpp"
+#include "cab_stats.hpp"
+
+// a file's bytes inside the mapping, nothing is copied
+typedef struct extent_span
+{
+    char *data;
+    size_t size;
+} extent_span;
+
+class CabImage
+{
+public:
+    CabImage() {}
+
+    ~CabImage()
+    {
+        close();
+    }
+
+    CabImage(const CabImage &) = delete;
+    CabImage &operator=(const CabImage &) = delete;
+
+    // maps the whole image; the boot record is not checked here so the formatter can open
+    // an image that has none yet, the tools call isFormatted() before using the views
+    bool open(const std::string &image_name, bool writable)
+    {
+        CAB_STAT_PHASE(PHASE_LOAD_METADATA);
+        close();
+        this->writable = writable;
+        image_fd = ::open(image_name.c_str(), writable ? O_RDWR : O_RDONLY);
+        struct stat image_stat;
+        if (image_fd < 0 || fstat(image_fd, &image_stat) < 0 || image_stat.st_size < (off_t)sizeof(boot_record))
+        {
+            close();
+            return false;
+        }
+        mapping_size = image_stat.st_size;
+        boot_record b_record;
+        journaled = pread(image_fd, &b_record, sizeof(b_record), 0) == sizeof(b_record) && b_record.magic == CAB_MAGIC &&
+                    b_record.version == CAB_FORMAT_VERSION && hasJournal(b_record);
+        int protection = PROT_READ | (writable || journaled ? PROT_WRITE : 0);
+        void *address = mmap(nullptr, mapping_size, protection, journaled ? MAP_PRIVATE : MAP_SHARED, image_fd, 0);
+        if (address == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        CAB_STAT_COUNT(STAT_SYSCALLS, 4); // open, fstat, pread, mmap
+        mapping = (char *)address;
+        if (journaled && !replayJournal())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (mapping != nullptr)
+            munmap(mapping, mapping_size);
+        if (image_fd >= 0)
+            ::close(image_fd);
+        mapping = nullptr;
+        mapping_size = 0;
+        image_fd = -1;
+        journaled = false;
+        replayed_blocks = 0;
+    }
+
+    bool isOpen()
+    {
+        return mapping != nullptr;
+    }
+
+    // a version 2 boot record whose geometry fits in the mapping, checked before any view is
+    // handed out (version 1 images have no magic and are refused here)
+    bool isFormatted()
+    {
+        if (!isOpen())
+            return false;
+        boot_record *b_record = bootRecord();
+        size_t block_size = blockSizeOf(*b_record);
+        return b_record->magic == CAB_MAGIC && b_record->version == CAB_FORMAT_VERSION &&
+               block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE && b_record->n_root_entries != 0 &&
+               b_record->total_blocks <= mapping_size / block_size &&
+               b_record->bitmap_size_in_blocks < b_record->total_blocks &&
+               metadataEnd() <= mapping_size && journalFits();
+    }
+
+    bool isJournaled()
+    {
+        return journaled;
+    }
+
+    int fd()
+    {
+        return image_fd;
+    }
+
+    size_t size()
+    {
+        return mapping_size;
+    }
+
+    size_t blockSize()
+    {
+        return blockSizeOf(*bootRecord());
+    }
+
+    boot_record *bootRecord()
+    {
+        return (boot_record *)mapping;
+    }
+
+    unsigned char *bitmapBytes()
+    {
+        return (unsigned char *)mapping + blockSize();
+    }
+
+    size_t bitmapSizeInBytes()
+    {
+        return (size_t)bootRecord()->bitmap_size_in_blocks * blockSize();
+    }
+
+    dir_entry *rootDir()
+    {
+        return (dir_entry *)(mapping + rootDirOffset());
+    }
+
+    size_t rootDirOffset()
+    {
+        return (size_t)(1 + bootRecord()->bitmap_size_in_blocks) * blockSize();
+    }
+
+    char *blockData(size_t block)
+    {
+        return mapping + block * blockSize();
+    }
+
+    extent_span fileData(const dir_entry &entry)
+    {
+        extent_span span = {nullptr, 0};
+        size_t offset = entryDataOffset(entry, blockSize());
+        if (offset <= mapping_size && entry.file_size_in_bytes <= mapping_size - offset)
+            span = {mapping + offset, entry.file_size_in_bytes};
+        return span;
+    }
+
+    // end of boot record + bitmap + root directory
+    size_t metadataEnd()
+    {
+        return rootDirOffset() + (size_t)bootRecord()->n_root_entries * ENTRY_SIZE;
+    }
+
+    // writes [offset, offset + length) of the mapping back to the image
+    bool flushRange(size_t offset, size_t length)
+    {
+        if (!writable || length == 0)
+            return true;
+        if (journaled)
+        {
+            length = std::min(offset + length, mapping_size) - offset;
+            return writeAll(image_fd, mapping + offset, length, offset) && syncImage();
+        }
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = offset / page * page;
+        length = std::min(offset + length, mapping_size) - start;
+        CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+        return msync(mapping + start, length, MS_SYNC) == 0;
+    }
+
+    bool flushMetadata()
+    {
+        CAB_STAT_PHASE(PHASE_FLUSH_METADATA);
+        return flushRange(0, metadataEnd());
+    }
+
+    bool flush()
+    {
+        return flushRange(0, mapping_size);
+    }
+
+    // makes the given metadata blocks of the mapping durable, after everything already written
+    // to the image (the file data they point at). fresh blocks are metadata nothing committed
+    // points at yet (a table written to a new place): they go out in place with the data. With
+    // a journal the blocks are logged as one transaction, so a crash keeps all of them or none;
+    // a set larger than commitCapacity() is refused. Blocks of a failed commit are kept and go
+    // out with the next one
+    bool commit(const std::set<size_t> &blocks, const std::set<size_t> &fresh = {})
+    {
+        if (!writable)
+            return false;
+        CAB_STAT_PHASE(PHASE_FLUSH_METADATA);
+        size_t block_size = blockSize();
+        uncommitted.insert(blocks.begin(), blocks.end());
+        uncommitted_fresh.insert(fresh.begin(), fresh.end());
+        if (!journaled)
+        {
+            bool ok = syncImage() && flushRange(0, metadataEnd());
+            for (size_t block : uncommitted)
+            {
+                if (block * block_size >= metadataEnd())
+                    ok = flushRange(block * block_size, block_size) && ok;
+            }
+            for (size_t block : uncommitted_fresh)
+            {
+                if (block * block_size >= metadataEnd())
+                    ok = flushRange(block * block_size, block_size) && ok;
+            }
+            if (ok)
+            {
+                uncommitted.clear();
+                uncommitted_fresh.clear();
+            }
+            return ok;
+        }
+
+        boot_record b_record = *bootRecord();
+        if (uncommitted.size() > journalCapacity(b_record))
+            return false;
+        std::vector<size_t> transaction(uncommitted.begin(), uncommitted.end());
+        // this sync also covers the data and the fresh blocks written before
+        if (!writeInPlace(std::vector<size_t>(uncommitted_fresh.begin(), uncommitted_fresh.end())) ||
+            !writeJournal(image_fd, b_record, transaction, mapping, ++journal_sequence) || !syncImage())
+            return false;
+        // the cleared header reaches the disk with the next sync, before anything else is
+        // written in place; a header still valid after a crash only replays the same blocks
+        if (!writeInPlace(transaction) || !syncImage() || !clearJournal(image_fd, b_record))
+            return false;
+        uncommitted.clear();
+        uncommitted_fresh.clear();
+        return true;
+    }
+
+    // most metadata blocks one commit takes; callers keep their groups under it
+    size_t commitCapacity()
+    {
+        return journaled ? journalCapacity(*bootRecord()) : SIZE_MAX;
+    }
+
+    // metadata blocks a failed commit left for the next one
+    size_t uncommittedBlocks()
+    {
+        return uncommitted.size();
+    }
+
+    // metadata blocks a journal replay applied when the image was opened
+    size_t replayed_blocks = 0;
+
+private:
+    int image_fd = -1;
+    bool writable = false;
+    bool journaled = false;
+    uint64_t journal_sequence = 0;
+    std::set<size_t> uncommitted, uncommitted_fresh; // blocks of the commit in progress or of a failed one
+    char *mapping = nullptr;
+    size_t mapping_size = 0;
+
+    bool syncImage()
+    {
+        CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+        return fdatasync(image_fd) == 0;
+    }
+
+    bool journalFits()
+    {
+        const boot_record &b_record = *bootRecord();
+        return !hasJournal(b_record) ||
+               (b_record.journal_first_block * blockSize() >= metadataEnd() &&
+                b_record.journal_first_block + b_record.journal_blocks <= b_record.total_blocks && journalCapacity(b_record) > 0);
+    }
+
+    // block runs of the mapping written to their place in the image
+    bool writeInPlace(const std::vector<size_t> &blocks)
+    {
+        size_t block_size = blockSize();
+        for (size_t i = 0; i < blocks.size();)
+        {
+            size_t run = 1;
+            while (i + run < blocks.size() && blocks[i + run] == blocks[i] + run)
+                run++;
+            size_t offset = blocks[i] * block_size;
+            if (offset >= mapping_size || !writeAll(image_fd, mapping + offset, std::min(run * block_size, mapping_size - offset), offset))
+                return false;
+            i += run;
+        }
+        return true;
+    }
+
+    // a committed transaction left by a crash is applied to the mapping, and in place when
+    // the image is writable; a read-only handle just sees the recovered metadata
+    bool replayJournal()
+    {
+        boot_record b_record = *bootRecord();
+        size_t block_size = blockSizeOf(b_record);
+        if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || !journalFits())
+            return true; // isFormatted refuses it
+        std::vector<uint64_t> blocks;
+        std::vector<char> images;
+        if (!readJournal(image_fd, b_record, blocks, images))
+            return true;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if ((blocks[i] + 1) * block_size > mapping_size)
+                return false;
+            memcpy(mapping + blocks[i] * block_size, images.data() + i * block_size, block_size);
+        }
+        replayed_blocks = blocks.size();
+        if (!writable)
+            return true;
+        std::vector<size_t> in_place(blocks.begin(), blocks.end());
+        std::sort(in_place.begin(), in_place.end());
+        return writeInPlace(in_place) && syncImage() && clearJournal(image_fd, b_record) && syncImage();
+    }
+};
+
+#endif
@@ -0,0 +1,724 @@
+#ifndef CAB_IMPORT_HPP
+#define CAB_IMPORT_HPP
+
+// importing host files into an image, kept in a header so cab_bench can drive it
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "cab_fs.hpp"
+#include "cab_copy.hpp"
+#include "cab_image.hpp"
+#include "cab_dir.hpp"
+#include "cab_blockio.hpp"
+#include "cab_compress.hpp"
+#include "cab_dedup.hpp"
+#include "cab_pack.hpp"
+#include "cab_extent.hpp"
+
+// totals of one writer run, used for the throughput report
+typedef struct batch_stats
+{
+    size_t files_written;
+    size_t files_skipped;
+    size_t bytes_written;
+    size_t commits;
+    size_t files_deduplicated; // written as a reference to an extent already in the image
+    size_t bytes_deduplicated;
+} batch_stats;
+
+// one file between its reservation and its commit
+typedef struct import_job
+{
+    std::string file_name;
+    uint64_t file_size;
+    size_t blocks_for_file;
+    size_t first_block;
+    dir_location parent;
+    size_t entry_index;
+    bool compressed = false;
+    std::vector<char> packed; // a compressed file's stored bytes, written out as they are
+    bool hashed = false;      // digest holds the fingerprint of the stored bytes
+    file_digest digest;
+    bool shared = false;      // first_block is an extent another entry already points at
+    bool in_pack = false;     // first_block is a byte offset in a pack block
+    bool split = false;       // no run was long enough: the data is in extents, first_block is their map
+    std::vector<file_extent> extents;
+    std::vector<size_t> map_blocks;
+} import_job;
+
+// the metadata every import of one run works against
+typedef struct import_context
+{
+    std::string image_name;
+    CabImage &image;
+    BitMap &bmap;
+    PathResolver &resolver;
+    bool verbose;
+    size_t commit_window; // files per metadata commit, 0: the caller commits once at the end
+    size_t compression_chunk; // 0: files are stored raw, else deflated in chunks of this size
+    DedupIndex *dedup;        // nullptr: every file gets its own extent
+    PackWriter *packer;       // nullptr: small files get whole blocks too
+    size_t max_extents;       // pieces a raw file may be split into, 1: files are only stored contiguous
+} import_context;
+
+// makes the metadata changed since the last commit durable, after the file data it points
+// at; with a journal all of it lands or none of it does, and a change set larger than the
+// journal is refused, so callers commit before metadataDue() says it may not fit
+inline bool commitMetadata(CabImage &image, BitMap &bmap, PathResolver &resolver, DedupIndex *dedup = nullptr)
+{
+    image.bootRecord()->next_fit_block = bmap.getNextFitBlock();
+    std::set<size_t> blocks = {0}, fresh;
+    // before the bitmap, which it may free an outgrown table in
+    if (dedup != nullptr)
+        dedup->store(image, bmap, blocks, fresh);
+    bmap.takeDirtyBlocks(blocks);
+    resolver.takeDirtyBlocks(blocks);
+    return image.commit(blocks, fresh);
+}
+
+// true once the metadata changed since the last commit takes half the journal: the other
+// half is the margin for the next change, so the commit after it still fits one transaction
+inline bool metadataDue(CabImage &image, BitMap &bmap, PathResolver &resolver, DedupIndex *dedup = nullptr)
+{
+    size_t pending = 1 + image.uncommittedBlocks() + bmap.dirtyBlockCount() + resolver.dirtyBlockCount();
+    if (dedup != nullptr)
+        pending += dedup->dirtyBlockCount();
+    return pending >= image.commitCapacity() / 2;
+}
+
+inline bool metadataDue(import_context &context)
+{
+    return metadataDue(context.image, context.bmap, context.resolver, context.dedup);
+}
+
+// one group commit of an import run
+inline bool commitImports(import_context &context, batch_stats &stats)
+{
+    stats.commits++;
+    // the pack header counts the entries about to be committed, so it goes out with the data
+    bool packed = context.packer == nullptr || context.packer->flush();
+    if (packed && commitMetadata(context.image, context.bmap, context.resolver, context.dedup))
+        return true;
+    std::cout << "could not commit the bitmap and directories" << std::endl;
+    return false;
+}
+
+// serialized part: directories, extent and directory slot for file_size bytes at path. The
+// entry is published and the blocks are marked right away so the next reservation cannot
+// take them; nothing reaches the disk before the caller flushes the metadata. A shared_block
+// is an existing extent with the same content: the entry points at it and nothing is allocated.
+// A small file goes into a pack block when the context has a packer, and a raw file no free
+// run can hold is split over several (cab_extent.hpp)
+inline bool reserveEntry(import_context &context, const std::string &file_name, uint64_t file_size, import_job &job, batch_stats &stats,
+                         unsigned char file_type = BINARY_TYPE, size_t shared_block = OUT_OF_FREE_SPACE)
+{
+    boot_record &b_record = *context.image.bootRecord();
+    job.file_name = file_name;
+    job.file_size = file_size;
+
+    std::vector<std::string> components = PathResolver::splitPath(file_name);
+    if (components.empty() || components.back().size() > MAX_NAME_LENGTH)
+    {
+        std::cout << "invalid name " << file_name << " (at most " << MAX_NAME_LENGTH << " characters per component)" << std::endl;
+        stats.files_skipped++;
+        return false;
+    }
+
+    // directories first: they take blocks from the same bitmap as the file below
+    if (!context.resolver.makeDirs(components, components.size() - 1, context.bmap, job.parent))
+    {
+        std::cout << "could not create the directories of " << file_name << std::endl;
+        stats.files_skipped++;
+        return false;
+    }
+
+    size_t block_size = blockSizeOf(b_record);
+    job.blocks_for_file = (job.file_size + block_size - 1) / block_size;
+    job.shared = shared_block != OUT_OF_FREE_SPACE;
+    job.in_pack = !job.shared && file_type == BINARY_TYPE && context.packer != nullptr && context.packer->packs(job.file_size);
+    if (job.in_pack)
+        job.blocks_for_file = 0; // placed once its slot is taken
+    else if (job.shared)
+        job.first_block = shared_block;
+    else
+    {
+        CAB_STAT_PHASE(PHASE_ALLOCATE);
+        job.first_block = context.bmap.getFreeBlock(job.blocks_for_file);
+    }
+    job.split = !job.in_pack && !job.shared && job.first_block == OUT_OF_FREE_SPACE && file_type == BINARY_TYPE &&
+                job.blocks_for_file > 0 && context.max_extents > 1;
+    if (context.verbose && !job.in_pack && !job.split)
+    {
+        std::cout << "blocks_for_file == " << job.blocks_for_file << std::endl;
+        std::cout << "first block == " << job.first_block << std::endl;
+    }
+
+    //if there is a big enough contiguous block
+    if (!job.in_pack && !job.split && job.first_block == OUT_OF_FREE_SPACE)
+    {
+        std::cout << "no contiguous space left for " << file_name << std::endl;
+        stats.files_skipped++;
+        return false;
+    }
+
+    //finding an empty dir entry
+    job.entry_index = context.resolver.takeFreeSlot(job.parent);
+    if (job.entry_index == ENTRY_NOT_FOUND)
+    {
+        std::cout << "directory is full, skipping " << file_name << std::endl;
+        stats.files_skipped++;
+        return false;
+    }
+    if (context.verbose)
+        std::cout << "available_entry_index = " << job.entry_index << std::endl;
+
+    if (job.in_pack)
+    {
+        job.first_block = context.packer->place(job.file_size);
+        if (job.first_block == OUT_OF_FREE_SPACE)
+        {
+            context.resolver.releaseSlot(job.parent, job.entry_index);
+            std::cout << "no space left for " << file_name << std::endl;
+            stats.files_skipped++;
+            return false;
+        }
+        file_type = PACKED_TYPE;
+        if (context.verbose)
+            std::cout << "packed at byte " << job.first_block << std::endl;
+    }
+    else if (job.split)
+    {
+        if (!allocateExtents(context.bmap, block_size, job.blocks_for_file, context.max_extents, job.extents, job.map_blocks))
+        {
+            context.resolver.releaseSlot(job.parent, job.entry_index);
+            std::cout << "no space left for " << file_name << std::endl;
+            stats.files_skipped++;
+            return false;
+        }
+        job.first_block = job.map_blocks[0];
+        file_type = EXTENTS_TYPE;
+        if (context.verbose)
+            std::cout << "split over " << job.extents.size() << " extents, map at block " << job.first_block << std::endl;
+    }
+
+    dir_entry file_entry;
+    memset(&file_entry, 0, sizeof(file_entry));
+    file_entry.first_block = job.first_block;
+    file_entry.file_size_in_bytes = job.file_size;
+    file_entry.file_type = file_type;
+    strncpy(file_entry.file_name, components.back().c_str(), MAX_NAME_LENGTH);
+    context.resolver.insertEntry(job.parent, job.entry_index, file_entry);
+
+    if (job.shared)
+        context.dedup->addReference(job.first_block);
+    else if (!job.in_pack && !job.split)
+        context.bmap.writeBits(job.first_block, job.blocks_for_file, 1);
+    return true;
+}
+
+// lock-free part before the reservation: a file to be compressed is deflated here, with
+// n_threads threads, since its stored size is what gets reserved, and the stored bytes are
+// fingerprinted when deduplicating. A file that cannot be read is left to reserveImport to report
+inline void prepareImport(import_context &context, const std::string &file_name, import_job &job, unsigned int n_threads)
+{
+    job.compressed = context.compression_chunk != 0 && compressFile(file_name, context.compression_chunk, n_threads, job.packed);
+    if (context.dedup == nullptr)
+        return;
+    if (job.compressed)
+    {
+        job.digest = digestBuffer(job.packed.data(), job.packed.size(), n_threads);
+        job.hashed = true;
+    }
+    else
+        job.hashed = digestFile(file_name, n_threads, job.digest);
+}
+
+// whether the extent at first_block holds exactly the bytes the job would store, read back
+// with pread so blocks written since the image was mapped are seen as they are on disk
+inline bool sameContent(import_context &context, const import_job &job, size_t first_block, uint64_t file_size)
+{
+    CAB_STAT_PHASE(PHASE_DEDUP);
+    int file_fd = -1;
+    if (!job.compressed)
+    {
+        file_fd = open(job.file_name.c_str(), O_RDONLY);
+        if (file_fd < 0)
+            return false;
+    }
+    std::vector<char> stored(DEDUP_CHUNK_SIZE), host(job.compressed ? 0 : DEDUP_CHUNK_SIZE);
+    off_t image_offset = (off_t)first_block * context.image.blockSize();
+    bool same = true;
+    for (uint64_t done = 0; same && done < file_size; done += DEDUP_CHUNK_SIZE)
+    {
+        size_t length = std::min((uint64_t)DEDUP_CHUNK_SIZE, file_size - done);
+        CAB_STAT_COUNT(STAT_SYSCALLS, job.compressed ? 1 : 2);
+        same = pread(context.image.fd(), stored.data(), length, image_offset + done) == (ssize_t)length;
+        if (same && !job.compressed)
+            same = pread(file_fd, host.data(), length, done) == (ssize_t)length;
+        const char *expected = job.compressed ? job.packed.data() + done : host.data();
+        same = same && memcmp(stored.data(), expected, length) == 0;
+        CAB_STAT_COUNT(STAT_BYTES_READ, job.compressed ? length : 2 * length);
+    }
+    if (file_fd >= 0)
+        close(file_fd);
+    return same;
+}
+
+// an indexed extent the job can point at instead of being copied, OUT_OF_FREE_SPACE if none
+inline size_t findShared(import_context &context, const import_job &job, uint64_t file_size, unsigned char file_type)
+{
+    // small files that will be packed take no blocks to save
+    if (!job.hashed || file_size == 0 || (file_type == BINARY_TYPE && context.packer != nullptr && context.packer->packs(file_size)))
+        return OUT_OF_FREE_SPACE;
+    size_t first_block = context.dedup->find(job.digest, file_size, file_type);
+    if (first_block == OUT_OF_FREE_SPACE || !sameContent(context, job, first_block, file_size))
+        return OUT_OF_FREE_SPACE;
+    return first_block;
+}
+
+// reserveEntry for a host file, sized by stat (or by its compressed bytes)
+inline bool reserveImport(import_context &context, const std::string &file_name, import_job &job, batch_stats &stats)
+{
+    job.file_name = file_name;
+    if (job.compressed)
+        return reserveEntry(context, file_name, job.packed.size(), job, stats, COMPRESSED_TYPE,
+                            findShared(context, job, job.packed.size(), COMPRESSED_TYPE));
+    struct stat file_stat;
+    if (stat(file_name.c_str(), &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+    {
+        std::cout << "could not open " << file_name << std::endl;
+        stats.files_skipped++;
+        return false;
+    }
+    // obtaining file's size in order to calculate how many blocks it needs
+    if (context.verbose)
+        std::cout << "file size == " << file_stat.st_size << std::endl;
+    return reserveEntry(context, file_name, file_stat.st_size, job, stats, BINARY_TYPE,
+                        findShared(context, job, file_stat.st_size, BINARY_TYPE));
+}
+
+// where the job's bytes go in the image
+inline off_t jobDataOffset(import_context &context, const import_job &job)
+{
+    return job.in_pack ? (off_t)job.first_block : (off_t)job.first_block * context.image.blockSize();
+}
+
+// the pieces of a split file in file order, each a sequential copy, then its map
+inline bool copySplitImport(import_context &context, const import_job &job, int image_fd, CopyBuffer &copy_buffer)
+{
+    int file_fd = open(job.file_name.c_str(), O_RDONLY);
+    if (file_fd < 0)
+        return false;
+    size_t block_size = context.image.blockSize();
+    bool copied = forEachExtentRange(job.extents, block_size, job.file_size, [&](off_t image_offset, off_t file_offset, size_t length) {
+        return copyRange(file_fd, file_offset, image_fd, image_offset, length, copy_buffer);
+    });
+    close(file_fd);
+    return copied && writeExtentMap(image_fd, job.extents, job.map_blocks, block_size);
+}
+
+// lock-free part: every job owns its extent, so copies only ever write their own blocks.
+// image_fd is the caller's own descriptor, sendfile moves its file position
+inline bool copyImport(import_context &context, const import_job &job, int image_fd, CopyBuffer &copy_buffer)
+{
+    if (job.shared)
+        return true;
+    CAB_STAT_PHASE(PHASE_COPY_DATA);
+    if (job.split)
+        return copySplitImport(context, job, image_fd, copy_buffer);
+    if (job.compressed)
+        return writeAll(image_fd, job.packed.data(), job.packed.size(), (off_t)job.first_block * context.image.blockSize());
+    int file_fd = open(job.file_name.c_str(), O_RDONLY);
+    if (file_fd < 0)
+        return false;
+    //write file, streamed straight to its blocks so memory use does not depend on its size
+    off_t data_offset = jobDataOffset(context, job);
+    bool copied = copyRange(file_fd, 0, image_fd, data_offset, job.file_size, copy_buffer);
+    close(file_fd);
+    return copied;
+}
+
+// serialized part: count the file (and index its new extent), or give its entry and blocks back
+inline void finishImport(import_context &context, const import_job &job, bool copied, batch_stats &stats)
+{
+    if (!copied)
+    {
+        std::cout << "could not copy " << job.file_name << " into the image" << std::endl;
+        context.resolver.removeEntry(job.parent, job.entry_index);
+        if (job.shared)
+            context.dedup->release(job.first_block);
+        else if (job.in_pack)
+            context.packer->release(job.first_block);
+        else if (job.split)
+            releaseExtents(context.bmap, job.extents, job.map_blocks);
+        else
+            context.bmap.writeBits(job.first_block, job.blocks_for_file, 0);
+        stats.files_skipped++;
+        return;
+    }
+    stats.files_written++;
+    if (job.shared)
+    {
+        stats.files_deduplicated++;
+        stats.bytes_deduplicated += job.file_size;
+        return;
+    }
+    stats.bytes_written += job.file_size;
+    // without room for a record the extent just stays unshared
+    if (job.hashed && !job.in_pack && !job.split && job.file_size != 0 && context.dedup->reserve(context.bmap))
+        context.dedup->insert(job.digest, job.file_size, job.compressed ? COMPRESSED_TYPE : BINARY_TYPE, job.first_block);
+}
+
+// writes one file's data and directory entry; the path given on the command line is also
+// its path inside the image ("logs/a.txt" lands in the "logs" subdirectory, created if
+// missing). Bitmap and directories are only updated in the mapping, the caller commits them
+inline bool writeToCAB(import_context &context, const std::string &file_name, CopyBuffer &copy_buffer, batch_stats &stats)
+{
+    import_job job;
+    prepareImport(context, file_name, job, std::max(1u, std::thread::hardware_concurrency()));
+    if (!reserveImport(context, file_name, job, stats))
+        return false;
+    bool copied = copyImport(context, job, context.image.fd(), copy_buffer);
+    finishImport(context, job, copied, stats);
+    return copied;
+}
+
+// extent a stream starts out with, before anything is known about its length
+const size_t STREAM_FIRST_EXTENT = 1 << 20;
+// most a stream's space grows by at once; up to that every growth doubles it
+const size_t STREAM_MAX_GROWTH = 64 << 20;
+
+// `blocks` more blocks for a stream whose last extent is full, written bytes into it: the
+// free blocks right after that extent when there are any (it grows in place), else a new
+// extent chained after it, else, for a file that must stay contiguous, a longer run the data
+// is moved to. False when the image has no room left
+inline bool growStream(import_context &context, std::vector<file_extent> &extents, uint64_t written, size_t blocks, CopyBuffer &copy_buffer)
+{
+    CAB_STAT_PHASE(PHASE_ALLOCATE);
+    FreeExtentIndex &index = context.bmap.getExtentIndex();
+    file_extent &last = extents.back();
+    size_t end = last.first_block + last.blocks;
+    size_t in_place = std::min(blocks, index.freeRunAt(end));
+    if (in_place > 0)
+    {
+        context.bmap.writeBits(end, in_place, 1);
+        last.blocks += in_place;
+        return true;
+    }
+
+    if (context.max_extents > 1)
+    {
+        if (extents.size() >= context.max_extents)
+            return false;
+        size_t first = context.bmap.getFreeBlock(blocks);
+        if (first == OUT_OF_FREE_SPACE)
+        {
+            first = index.largestExtentStart();
+            blocks = index.largestExtent();
+        }
+        if (first == OUT_OF_FREE_SPACE)
+            return false;
+        context.bmap.writeBits(first, blocks, 1);
+        extents.push_back({first, blocks});
+        return true;
+    }
+
+    size_t first = context.bmap.getFreeBlock(last.blocks + blocks);
+    if (first == OUT_OF_FREE_SPACE)
+    {
+        blocks = 1;
+        first = context.bmap.getFreeBlock(last.blocks + blocks);
+    }
+    if (first == OUT_OF_FREE_SPACE)
+        return false;
+    size_t block_size = context.image.blockSize();
+    context.bmap.writeBits(first, last.blocks + blocks, 1);
+    if (!copyRange(context.image.fd(), (off_t)last.first_block * block_size, context.image.fd(), (off_t)first * block_size, written, copy_buffer))
+    {
+        context.bmap.writeBits(first, last.blocks + blocks, 0);
+        return false;
+    }
+    context.bmap.writeBits(last.first_block, last.blocks, 0);
+    last = {first, last.blocks + blocks};
+    return true;
+}
+
+// imports everything read from input_fd up to its end as file_name, for input whose length is
+// not known up front (a pipe, standard input). The data goes straight into a speculative
+// extent that grows as it fills (growStream) and is trimmed to the final size at the end, so
+// nothing is staged in a temporary file first. Streams are stored raw: never compressed,
+// packed or deduplicated
+inline bool streamToCAB(import_context &context, int input_fd, const std::string &file_name, CopyBuffer &copy_buffer, batch_stats &stats)
+{
+    size_t block_size = context.image.blockSize();
+    if (!context.bmap.hasExtentIndex())
+        context.bmap.buildExtentIndex();
+
+    // the first extent is reserved like a file of that size, split if no run holds it
+    import_context first_context = context;
+    first_context.packer = nullptr;
+    first_context.verbose = false;
+    import_job job;
+    // no more than the largest free run, so a short stream fits wherever a file of its size would
+    size_t first_blocks = std::min((STREAM_FIRST_EXTENT + block_size - 1) / block_size, context.bmap.getExtentIndex().largestExtent());
+    uint64_t first_bytes = std::max(first_blocks, (size_t)1) * block_size;
+    if (!reserveEntry(first_context, file_name, first_bytes, job, stats))
+        return false;
+    std::vector<file_extent> extents = job.extents;
+    if (!job.split)
+        extents = {{job.first_block, job.blocks_for_file}};
+    // the map is laid out once the extents are final
+    std::vector<size_t> map_blocks;
+    releaseExtents(context.bmap, {}, job.map_blocks);
+
+    uint64_t written = 0;
+    uint64_t capacity = first_bytes;
+    uint64_t extent_start = 0; // file offset of extents[extent]
+    size_t extent = 0;
+    bool ok = true;
+    for (;;)
+    {
+        if (written == capacity)
+        {
+            size_t grow_bytes = std::min(std::max(capacity, (uint64_t)STREAM_FIRST_EXTENT), (uint64_t)STREAM_MAX_GROWTH);
+            ok = growStream(context, extents, written, (grow_bytes + block_size - 1) / block_size, copy_buffer);
+            if (!ok)
+            {
+                std::cout << "no space left for " << file_name << std::endl;
+                break;
+            }
+            capacity = 0;
+            for (const file_extent &e : extents)
+                capacity += e.blocks * block_size;
+        }
+        while (written >= extent_start + extents[extent].blocks * block_size)
+            extent_start += extents[extent++].blocks * block_size;
+
+        size_t room = extent_start + extents[extent].blocks * block_size - written;
+        CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+        ssize_t n = read(input_fd, copy_buffer.getData(), std::min(room, copy_buffer.getSize()));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            std::cout << "could not read " << file_name << std::endl;
+            ok = false;
+        }
+        if (n <= 0)
+            break;
+        CAB_STAT_COUNT(STAT_BYTES_READ, n);
+        off_t image_offset = (off_t)(extents[extent].first_block * block_size + (written - extent_start));
+        if (!writeAll(context.image.fd(), copy_buffer.getData(), n, image_offset))
+        {
+            std::cout << "could not copy " << file_name << " into the image" << std::endl;
+            ok = false;
+            break;
+        }
+        written += n;
+    }
+    if (ok && written == 0)
+    {
+        std::cout << "nothing read for " << file_name << ", skipping" << std::endl;
+        ok = false;
+    }
+
+    // trimmed to the blocks the data fills
+    if (ok)
+    {
+        size_t needed = (written + block_size - 1) / block_size;
+        size_t kept = 0;
+        for (file_extent &e : extents)
+        {
+            size_t keep = std::min((size_t)e.blocks, needed);
+            if (keep < e.blocks)
+                context.bmap.writeBits(e.first_block + keep, e.blocks - keep, 0);
+            e.blocks = keep;
+            needed -= keep;
+            kept += keep > 0;
+        }
+        extents.resize(kept);
+        if (extents.size() > 1)
+        {
+            ok = allocateMapBlocks(context.bmap, block_size, extents.size(), map_blocks) &&
+                 writeExtentMap(context.image.fd(), extents, map_blocks, block_size);
+            if (!ok)
+                std::cout << "no space left for the extent map of " << file_name << std::endl;
+        }
+    }
+    if (!ok)
+    {
+        releaseExtents(context.bmap, extents, map_blocks);
+        context.resolver.removeEntry(job.parent, job.entry_index);
+        stats.files_skipped++;
+        return false;
+    }
+
+    dir_entry file_entry;
+    memset(&file_entry, 0, sizeof(file_entry));
+    file_entry.first_block = extents.size() > 1 ? map_blocks[0] : extents[0].first_block;
+    file_entry.file_size_in_bytes = written;
+    file_entry.file_type = extents.size() > 1 ? EXTENTS_TYPE : BINARY_TYPE;
+    strncpy(file_entry.file_name, PathResolver::splitPath(file_name).back().c_str(), MAX_NAME_LENGTH);
+    context.resolver.insertEntry(job.parent, job.entry_index, file_entry);
+    if (context.verbose)
+        std::cout << file_name << ": " << written << " bytes streamed into " << extents.size() << " extent(s)" << std::endl;
+    stats.files_written++;
+    stats.bytes_written += written;
+    return true;
+}
+
+// n_threads workers each take the next file, compress it if asked, reserve it under the
+// metadata lock, copy it with no lock held, and take the lock again only to record the
+// outcome. Every context.commit_window files, or once the metadata nears the journal's size,
+// a commit is due: reservations wait, and the worker that finishes the last copy in flight
+// commits, so no entry is logged before its data is written
+inline void importFiles(import_context &context, const std::vector<std::string> &file_names, unsigned int n_threads, batch_stats &stats)
+{
+    if (n_threads <= 1)
+    {
+        CopyBuffer copy_buffer;
+        size_t since_commit = 0;
+        for (const std::string &file_name : file_names)
+        {
+            writeToCAB(context, file_name, copy_buffer, stats);
+            since_commit++;
+            if ((context.commit_window != 0 && since_commit >= context.commit_window) || metadataDue(context))
+            {
+                commitImports(context, stats);
+                since_commit = 0;
+            }
+        }
+        return;
+    }
+
+    std::mutex metadata_lock;
+    std::condition_variable committed;
+    size_t in_flight = 0, since_commit = 0;
+    bool commit_due = false;
+    std::atomic<size_t> next_file(0);
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < n_threads; t++)
+    {
+        workers.emplace_back([&]() {
+            CopyBuffer copy_buffer;
+            int image_fd = open(context.image_name.c_str(), O_WRONLY);
+            for (size_t i = next_file++; i < file_names.size(); i = next_file++)
+            {
+                import_job job;
+                prepareImport(context, file_names[i], job, 1);
+                {
+                    std::unique_lock<std::mutex> guard(metadata_lock);
+                    committed.wait(guard, [&]() { return !commit_due; });
+                    if (!reserveImport(context, file_names[i], job, stats))
+                        continue;
+                    in_flight++;
+                }
+                bool copied = image_fd >= 0 && copyImport(context, job, image_fd, copy_buffer);
+                std::lock_guard<std::mutex> guard(metadata_lock);
+                finishImport(context, job, copied, stats);
+                in_flight--;
+                since_commit++;
+                if ((context.commit_window != 0 && since_commit >= context.commit_window) || metadataDue(context))
+                    commit_due = true;
+                if (commit_due && in_flight == 0)
+                {
+                    commitImports(context, stats);
+                    since_commit = 0;
+                    commit_due = false;
+                    committed.notify_all();
+                }
+            }
+            if (image_fd >= 0)
+                close(image_fd);
+        });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+// files waiting for their queued copies, finished together once the batch is full
+const size_t BLOCK_IO_BATCH_FILES = 256;
+
+// single-threaded import through a block I/O backend: reservations run as before, the copies
+// of up to BLOCK_IO_BATCH_FILES files (no more than a commit window) are queued and finished
+// once the backend has run them. Files are always stored raw here
+inline void importFilesBlockIO(import_context &context, const std::vector<std::string> &file_names, BlockIO &io, batch_stats &stats)
+{
+    typedef struct queued_file
+    {
+        import_job job;
+        int fd;
+        bool copied;
+    } queued_file;
+
+    std::vector<queued_file> batch;
+    batch.reserve(BLOCK_IO_BATCH_FILES); // the backend holds pointers to the copied flags
+    size_t next_buffer = 0;
+    size_t batch_files = BLOCK_IO_BATCH_FILES, since_commit = 0;
+    if (context.commit_window != 0)
+        batch_files = std::min(batch_files, context.commit_window);
+    auto commitBatch = [&]() {
+        {
+            CAB_STAT_PHASE(PHASE_COPY_DATA);
+            io.wait();
+        }
+        next_buffer = 0;
+        for (queued_file &file : batch)
+        {
+            close(file.fd);
+            finishImport(context, file.job, file.copied, stats);
+        }
+        since_commit += batch.size();
+        batch.clear();
+        if ((context.commit_window != 0 && since_commit >= context.commit_window) || metadataDue(context))
+        {
+            commitImports(context, stats);
+            since_commit = 0;
+        }
+    };
+
+    for (const std::string &file_name : file_names)
+    {
+        // before the next reservation, so a commit never holds an entry without its data
+        if (batch.size() == batch_files || (!batch.empty() && metadataDue(context)))
+            commitBatch();
+        import_job job;
+        if (!reserveImport(context, file_name, job, stats))
+            continue;
+        int file_fd = open(file_name.c_str(), O_RDONLY);
+        if (file_fd < 0)
+        {
+            finishImport(context, job, false, stats);
+            continue;
+        }
+        batch.push_back({job, file_fd, true});
+
+        queued_file &file = batch.back();
+        CAB_STAT_PHASE(PHASE_COPY_DATA);
+        auto queueRange = [&](off_t image_offset, off_t file_offset, size_t length) {
+            for (size_t offset = 0; offset < length; offset += io.bufferSize())
+            {
+                // buffers are only handed out again after everything queued has run
+                if (next_buffer == io.bufferCount())
+                {
+                    io.wait();
+                    next_buffer = 0;
+                }
+                size_t chunk = std::min(io.bufferSize(), length - offset);
+                io.copyIn(file_fd, file_offset + offset, image_offset + offset, chunk, next_buffer++, &file.copied);
+            }
+            return true;
+        };
+        if (!job.split)
+            queueRange(jobDataOffset(context, job), 0, job.file_size);
+        else if (!forEachExtentRange(job.extents, context.image.blockSize(), job.file_size, queueRange) ||
+                 !writeExtentMap(context.image.fd(), job.extents, job.map_blocks, context.image.blockSize()))
+            file.copied = false;
+    }
+    commitBatch();
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef CAB_JOURNAL_HPP
+#define CAB_JOURNAL_HPP
+
+// redo journal of the metadata blocks (boot record, bitmap, directory tables). A transaction
+// is the new contents of every block it changes, written to the journal region in one piece
+// and sealed by a checksum over all of it; once that is on disk the blocks are written in
+// place and the header is cleared. Recovery replays a transaction whose checksum matches;
+// one that does not was torn before it was acknowledged and is ignored
+
+#include <set>
+#include <unistd.h>
+
+#include "cab_fs.hpp"
+#include "cab_copy.hpp"
+
+const uint32_t JOURNAL_MAGIC = 0x4a424143; // "CABJ"
+const size_t DEFAULT_JOURNAL_SIZE = 4 << 20;
+
+// first bytes of the journal region, followed by n_blocks block numbers and, from the next
+// block boundary on, the n_blocks block images
+typedef struct journal_header
+{
+    uint32_t magic;
+    uint32_t n_blocks;
+    uint64_t sequence;
+    uint64_t checksum; // over the header with checksum 0, the block numbers and the images
+} __attribute__((packed)) journal_header;
+
+inline bool hasJournal(const boot_record &b_record)
+{
+    return b_record.journal_blocks != 0;
+}
+
+// blocks one transaction can carry: the header and block numbers share the leading blocks
+inline size_t journalCapacity(const boot_record &b_record)
+{
+    size_t block_size = blockSizeOf(b_record);
+    size_t region = b_record.journal_blocks * block_size;
+    return region > sizeof(journal_header) ? (region - sizeof(journal_header)) / (block_size + sizeof(uint64_t)) : 0;
+}
+
+inline size_t journalDescriptorBlocks(const boot_record &b_record, size_t n_blocks)
+{
+    size_t block_size = blockSizeOf(b_record);
+    return (sizeof(journal_header) + n_blocks * sizeof(uint64_t) + block_size - 1) / block_size;
+}
+
+// FNV-1a over 64-bit words, the tail byte by byte
+inline uint64_t journalChecksum(const char *data, size_t length, uint64_t hash = 14695981039346656037ULL)
+{
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < length; i++)
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+// writes blocks (at most journalCapacity) as one transaction, their images taken from
+// source + block * block size; nothing is synced here
+inline bool writeJournal(int fd, const boot_record &b_record, const std::vector<size_t> &blocks, const char *source, uint64_t sequence)
+{
+    size_t block_size = blockSizeOf(b_record);
+    size_t descriptor_blocks = journalDescriptorBlocks(b_record, blocks.size());
+    std::vector<char> transaction((descriptor_blocks + blocks.size()) * block_size, 0);
+
+    journal_header header = {JOURNAL_MAGIC, (uint32_t)blocks.size(), sequence, 0};
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        uint64_t block = blocks[i];
+        memcpy(transaction.data() + sizeof(header) + i * sizeof(block), &block, sizeof(block));
+        memcpy(transaction.data() + (descriptor_blocks + i) * block_size, source + block * block_size, block_size);
+    }
+    memcpy(transaction.data(), &header, sizeof(header));
+    header.checksum = journalChecksum(transaction.data(), transaction.size());
+    memcpy(transaction.data(), &header, sizeof(header));
+    return writeAll(fd, transaction.data(), transaction.size(), (off_t)b_record.journal_first_block * block_size);
+}
+
+// the committed transaction in the journal, false when there is none (or it is torn)
+inline bool readJournal(int fd, const boot_record &b_record, std::vector<uint64_t> &blocks, std::vector<char> &images)
+{
+    size_t block_size = blockSizeOf(b_record);
+    off_t journal_offset = (off_t)b_record.journal_first_block * block_size;
+    journal_header header;
+    CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+    if (pread(fd, &header, sizeof(header), journal_offset) != sizeof(header) || header.magic != JOURNAL_MAGIC ||
+        header.n_blocks == 0 || header.n_blocks > journalCapacity(b_record))
+        return false;
+
+    size_t descriptor_blocks = journalDescriptorBlocks(b_record, header.n_blocks);
+    std::vector<char> transaction((descriptor_blocks + header.n_blocks) * block_size);
+    for (size_t done = 0; done < transaction.size();)
+    {
+        ssize_t n = pread(fd, transaction.data() + done, transaction.size() - done, journal_offset + done);
+        CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        CAB_STAT_COUNT(STAT_BYTES_READ, n);
+        done += n;
+    }
+    uint64_t checksum = header.checksum;
+    header.checksum = 0;
+    memcpy(transaction.data(), &header, sizeof(header));
+    if (journalChecksum(transaction.data(), transaction.size()) != checksum)
+        return false;
+
+    blocks.resize(header.n_blocks);
+    memcpy(blocks.data(), transaction.data() + sizeof(header), header.n_blocks * sizeof(uint64_t));
+    for (uint64_t block : blocks)
+    {
+        // only metadata outside the journal itself is ever logged
+        if (block >= b_record.total_blocks ||
+            (block >= b_record.journal_first_block && block < b_record.journal_first_block + b_record.journal_blocks))
+            return false;
+    }
+    images.assign(transaction.begin() + descriptor_blocks * block_size, transaction.end());
+    return true;
+}
+
+// makes the journal empty again once its transaction is in place
+inline bool clearJournal(int fd, const boot_record &b_record)
+{
+    journal_header header;
+    memset(&header, 0, sizeof(header));
+    return writeAll(fd, &header, sizeof(header), (off_t)b_record.journal_first_block * blockSizeOf(b_record));
+}
+
+#endif
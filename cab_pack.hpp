@@ -0,0 +1,119 @@
+#ifndef CAB_PACK_HPP
+#define CAB_PACK_HPP
+
+// small files packed together (cab_file_writer --pack): a file of at most packThreshold bytes
+// does not get a block of its own but is appended to a shared pack block, and its entry
+// (PACKED_TYPE) holds the byte offset of its data in the image instead of a block number.
+// Each pack block starts with a pack_header counting the entries that still point into it;
+// cabd frees the block when that count drops to zero. Space of removed files inside a pack
+// block is not reused. The block being filled is recorded in the boot record, so the next
+// run keeps appending to it
+
+#include "cab_fs.hpp"
+#include "cab_image.hpp"
+#include "cab_copy.hpp"
+
+const uint32_t PACK_MAGIC = 0x50424143; // "CABP"
+
+typedef struct pack_header
+{
+    uint32_t magic;
+    uint32_t live_files; // entries whose data is in this block
+    uint32_t used_bytes; // header included: the next file goes at this offset
+    uint32_t reserved;
+} __attribute__((packed)) pack_header;
+
+// files up to this size are packed; a quarter block keeps at least three files per block
+inline size_t packThreshold(size_t block_size)
+{
+    return block_size / 4;
+}
+
+inline bool readPackHeader(int image_fd, size_t block, size_t block_size, pack_header &header)
+{
+    CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+    return pread(image_fd, &header, sizeof(header), (off_t)block * block_size) == sizeof(header) && header.magic == PACK_MAGIC &&
+           header.used_bytes >= sizeof(header) && header.used_bytes <= block_size;
+}
+
+// hands out space in pack blocks to one import run; not thread-safe, callers hold the
+// metadata lock as for every other reservation
+class PackWriter
+{
+public:
+    PackWriter(CabImage &image, BitMap &bmap) : image(image), bmap(bmap), block_size(image.blockSize())
+    {
+        // the pack block of the previous run, if it still is one
+        size_t recorded = image.bootRecord()->pack_block;
+        if (recorded != 0 && recorded * block_size >= image.metadataEnd() && recorded < image.bootRecord()->total_blocks &&
+            bmap.getBit(recorded) && readPackHeader(image.fd(), recorded, block_size, header))
+            block = recorded;
+    }
+
+    bool packs(uint64_t file_size)
+    {
+        return file_size != 0 && file_size <= packThreshold(block_size);
+    }
+
+    // byte offset for file_size bytes, in the open pack block or in a new one when it is full;
+    // OUT_OF_FREE_SPACE when no block is left
+    uint64_t place(uint64_t file_size)
+    {
+        if (block == 0 || header.used_bytes + file_size > block_size)
+        {
+            if (block != 0 && !writeHeader())
+                return OUT_OF_FREE_SPACE;
+            size_t new_block;
+            {
+                CAB_STAT_PHASE(PHASE_ALLOCATE);
+                new_block = bmap.getFreeBlock(1);
+            }
+            if (new_block == OUT_OF_FREE_SPACE)
+                return OUT_OF_FREE_SPACE;
+            bmap.writeBits(new_block, 1, 1);
+            block = new_block;
+            header = {PACK_MAGIC, 0, sizeof(pack_header), 0};
+            dirty = true;
+        }
+        uint64_t offset = (uint64_t)block * block_size + header.used_bytes;
+        header.used_bytes += file_size;
+        header.live_files++;
+        dirty = true;
+        return offset;
+    }
+
+    // a placed file whose copy failed; its bytes stay used, only the count is taken back (a
+    // block already closed keeps the count, and is never freed, rather than risk its neighbours)
+    void release(uint64_t offset)
+    {
+        if (block != 0 && offset / block_size == block && header.live_files > 0)
+        {
+            header.live_files--;
+            dirty = true;
+        }
+    }
+
+    // writes the open block's header, before the entries pointing into it are committed, and
+    // records the block in the boot record
+    bool flush()
+    {
+        image.bootRecord()->pack_block = block;
+        return !dirty || writeHeader();
+    }
+
+private:
+    CabImage &image;
+    BitMap &bmap;
+    size_t block_size;
+    size_t block = 0; // open pack block, 0: none
+    pack_header header = {PACK_MAGIC, 0, sizeof(pack_header), 0};
+    bool dirty = false;
+
+    bool writeHeader()
+    {
+        dirty = false;
+        return writeAll(image.fd(), &header, sizeof(header), (off_t)block * block_size);
+    }
+};
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef CAB_PROTO_HPP
+#define CAB_PROTO_HPP
+
+// wire format between cabd and its clients over a Unix stream socket. A request is a header,
+// the path inside the image and the payload; a response is a header and the payload. Clients
+// may send any number of requests before reading: responses come back in request order
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+const size_t CAB_PROTO_MAX_PATH = 4096;
+const size_t CAB_PROTO_MAX_PAYLOAD = 256 << 20;
+
+enum cab_op
+{
+    CAB_OP_OPEN = 1, // path: image file name; reply: uint32_t image id for the other requests
+    CAB_OP_PUT,      // payload: the file's bytes; an existing file at path is replaced
+    CAB_OP_GET,      // reply: the file's bytes
+    CAB_OP_STAT,     // reply: wire_entry_stat, or wire_image_stat for an empty path
+    CAB_OP_LIST,     // path: a directory, empty for the root; reply: wire_list_entry + name, repeated
+    CAB_OP_DELETE
+};
+
+enum cab_status
+{
+    CAB_OK,
+    CAB_NOT_FOUND,
+    CAB_NO_SPACE,   // no extent or directory slot for the file
+    CAB_INVALID,    // malformed request, bad name, or the wrong kind of entry
+    CAB_TOO_LARGE,  // over CAB_PROTO_MAX_PAYLOAD
+    CAB_IO_ERROR
+};
+
+typedef struct request_header
+{
+    uint32_t request_id; // echoed back, the daemon does not interpret it
+    uint8_t op;
+    uint8_t flags;
+    uint16_t path_length;
+    uint32_t image;
+    uint64_t payload_length;
+} __attribute__((packed)) request_header;
+
+typedef struct response_header
+{
+    uint32_t request_id;
+    int32_t status;
+    uint64_t payload_length;
+} __attribute__((packed)) response_header;
+
+typedef struct wire_entry_stat
+{
+    uint64_t first_block;
+    uint64_t file_size;
+    uint8_t file_type;
+} __attribute__((packed)) wire_entry_stat;
+
+typedef struct wire_image_stat
+{
+    uint64_t block_size;
+    uint64_t total_blocks;
+    uint64_t free_blocks;
+    uint64_t largest_free_extent;
+} __attribute__((packed)) wire_image_stat;
+
+typedef struct wire_list_entry
+{
+    uint64_t file_size;
+    uint8_t file_type;
+    uint8_t name_length; // the name follows, not terminated
+} __attribute__((packed)) wire_list_entry;
+
+inline const char *statusName(int32_t status)
+{
+    static const char *names[] = {"ok", "not found", "no space", "invalid request", "too large", "i/o error"};
+    return status >= 0 && status <= CAB_IO_ERROR ? names[status] : "unknown status";
+}
+
+// blocking send/receive of exactly length bytes on a stream socket
+inline bool sendAll(int fd, const void *data, size_t length)
+{
+    for (size_t sent = 0; sent < length;)
+    {
+        ssize_t n = send(fd, (const char *)data + sent, length - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+inline bool receiveAll(int fd, void *data, size_t length)
+{
+    for (size_t received = 0; received < length;)
+    {
+        ssize_t n = recv(fd, (char *)data + received, length - received, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        received += n;
+    }
+    return true;
+}
+
+inline bool socketAddress(const std::string &socket_path, sockaddr_un &address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+        return false;
+    memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+    return true;
+}
+
+#endif
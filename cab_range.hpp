@@ -0,0 +1,217 @@
+#ifndef CAB_RANGE_HPP
+#define CAB_RANGE_HPP
+
+// byte ranges of one stored file without extracting it: open() resolves the entry once (its
+// extent map too, for a split file) into a list of segments, file offset -> image offset, and
+// every read after that is a lookup in the list and a pread. readBatch sorts the requests by
+// position in the image and reads requests that touch neighbouring bytes with one preadv.
+// A compressed file inflates only the chunks a range covers, the last one is kept
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <climits>
+
+#include "cab_fs.hpp"
+#include "cab_image.hpp"
+#include "cab_compress.hpp"
+#include "cab_extent.hpp"
+
+typedef struct range_request
+{
+    uint64_t offset; // in the file
+    size_t length;
+    char *buffer;
+    ssize_t result;  // set by readBatch: bytes read (fewer at the end of the file), -1 on error
+} range_request;
+
+class RangeReader
+{
+public:
+    // false when the entry is not a file or its map or chunk table does not check out
+    bool open(CabImage &image, const dir_entry &entry)
+    {
+        this->image = &image;
+        segments.clear();
+        compressed = false;
+        cached_chunk = SIZE_MAX;
+        size_t block_size = image.blockSize();
+        file_size = entry.file_size_in_bytes;
+        if (!isFileEntry(entry))
+            return false;
+        if (entry.file_type == COMPRESSED_TYPE)
+        {
+            extent_span span = image.fileData(entry);
+            if (span.data == nullptr || !readCompressedTable(span.data, span.size, header, offsets))
+                return false;
+            stored = span.data;
+            compressed = true;
+            file_size = header.file_size;
+            return true;
+        }
+        if (entry.file_type == EXTENTS_TYPE)
+        {
+            std::vector<file_extent> extents;
+            if (!readExtentMap(image.fd(), entry, block_size, image.bootRecord()->total_blocks, extents))
+                return false;
+            return forEachExtentRange(extents, block_size, file_size, [&](off_t image_offset, off_t file_offset, size_t length) {
+                segments.push_back({(uint64_t)file_offset, (uint64_t)image_offset, length});
+                return true;
+            });
+        }
+        uint64_t data_offset = entryDataOffset(entry, block_size);
+        if (data_offset > image.size() || file_size > image.size() - data_offset)
+            return false;
+        segments.push_back({0, data_offset, file_size});
+        return true;
+    }
+
+    // bytes the file holds (the original size for a compressed file)
+    uint64_t size()
+    {
+        return file_size;
+    }
+
+    // pread on the file: up to length bytes at offset, fewer at the end; -1 on error
+    ssize_t read(void *buffer, size_t length, uint64_t offset)
+    {
+        if (offset >= file_size)
+            return 0;
+        length = std::min((uint64_t)length, file_size - offset);
+        if (compressed)
+            return readCompressed((char *)buffer, length, offset) ? (ssize_t)length : -1;
+
+        std::vector<range_piece> pieces;
+        pieceRange(0, (char *)buffer, length, offset, pieces);
+        for (const range_piece &piece : pieces)
+        {
+            CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+            if (pread(image->fd(), piece.buffer, piece.length, piece.image_offset) != (ssize_t)piece.length)
+                return -1;
+            CAB_STAT_COUNT(STAT_BYTES_READ, piece.length);
+        }
+        return length;
+    }
+
+    // every request read, in image order so neighbouring ranges share one preadv; returns the
+    // number of requests that failed
+    size_t readBatch(std::vector<range_request> &requests)
+    {
+        // file order, so requests in the same compressed chunk inflate it once
+        std::vector<size_t> order(requests.size());
+        for (size_t r = 0; r < order.size(); r++)
+            order[r] = r;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return requests[a].offset < requests[b].offset; });
+        std::vector<range_piece> pieces;
+        for (size_t r : order)
+        {
+            range_request &request = requests[r];
+            request.result = request.offset >= file_size ? 0 : std::min((uint64_t)request.length, file_size - request.offset);
+            if (compressed)
+            {
+                if (request.result > 0 && !readCompressed(request.buffer, request.result, request.offset))
+                    request.result = -1;
+            }
+            else if (request.result > 0)
+                pieceRange(r, request.buffer, request.result, request.offset, pieces);
+        }
+        std::sort(pieces.begin(), pieces.end(), [](const range_piece &a, const range_piece &b) { return a.image_offset < b.image_offset; });
+
+        std::vector<iovec> vectors;
+        for (size_t first = 0; first < pieces.size();)
+        {
+            // the run of pieces that continue each other in the image
+            size_t last = first + 1;
+            uint64_t end = pieces[first].image_offset + pieces[first].length;
+            while (last < pieces.size() && last - first < IOV_MAX && pieces[last].image_offset == end)
+                end += pieces[last++].length;
+            vectors.clear();
+            for (size_t p = first; p < last; p++)
+                vectors.push_back({pieces[p].buffer, pieces[p].length});
+            CAB_STAT_COUNT(STAT_SYSCALLS, 1);
+            ssize_t done = preadv(image->fd(), vectors.data(), vectors.size(), pieces[first].image_offset);
+            if (done != (ssize_t)(end - pieces[first].image_offset))
+            {
+                for (size_t p = first; p < last; p++)
+                    requests[pieces[p].request].result = -1;
+            }
+            else
+                CAB_STAT_COUNT(STAT_BYTES_READ, done);
+            first = last;
+        }
+
+        size_t failed = 0;
+        for (const range_request &request : requests)
+            failed += request.result < 0;
+        return failed;
+    }
+
+private:
+    typedef struct file_segment
+    {
+        uint64_t file_offset;
+        uint64_t image_offset;
+        uint64_t length;
+    } file_segment;
+
+    // the part of one request that lies in one segment
+    typedef struct range_piece
+    {
+        size_t request;
+        char *buffer;
+        size_t length;
+        uint64_t image_offset;
+    } range_piece;
+
+    CabImage *image = nullptr;
+    uint64_t file_size = 0;
+    std::vector<file_segment> segments; // in file order
+    bool compressed = false;
+    const char *stored = nullptr;
+    compressed_header header;
+    std::vector<uint64_t> offsets;
+    size_t cached_chunk = SIZE_MAX;
+    std::vector<char> chunk;
+
+    // [offset, offset + length) of the file, inside its size, split at segment boundaries
+    void pieceRange(size_t request, char *buffer, size_t length, uint64_t offset, std::vector<range_piece> &pieces)
+    {
+        auto segment = std::upper_bound(segments.begin(), segments.end(), offset,
+                                        [](uint64_t value, const file_segment &s) { return value < s.file_offset; });
+        for (--segment; length > 0; ++segment)
+        {
+            uint64_t inside = offset - segment->file_offset;
+            size_t piece = std::min((uint64_t)length, segment->length - inside);
+            pieces.push_back({request, buffer, piece, segment->image_offset + inside});
+            buffer += piece;
+            offset += piece;
+            length -= piece;
+        }
+    }
+
+    bool readCompressed(char *buffer, size_t length, uint64_t offset)
+    {
+        CAB_STAT_PHASE(PHASE_COMPRESS);
+        chunk.resize(header.chunk_size);
+        while (length > 0)
+        {
+            size_t index = offset / header.chunk_size;
+            if (index != cached_chunk)
+            {
+                cached_chunk = SIZE_MAX;
+                if (!inflateChunk(stored, header, offsets, index, chunk.data()))
+                    return false;
+                cached_chunk = index;
+            }
+            size_t inside = offset % header.chunk_size;
+            size_t piece = std::min(length, chunkLength(header, index) - inside);
+            memcpy(buffer, chunk.data() + inside, piece);
+            buffer += piece;
+            offset += piece;
+            length -= piece;
+        }
+        return true;
+    }
+};
+
+#endif
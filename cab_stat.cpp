@@ -0,0 +1,147 @@
+#include "cab_image.hpp"
+#include "cab_stat.hpp"
+#include "cab_extract.hpp"
+#include "cab_dedup.hpp"
+
+typedef struct tree_stats
+{
+    size_t files;
+    size_t directories;
+    size_t file_bytes;
+    size_t file_blocks;
+    size_t compressed_files;
+    size_t compressed_bytes; // stored, the original size is in original_bytes
+    size_t original_bytes;
+    size_t packed_files;
+    size_t packed_bytes;
+    std::set<size_t> pack_blocks;
+    size_t split_files;
+    size_t split_extents;
+    size_t map_blocks;
+    size_t bad_maps;
+} tree_stats;
+
+// counts what the directory tree below `entries` holds, without following ponto/pontoponto
+void walkTree(CabImage &image, dir_entry *entries, size_t n_entries, tree_stats &stats, size_t depth)
+{
+    size_t block_size = image.blockSize();
+    for (size_t i = 0; i < n_entries; i++)
+    {
+        const dir_entry &entry = entries[i];
+        if (entry.file_type == 0xff || entry.first_block == 0)
+            continue;
+        if (entry.file_type == DIRECTORY_TYPE)
+        {
+            if (strcmp(entry.file_name, "ponto") == 0 || strcmp(entry.file_name, "pontoponto") == 0 || depth > 64)
+                continue;
+            stats.directories++;
+            size_t table_end = entry.first_block * block_size + entry.file_size_in_bytes;
+            if (table_end <= image.size())
+                walkTree(image, (dir_entry *)image.blockData(entry.first_block), entry.file_size_in_bytes / ENTRY_SIZE, stats, depth + 1);
+            continue;
+        }
+        stats.files++;
+        stats.file_bytes += entry.file_size_in_bytes;
+        stats.file_blocks += entryBlocks(entry, block_size);
+        if (entry.file_type == PACKED_TYPE)
+        {
+            stats.packed_files++;
+            stats.packed_bytes += entry.file_size_in_bytes;
+            stats.pack_blocks.insert(entry.first_block / block_size);
+        }
+        if (entry.file_type == EXTENTS_TYPE)
+        {
+            std::vector<file_extent> extents;
+            std::vector<size_t> map_blocks;
+            stats.split_files++;
+            if (!readExtentMap(image.fd(), entry, block_size, image.bootRecord()->total_blocks, extents, &map_blocks))
+                stats.bad_maps++;
+            stats.split_extents += extents.size();
+            stats.map_blocks += map_blocks.size();
+        }
+        if (entry.file_type == COMPRESSED_TYPE)
+        {
+            stats.compressed_files++;
+            stats.compressed_bytes += entry.file_size_in_bytes;
+            stats.original_bytes += extractedSize(image, entry);
+        }
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    if (argc < 2 || argc > 3 || (argc == 3 && std::string(argv[2]) != "--stats"))
+    {
+        std::cout << "usage: " << argv[0] << " <image> [--stats]\n";
+        return 1;
+    }
+
+    CabImage image;
+    if (!image.open(argv[1], false) || !image.isFormatted())
+    {
+        std::cout << "could not open image " << argv[1] << std::endl;
+        return 1;
+    }
+    const boot_record &b_record = *image.bootRecord();
+    size_t block_size = image.blockSize();
+
+    // read-only mapping: the bitmap is only scanned to build the extent index
+    BitMap bmap(b_record, image.bitmapBytes());
+    bmap.buildExtentIndex();
+    fragmentation_report report = makeFragmentationReport(bmap.getExtentIndex());
+
+    tree_stats tree = {0, 0, 0, 0, 0, 0, 0, 0, 0, {}, 0, 0, 0, 0};
+    walkTree(image, image.rootDir(), b_record.n_root_entries, tree, 0);
+
+    size_t metadata_blocks = 1 + b_record.bitmap_size_in_blocks + rootDirBlocks(b_record) + b_record.journal_blocks;
+    std::cout << "image              " << argv[1] << "\n"
+              << "format version     " << b_record.version << "\n"
+              << "block size         " << block_size << " bytes\n"
+              << "total blocks       " << b_record.total_blocks << " (" << b_record.total_blocks * block_size << " bytes)\n"
+              << "metadata blocks    " << metadata_blocks << " (boot record, " << b_record.bitmap_size_in_blocks
+              << " bitmap, " << rootDirBlocks(b_record) << " root directory, " << b_record.journal_blocks << " journal)\n"
+              << "used data blocks   " << b_record.total_blocks - metadata_blocks - report.free_blocks << "\n"
+              << "files              " << tree.files << " (" << tree.file_bytes << " bytes in " << tree.file_blocks << " blocks)\n"
+              << "directories        " << tree.directories << "\n";
+    if (tree.compressed_files != 0)
+        std::cout << "compressed files   " << tree.compressed_files << " (" << tree.compressed_bytes << " bytes stored for "
+                  << tree.original_bytes << ", ratio " << (double)tree.original_bytes / tree.compressed_bytes << ")\n";
+    if (tree.packed_files != 0)
+        std::cout << "packed files       " << tree.packed_files << " (" << tree.packed_bytes << " bytes in " << tree.pack_blocks.size()
+                  << " pack blocks, " << tree.packed_files * block_size - tree.pack_blocks.size() * block_size
+                  << " bytes saved against a block per file)\n";
+    if (tree.split_files != 0)
+    {
+        std::cout << "split files        " << tree.split_files << " (" << tree.split_extents << " extents, "
+                  << (double)tree.split_extents / tree.split_files << " per file, " << tree.map_blocks << " map blocks";
+        if (tree.bad_maps != 0)
+            std::cout << ", " << tree.bad_maps << " with an unreadable map";
+        std::cout << ")\n";
+    }
+    DedupIndex dedup;
+    if (!dedup.load(image))
+        std::cout << "dedup              unreadable table\n";
+    else if (dedup.tableBlocks() != 0)
+    {
+        dedup_totals totals = dedup.totals();
+        std::cout << "dedup              " << totals.extents << " indexed extents for " << totals.references << " files, "
+                  << totals.logical_bytes - totals.stored_bytes << " bytes saved (ratio "
+                  << (totals.stored_bytes == 0 ? 1 : (double)totals.logical_bytes / totals.stored_bytes) << "), table of "
+                  << dedup.tableBlocks() << " blocks at block " << dedup.tableFirstBlock() << "\n";
+    }
+    std::cout
+              << "policy             " << ALLOC_POLICY_NAMES[bmap.getPolicy()] << " (next-fit resumes at block "
+              << b_record.next_fit_block << ")\n";
+    if (hasJournal(b_record))
+        std::cout << "journal            " << b_record.journal_blocks << " blocks at block " << b_record.journal_first_block << ", up to "
+                  << journalCapacity(b_record) << " blocks per commit";
+    else
+        std::cout << "journal            none";
+    if (image.replayed_blocks != 0)
+        std::cout << " (" << image.replayed_blocks << " blocks replayed on open, not yet written in place)";
+    std::cout << "\n";
+    printFragmentationReport(std::cout, report, block_size);
+    if (argc == 3)
+        printStats("cab_stat");
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef CAB_STAT_HPP
+#define CAB_STAT_HPP
+
+// free space report of cab_stat, kept in a header so cab_bench can print the same numbers
+
+#include "cab_fs.hpp"
+
+typedef struct fragmentation_report
+{
+    size_t free_blocks;
+    size_t free_extents;
+    size_t largest_extent;
+    // bucket k counts the free extents of 2^k to 2^(k+1) - 1 blocks
+    std::vector<size_t> extents_by_size;
+    std::vector<size_t> blocks_by_size;
+} fragmentation_report;
+
+inline fragmentation_report makeFragmentationReport(FreeExtentIndex &index)
+{
+    fragmentation_report report = {0, index.extentCount(), index.largestExtent(), {}, {}};
+    for (auto &extent : index.extentsByAddress())
+    {
+        size_t bucket = 63 - __builtin_clzll(extent.second);
+        if (bucket >= report.extents_by_size.size())
+        {
+            report.extents_by_size.resize(bucket + 1, 0);
+            report.blocks_by_size.resize(bucket + 1, 0);
+        }
+        report.extents_by_size[bucket]++;
+        report.blocks_by_size[bucket] += extent.second;
+        report.free_blocks += extent.second;
+    }
+    return report;
+}
+
+// share of the free space outside the largest hole: 0 when it is all one extent
+inline double externalFragmentation(const fragmentation_report &report)
+{
+    return report.free_blocks == 0 ? 0 : 1 - (double)report.largest_extent / report.free_blocks;
+}
+
+inline void printFragmentationReport(std::ostream &out, const fragmentation_report &report, size_t block_size)
+{
+    out << "free blocks        " << report.free_blocks << " (" << report.free_blocks * block_size << " bytes)\n"
+        << "free extents       " << report.free_extents << "\n"
+        << "largest free hole  " << report.largest_extent << " blocks (" << report.largest_extent * block_size << " bytes)\n"
+        << "fragmentation      " << 100 * externalFragmentation(report) << "% of the free space outside the largest hole\n"
+        << "free extents by size (blocks):\n";
+    for (size_t k = 0; k < report.extents_by_size.size(); k++)
+    {
+        if (report.extents_by_size[k] == 0)
+            continue;
+        std::string range = std::to_string((size_t)1 << k);
+        if (k > 0)
+            range += "-" + std::to_string(((size_t)2 << k) - 1);
+        out << "  " << range << std::string(range.size() < 24 ? 24 - range.size() : 1, ' ')
+            << report.extents_by_size[k] << " extents, " << report.blocks_by_size[k] << " blocks\n";
+    }
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef CAB_STATS_HPP
+#define CAB_STATS_HPP
+
+// built-in instrumentation shared by the tools: time per phase, byte, syscall, bitmap and
+// block cache counters and a latency histogram of block allocations, printed as JSON by
+// --stats. Everything is a relaxed atomic add, so worker threads record without locking.
+// Building with -DCAB_NO_STATS turns every CAB_STAT_* macro into nothing
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+enum stat_phase
+{
+    PHASE_LOAD_METADATA,  // mapping the image, replaying the journal, building the indexes
+    PHASE_ALLOCATE,       // choosing an extent for a file
+    PHASE_COPY_DATA,      // file bytes between the host and the image
+    PHASE_FLUSH_METADATA, // bitmap, directories and boot record to disk
+    PHASE_FORMAT,         // all of cab_format's work
+    PHASE_COMPRESS,       // deflating chunks on import, inflating them on reads
+    PHASE_DEDUP,          // fingerprinting files and comparing them with a shared extent
+    N_STAT_PHASES
+};
+
+enum stat_counter
+{
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_SYSCALLS, // read/write/copy/sync calls on file data and metadata
+    STAT_BITS_SCANNED,
+    STAT_CACHE_HITS,   // blocks cabd's block cache had
+    STAT_CACHE_MISSES, // blocks it had to load or make room for
+    N_STAT_COUNTERS
+};
+
+// allocation latencies in power-of-two buckets: bucket i counts latencies below 2^(i+1) ns
+const size_t STAT_LATENCY_BUCKETS = 32;
+
+typedef struct cab_stats
+{
+    std::atomic<uint64_t> phase_ns[N_STAT_PHASES];
+    std::atomic<uint64_t> phase_calls[N_STAT_PHASES];
+    std::atomic<uint64_t> counters[N_STAT_COUNTERS];
+    std::atomic<uint64_t> allocation_latency[STAT_LATENCY_BUCKETS];
+} cab_stats;
+
+// zero-initialized as a static
+inline cab_stats process_stats;
+
+inline void statCount(stat_counter counter, uint64_t amount)
+{
+    process_stats.counters[counter].fetch_add(amount, std::memory_order_relaxed);
+}
+
+inline void statPhase(stat_phase phase, uint64_t ns)
+{
+    process_stats.phase_ns[phase].fetch_add(ns, std::memory_order_relaxed);
+    process_stats.phase_calls[phase].fetch_add(1, std::memory_order_relaxed);
+    if (phase == PHASE_ALLOCATE)
+    {
+        size_t bucket = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+        process_stats.allocation_latency[std::min(bucket, STAT_LATENCY_BUCKETS - 1)].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// adds the time from construction to destruction to a phase
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(stat_phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+
+    ~PhaseTimer()
+    {
+        statPhase(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+    stat_phase phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifndef CAB_NO_STATS
+#define CAB_STAT_JOIN(a, b) a##b
+#define CAB_STAT_NAME(line) CAB_STAT_JOIN(phase_timer_, line)
+#define CAB_STAT_PHASE(phase) PhaseTimer CAB_STAT_NAME(__LINE__)(phase)
+#define CAB_STAT_COUNT(counter, amount) statCount(counter, amount)
+#else
+// sizeof keeps the operands "used" without evaluating them
+#define CAB_STAT_PHASE(phase) ((void)sizeof(phase))
+#define CAB_STAT_COUNT(counter, amount) ((void)sizeof(amount))
+#endif
+
+// the report of --stats, one JSON object; phase times are summed over threads
+inline void printStats(const std::string &tool)
+{
+#ifndef CAB_NO_STATS
+    static const char *phase_names[] = {"load_metadata", "allocate", "copy_data", "flush_metadata", "format", "compress", "dedup"};
+    static const char *counter_names[] = {"bytes_read", "bytes_written", "syscalls", "bits_scanned", "cache_hits", "cache_misses"};
+
+    std::cout << "{\"tool\":\"" << tool << "\",\"phases\":{";
+    for (size_t p = 0; p < N_STAT_PHASES; p++)
+        std::cout << (p == 0 ? "" : ",") << "\"" << phase_names[p] << "\":{\"ms\":" << process_stats.phase_ns[p] / 1e6
+                  << ",\"calls\":" << process_stats.phase_calls[p] << "}";
+    std::cout << "},\"counters\":{";
+    for (size_t c = 0; c < N_STAT_COUNTERS; c++)
+        std::cout << (c == 0 ? "" : ",") << "\"" << counter_names[c] << "\":" << process_stats.counters[c];
+    // [upper bound in ns, count] for every bucket in use
+    std::cout << "},\"allocation_latency_ns\":[";
+    bool first = true;
+    for (size_t b = 0; b < STAT_LATENCY_BUCKETS; b++)
+    {
+        if (process_stats.allocation_latency[b] == 0)
+            continue;
+        std::cout << (first ? "" : ",") << "[" << (2ull << b) << "," << process_stats.allocation_latency[b] << "]";
+        first = false;
+    }
+    std::cout << "]}" << std::endl;
+#else
+    std::cout << "{\"tool\":\"" << tool << "\",\"stats\":\"disabled\"}" << std::endl;
+#endif
+}
+
+#endif
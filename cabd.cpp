@@ -0,0 +1,83 @@
+#include <csignal>
+
+#include "cabd.hpp"
+
+CabServer *running_server = nullptr;
+
+void stopServer(int)
+{
+    if (running_server != nullptr)
+        running_server->stop();
+}
+
+void printUsage(const char *program)
+{
+    std::cout << "usage: " << program << " [--cache-mb N] [--stats] <socket> [image ...]\n"
+              << "  serves put, get, stat, list and delete on CAB images over a Unix socket;\n"
+              << "  images named here are opened at start, clients may open others\n"
+              << "  --cache-mb N   block cache per image in MiB (default " << (DEFAULT_BLOCK_CACHE_BUDGET >> 20) << ")\n"
+              << "  --stats        print time per phase and I/O counters as JSON on exit\n";
+}
+
+int main(int argc, const char **argv)
+{
+    const char *program = argv[0];
+    size_t cache_budget = DEFAULT_BLOCK_CACHE_BUDGET;
+    bool show_stats = false;
+    int arg = 1;
+    for (; arg < argc; arg++)
+    {
+        std::string option = argv[arg];
+        if (option == "--cache-mb" && arg + 1 < argc)
+        {
+            size_t cache_mb;
+            if (!parseNumber(argv[++arg], cache_mb) || cache_mb > (SIZE_MAX >> 20))
+            {
+                printUsage(program);
+                return 1;
+            }
+            cache_budget = cache_mb << 20;
+        }
+        else if (option == "--stats")
+            show_stats = true;
+        else
+            break;
+    }
+    if (arg >= argc)
+    {
+        printUsage(program);
+        return 1;
+    }
+
+    CabServer server(cache_budget);
+    std::string socket_path = argv[arg++];
+    if (!server.listen(socket_path))
+    {
+        std::cout << "could not listen on " << socket_path << std::endl;
+        return 1;
+    }
+    for (; arg < argc; arg++)
+    {
+        uint32_t id;
+        if (!server.openImage(argv[arg], id))
+        {
+            std::cout << "could not open image " << argv[arg] << std::endl;
+            return 1;
+        }
+        std::cout << "image " << id << ": " << argv[arg] << std::endl;
+    }
+
+    running_server = &server;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    signal(SIGPIPE, SIG_IGN);
+    std::cout << "listening on " << socket_path << std::endl;
+    server.run();
+
+    std::cout << "served " << server.requests << " requests in " << server.commits << " commits" << std::endl;
+    running_server = nullptr;
+    server.close();
+    if (show_stats)
+        printStats("cabd");
+    return 0;
+}
@@ -0,0 +1,647 @@
+#ifndef CABD_HPP
+#define CABD_HPP
+
+// resident side of cabd, kept in a header so cab_bench can run a server in-process. Images
+// stay open with their extent index, root directory index, dentry cache and block cache in
+// memory, and one event loop serves every connection. Requests that arrive together are
+// committed together: their data blocks are written back, then the metadata is committed
+// (through the journal when the image has one), and only then are their responses sent, so
+// an answered put is on disk. When the commit fails, the batch's puts and deletes are answered
+// CAB_IO_ERROR instead and their changes stay pending for the next commit to retry
+
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <poll.h>
+
+#include "cab_import.hpp"
+#include "cab_cache.hpp"
+#include "cab_stat.hpp"
+#include "cab_proto.hpp"
+
+const size_t CABD_RECEIVE_CHUNK = 64 << 10;
+
+typedef struct cabd_connection
+{
+    int fd;
+    std::vector<char> input;  // received, not parsed yet
+    std::vector<char> output; // responses not sent yet
+    size_t output_sent;
+    bool closing;             // peer is gone or broke the protocol: drop once output is out
+} cabd_connection;
+
+// one open image and everything kept in memory for it
+typedef struct served_image
+{
+    std::string image_name;
+    CabImage image;
+    std::unique_ptr<BitMap> bmap;
+    std::unique_ptr<DirIndex> root_index;
+    std::unique_ptr<PathResolver> resolver;
+    std::unique_ptr<BlockCache> cache;
+    std::unique_ptr<DedupIndex> dedup; // reference counts of extents cab_file_writer --dedup shared
+    std::unique_ptr<import_context> context;
+    bool dirty;
+    std::vector<dir_entry> removed; // files deleted or replaced by a put, their blocks are freed after the next commit
+    std::vector<std::pair<cabd_connection *, size_t>> answered; // CAB_OK answers to changes not committed yet: where they are in the output
+} served_image;
+
+class CabServer
+{
+public:
+    CabServer(size_t cache_budget = DEFAULT_BLOCK_CACHE_BUDGET)
+        : cache_budget(cache_budget)
+    {
+    }
+
+    ~CabServer()
+    {
+        close();
+    }
+
+    CabServer(const CabServer &) = delete;
+    CabServer &operator=(const CabServer &) = delete;
+
+    // binds socket_path; a stale socket file is replaced, one a daemon still answers is not
+    bool listen(const std::string &socket_path)
+    {
+        sockaddr_un address;
+        if (!socketAddress(socket_path, address) || pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+            return false;
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool in_use = probe >= 0 && connect(probe, (sockaddr *)&address, sizeof(address)) == 0;
+        if (probe >= 0)
+            ::close(probe);
+        if (in_use)
+            return false;
+        unlink(socket_path.c_str());
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&address, sizeof(address)) < 0 || ::listen(listen_fd, SOMAXCONN) < 0)
+            return false;
+        this->socket_path = socket_path;
+        return true;
+    }
+
+    // id of image_name, opening it on first use; the same file always gets the same id
+    bool openImage(const std::string &image_name, uint32_t &id)
+    {
+        char resolved[PATH_MAX];
+        if (realpath(image_name.c_str(), resolved) == nullptr)
+            return false;
+        for (id = 0; id < images.size(); id++)
+        {
+            if (images[id]->image_name == resolved)
+                return true;
+        }
+
+        std::unique_ptr<served_image> served(new served_image());
+        served->image_name = resolved;
+        CabImage &image = served->image;
+        if (!image.open(resolved, true) || !image.isFormatted())
+            return false;
+        served->bmap.reset(new BitMap(*image.bootRecord(), image.bitmapBytes()));
+        served->bmap->buildExtentIndex();
+        served->root_index.reset(new DirIndex(image.rootDir(), image.bootRecord()->n_root_entries));
+        served->resolver.reset(new PathResolver(image, *served->root_index));
+        served->cache.reset(new BlockCache(image, cache_budget));
+        served->dedup.reset(new DedupIndex());
+        if (!served->dedup->load(image))
+            return false;
+        served->context.reset(new import_context{served->image_name, image, *served->bmap, *served->resolver, false, 0, 0, served->dedup.get(), nullptr,
+                                                    MAX_FILE_EXTENTS});
+        served->dirty = false;
+        images.push_back(std::move(served));
+        id = images.size() - 1;
+        return true;
+    }
+
+    // serves connections until stop()
+    void run()
+    {
+        while (!stopping)
+        {
+            std::vector<pollfd> fds = {{listen_fd, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+            for (auto &connection : connections)
+            {
+                short events = connection->output_sent < connection->output.size() ? POLLOUT : POLLIN;
+                fds.push_back({connection->fd, events, 0});
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            if (fds[1].revents != 0)
+                break;
+
+            // every request that is complete now is served before anything is committed
+            size_t polled = connections.size();
+            for (size_t i = 0; i < polled; i++)
+            {
+                if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+                    receive(*connections[i]);
+            }
+            if (fds[0].revents & POLLIN)
+                acceptConnections();
+
+            commit();
+            for (size_t i = 0; i < connections.size(); i++)
+                sendOutput(*connections[i]);
+            connections.erase(std::remove_if(connections.begin(), connections.end(), [](const std::unique_ptr<cabd_connection> &connection) {
+                                  if (!connection->closing || connection->output_sent < connection->output.size())
+                                      return false;
+                                  ::close(connection->fd);
+                                  return true;
+                              }),
+                              connections.end());
+        }
+    }
+
+    // safe from another thread or a signal handler
+    void stop()
+    {
+        stopping = true;
+        if (wake_pipe[1] >= 0)
+        {
+            char byte = 0;
+            ssize_t ignored = write(wake_pipe[1], &byte, 1);
+            (void)ignored;
+        }
+    }
+
+    void close()
+    {
+        commit();
+        for (auto &connection : connections)
+            ::close(connection->fd);
+        connections.clear();
+        images.clear();
+        if (listen_fd >= 0)
+        {
+            ::close(listen_fd);
+            unlink(socket_path.c_str());
+        }
+        for (int &fd : wake_pipe)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+        listen_fd = -1;
+    }
+
+    size_t requests = 0;
+    size_t commits = 0;
+
+private:
+    size_t cache_budget;
+    std::string socket_path;
+    int listen_fd = -1;
+    int wake_pipe[2] = {-1, -1};
+    std::atomic<bool> stopping{false};
+    std::vector<std::unique_ptr<served_image>> images;
+    std::vector<std::unique_ptr<cabd_connection>> connections;
+
+    void acceptConnections()
+    {
+        for (;;)
+        {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            connections.emplace_back(new cabd_connection{fd, {}, {}, 0, false});
+        }
+    }
+
+    // reads what the socket has and serves every complete request in it, in order
+    void receive(cabd_connection &connection)
+    {
+        for (;;)
+        {
+            size_t used = connection.input.size();
+            connection.input.resize(used + CABD_RECEIVE_CHUNK);
+            ssize_t n = recv(connection.fd, connection.input.data() + used, CABD_RECEIVE_CHUNK, 0);
+            connection.input.resize(used + std::max(n, (ssize_t)0));
+            if (n > 0)
+                continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                connection.closing = true;
+            if (n == 0 || errno != EINTR)
+                break;
+        }
+
+        size_t parsed = 0;
+        while (!connection.input.empty() && connection.input.size() - parsed >= sizeof(request_header))
+        {
+            request_header header;
+            memcpy(&header, connection.input.data() + parsed, sizeof(header));
+            if (header.path_length > CAB_PROTO_MAX_PATH || header.payload_length > CAB_PROTO_MAX_PAYLOAD)
+            {
+                // the rest of the stream cannot be framed any more
+                respond(connection, header.request_id, CAB_TOO_LARGE, nullptr, 0);
+                connection.closing = true;
+                parsed = connection.input.size();
+                break;
+            }
+            size_t length = sizeof(header) + header.path_length + header.payload_length;
+            if (connection.input.size() - parsed < length)
+                break;
+            const char *path = connection.input.data() + parsed + sizeof(header);
+            serve(connection, header, std::string(path, header.path_length), path + header.path_length);
+            parsed += length;
+            requests++;
+        }
+        connection.input.erase(connection.input.begin(), connection.input.begin() + parsed);
+    }
+
+    void sendOutput(cabd_connection &connection)
+    {
+        while (connection.output_sent < connection.output.size())
+        {
+            ssize_t n = send(connection.fd, connection.output.data() + connection.output_sent,
+                             connection.output.size() - connection.output_sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (n <= 0)
+            {
+                connection.closing = true;
+                connection.output_sent = connection.output.size();
+                return;
+            }
+            connection.output_sent += n;
+        }
+        connection.output.clear();
+        connection.output_sent = 0;
+    }
+
+    // file data first, then the bitmap and directories that point at it
+    void commit()
+    {
+        for (auto &served : images)
+        {
+            while (served->dirty)
+            {
+                // the commit syncs the data the cache wrote back before the metadata goes out
+                bool ok = served->cache->flush(false);
+                ok = commitMetadata(served->image, *served->bmap, *served->resolver, served->dedup.get()) && ok;
+                commits++;
+                if (!ok)
+                {
+                    // still dirty, so the next loop tries again
+                    std::cout << "could not commit " << served->image_name << std::endl;
+                    failAnswered(*served);
+                    break;
+                }
+                served->dirty = false;
+                served->answered.clear();
+                // no committed entry points at the removed files any more
+                releaseRemoved(*served);
+            }
+        }
+    }
+
+    void respond(cabd_connection &connection, uint32_t request_id, int32_t status, const void *payload, size_t length)
+    {
+        response_header header = {request_id, status, length};
+        connection.output.insert(connection.output.end(), (const char *)&header, (const char *)&header + sizeof(header));
+        connection.output.insert(connection.output.end(), (const char *)payload, (const char *)payload + length);
+    }
+
+    // the answer to a put or delete; a CAB_OK is only true once the commit is, so where it sits
+    // in the output is kept until then. A batch whose metadata nears the journal's size is
+    // committed early, so each commit still fits one transaction
+    void respondChange(served_image &served, cabd_connection &connection, uint32_t request_id, int32_t status)
+    {
+        if (status == CAB_OK)
+            served.answered.push_back({&connection, connection.output.size()});
+        respond(connection, request_id, status, nullptr, 0);
+        if (metadataDue(*served.context))
+            commit();
+    }
+
+    // the commit of this batch failed: its changes were not made durable, so none is answered
+    // CAB_OK. The answers are still in the output, nothing is sent before the commit
+    void failAnswered(served_image &served)
+    {
+        int32_t status = CAB_IO_ERROR;
+        for (const auto &answer : served.answered)
+            memcpy(answer.first->output.data() + answer.second + offsetof(response_header, status), &status, sizeof(status));
+        served.answered.clear();
+    }
+
+    void serve(cabd_connection &connection, const request_header &header, const std::string &path, const char *payload)
+    {
+        if (header.op == CAB_OP_OPEN)
+        {
+            uint32_t id;
+            if (!openImage(path, id))
+                respond(connection, header.request_id, CAB_NOT_FOUND, nullptr, 0);
+            else
+                respond(connection, header.request_id, CAB_OK, &id, sizeof(id));
+            return;
+        }
+        if (header.image >= images.size())
+        {
+            respond(connection, header.request_id, CAB_INVALID, nullptr, 0);
+            return;
+        }
+        served_image &served = *images[header.image];
+
+        switch (header.op)
+        {
+        case CAB_OP_PUT:
+            respondChange(served, connection, header.request_id, putFile(served, path, payload, header.payload_length));
+            break;
+        case CAB_OP_GET:
+            getFile(served, connection, header.request_id, path);
+            break;
+        case CAB_OP_STAT:
+            statPath(served, connection, header.request_id, path);
+            break;
+        case CAB_OP_LIST:
+            listDir(served, connection, header.request_id, path);
+            break;
+        case CAB_OP_DELETE:
+            respondChange(served, connection, header.request_id, removePath(served, path));
+            break;
+        default:
+            respond(connection, header.request_id, CAB_INVALID, nullptr, 0);
+        }
+    }
+
+    size_t blocksOf(served_image &served, const dir_entry &entry)
+    {
+        size_t block_size = served.image.blockSize();
+        return (entry.file_size_in_bytes + block_size - 1) / block_size;
+    }
+
+    // the entry goes now, its blocks only once the commit dropping it is in: until then the
+    // directory on disk still points at them, and nothing else may be written there
+    void removeFile(served_image &served, dir_location parent, size_t slot)
+    {
+        served.removed.push_back(served.resolver->entries(parent)[slot]);
+        served.resolver->removeEntry(parent, slot);
+        served.dirty = true;
+    }
+
+    // frees what the removed files held, for the next commit to record
+    void releaseRemoved(served_image &served)
+    {
+        for (const dir_entry &entry : served.removed)
+            releaseFile(served, entry);
+        served.dirty = !served.removed.empty();
+        served.removed.clear();
+    }
+
+    // the file's blocks go back to the bitmap and out of the cache, unless other entries
+    // still share them
+    void releaseFile(served_image &served, const dir_entry &entry)
+    {
+        if (entry.file_type == PACKED_TYPE)
+        {
+            removePacked(served, entry);
+            return;
+        }
+        if (entry.file_type == EXTENTS_TYPE)
+        {
+            removeSplit(served, entry);
+            return;
+        }
+        if (!served.dedup->release(entry.first_block))
+            return;
+        served.cache->invalidate(entry.first_block, blocksOf(served, entry));
+        served.bmap->writeBits(entry.first_block, blocksOf(served, entry), 0);
+    }
+
+    // a packed file leaves the count of its pack block, which is freed with its last file; a
+    // header that does not check out keeps the block rather than risk its other files
+    void removePacked(served_image &served, const dir_entry &entry)
+    {
+        size_t block_size = served.image.blockSize();
+        size_t block = entry.first_block / block_size;
+        pack_header header;
+        if (!served.cache->read(block * block_size, &header, sizeof(header)) || header.magic != PACK_MAGIC || header.live_files == 0)
+            return;
+        if (--header.live_files > 0)
+        {
+            served.cache->write(block * block_size, &header, sizeof(header));
+            return;
+        }
+        served.cache->invalidate(block, 1);
+        served.bmap->writeBits(block, 1, 0);
+        if (served.image.bootRecord()->pack_block == block)
+            served.image.bootRecord()->pack_block = 0;
+    }
+
+    // the map of a split file, read through the cache like its data
+    bool readSplitMap(served_image &served, const dir_entry &entry, std::vector<file_extent> &extents, std::vector<size_t> *map_blocks = nullptr)
+    {
+        return readExtentMap(entry, served.image.blockSize(), served.image.bootRecord()->total_blocks,
+                             [&](off_t offset, char *buffer, size_t length) { return served.cache->read(offset, buffer, length); },
+                             extents, map_blocks);
+    }
+
+    // every piece of a split file and its map go back to the bitmap; a map that does not
+    // check out keeps them all rather than free blocks it cannot account for
+    void removeSplit(served_image &served, const dir_entry &entry)
+    {
+        std::vector<file_extent> extents;
+        std::vector<size_t> map_blocks;
+        if (!readSplitMap(served, entry, extents, &map_blocks))
+            return;
+        for (const file_extent &extent : extents)
+            served.cache->invalidate(extent.first_block, extent.blocks);
+        for (size_t block : map_blocks)
+            served.cache->invalidate(block, 1);
+        releaseExtents(*served.bmap, extents, map_blocks);
+    }
+
+    int32_t putFile(served_image &served, const std::string &path, const char *data, size_t length)
+    {
+        std::vector<std::string> components = PathResolver::splitPath(path);
+        if (components.empty() || length == 0)
+            return CAB_INVALID;
+        for (const std::string &component : components)
+        {
+            if (component.size() > MAX_NAME_LENGTH)
+                return CAB_INVALID;
+        }
+
+        // a put replaces the file, but the old one stays until the new one is written, so a
+        // put that fails leaves it as it was
+        dir_location parent;
+        size_t slot;
+        bool replacing = served.resolver->locate(path, parent, slot);
+        if (replacing && !isFileEntry(served.resolver->entries(parent)[slot]))
+            return CAB_INVALID;
+
+        import_job job;
+        batch_stats stats = {0, 0, 0, 0, 0, 0};
+        if (!reserveEntry(*served.context, path, length, job, stats))
+            return CAB_NO_SPACE;
+        served.dirty = true;
+        size_t block_size = served.image.blockSize();
+        bool written;
+        if (job.split)
+        {
+            written = forEachExtentRange(job.extents, block_size, length, [&](off_t image_offset, off_t file_offset, size_t range_length) {
+                return served.cache->write(image_offset, data + file_offset, range_length);
+            });
+            std::vector<std::vector<char>> map = encodeExtentMap(job.extents, job.map_blocks, block_size);
+            for (size_t m = 0; written && m < map.size(); m++)
+                written = served.cache->write(job.map_blocks[m] * block_size, map[m].data(), block_size);
+        }
+        else
+            written = served.cache->write(job.first_block * block_size, data, length);
+        finishImport(*served.context, job, written, stats);
+        if (!written)
+            return CAB_IO_ERROR;
+        // both entries change in the same commit
+        if (replacing)
+            removeFile(served, parent, slot);
+        return CAB_OK;
+    }
+
+    void getFile(served_image &served, cabd_connection &connection, uint32_t request_id, const std::string &path)
+    {
+        dir_entry *entry = served.resolver->lookup(path);
+        if (entry == nullptr || !isFileEntry(*entry))
+        {
+            respond(connection, request_id, entry == nullptr ? CAB_NOT_FOUND : CAB_INVALID, nullptr, 0);
+            return;
+        }
+        if (entry->file_size_in_bytes > CAB_PROTO_MAX_PAYLOAD)
+        {
+            respond(connection, request_id, CAB_TOO_LARGE, nullptr, 0);
+            return;
+        }
+        if (entry->file_type == COMPRESSED_TYPE)
+        {
+            getCompressedFile(served, connection, request_id, *entry);
+            return;
+        }
+        std::vector<file_extent> extents;
+        if (entry->file_type == EXTENTS_TYPE && !readSplitMap(served, *entry, extents))
+        {
+            respond(connection, request_id, CAB_IO_ERROR, nullptr, 0);
+            return;
+        }
+
+        // read straight into the output buffer, behind the header (a packed file is one read
+        // of its bytes, wherever they sit in their pack block)
+        size_t start = connection.output.size();
+        respond(connection, request_id, CAB_OK, nullptr, 0);
+        size_t length = entry->file_size_in_bytes;
+        ((response_header *)(connection.output.data() + start))->payload_length = length;
+        connection.output.resize(start + sizeof(response_header) + length);
+        char *payload = connection.output.data() + start + sizeof(response_header);
+        bool read;
+        if (entry->file_type == EXTENTS_TYPE)
+            read = forEachExtentRange(extents, served.image.blockSize(), length, [&](off_t image_offset, off_t file_offset, size_t range_length) {
+                return served.cache->read(image_offset, payload + file_offset, range_length);
+            });
+        else
+            read = served.cache->read(entryDataOffset(*entry, served.image.blockSize()), payload, length);
+        if (!read)
+        {
+            connection.output.resize(start);
+            respond(connection, request_id, CAB_IO_ERROR, nullptr, 0);
+        }
+    }
+
+    // written by cab_file_writer --compress: the stored bytes go through the cache, the chunks
+    // are inflated straight into the output buffer
+    void getCompressedFile(served_image &served, cabd_connection &connection, uint32_t request_id, const dir_entry &entry)
+    {
+        std::vector<char> stored(entry.file_size_in_bytes);
+        compressed_header header;
+        std::vector<uint64_t> offsets;
+        if (!served.cache->read(entry.first_block * served.image.blockSize(), stored.data(), stored.size()) ||
+            !readCompressedTable(stored.data(), stored.size(), header, offsets))
+        {
+            respond(connection, request_id, CAB_IO_ERROR, nullptr, 0);
+            return;
+        }
+        if (header.file_size > CAB_PROTO_MAX_PAYLOAD)
+        {
+            respond(connection, request_id, CAB_TOO_LARGE, nullptr, 0);
+            return;
+        }
+
+        size_t start = connection.output.size();
+        respond(connection, request_id, CAB_OK, nullptr, 0);
+        ((response_header *)(connection.output.data() + start))->payload_length = header.file_size;
+        connection.output.resize(start + sizeof(response_header) + header.file_size);
+        char *payload = connection.output.data() + start + sizeof(response_header);
+        for (size_t i = 0; i < header.n_chunks; i++)
+        {
+            if (!inflateChunk(stored.data(), header, offsets, i, payload + i * header.chunk_size))
+            {
+                connection.output.resize(start);
+                respond(connection, request_id, CAB_IO_ERROR, nullptr, 0);
+                return;
+            }
+        }
+    }
+
+    void statPath(served_image &served, cabd_connection &connection, uint32_t request_id, const std::string &path)
+    {
+        if (PathResolver::splitPath(path).empty())
+        {
+            fragmentation_report report = makeFragmentationReport(served.bmap->getExtentIndex());
+            wire_image_stat image_stat = {served.image.blockSize(), served.image.bootRecord()->total_blocks,
+                                          report.free_blocks, report.largest_extent};
+            respond(connection, request_id, CAB_OK, &image_stat, sizeof(image_stat));
+            return;
+        }
+        dir_entry *entry = served.resolver->lookup(path);
+        if (entry == nullptr)
+        {
+            respond(connection, request_id, CAB_NOT_FOUND, nullptr, 0);
+            return;
+        }
+        wire_entry_stat entry_stat = {entry->first_block, entry->file_size_in_bytes, entry->file_type};
+        respond(connection, request_id, CAB_OK, &entry_stat, sizeof(entry_stat));
+    }
+
+    void listDir(served_image &served, cabd_connection &connection, uint32_t request_id, const std::string &path)
+    {
+        std::vector<std::string> components = PathResolver::splitPath(path);
+        dir_location location;
+        if (!served.resolver->resolveDir(components, components.size(), location))
+        {
+            respond(connection, request_id, CAB_NOT_FOUND, nullptr, 0);
+            return;
+        }
+        std::vector<char> listing;
+        dir_entry *table = served.resolver->entries(location);
+        for (size_t i = 0; i < location.n_entries; i++)
+        {
+            const dir_entry &entry = table[i];
+            if (isFreeEntry(entry) || strcmp(entry.file_name, "ponto") == 0 || strcmp(entry.file_name, "pontoponto") == 0)
+                continue;
+            wire_list_entry item = {entry.file_size_in_bytes, entry.file_type, (uint8_t)entryNameLength(entry)};
+            listing.insert(listing.end(), (const char *)&item, (const char *)&item + sizeof(item));
+            listing.insert(listing.end(), entry.file_name, entry.file_name + item.name_length);
+        }
+        respond(connection, request_id, CAB_OK, listing.data(), listing.size());
+    }
+
+    int32_t removePath(served_image &served, const std::string &path)
+    {
+        dir_location parent;
+        size_t slot;
+        if (!served.resolver->locate(path, parent, slot))
+            return CAB_NOT_FOUND;
+        if (!isFileEntry(served.resolver->entries(parent)[slot]))
+            return CAB_INVALID;
+        removeFile(served, parent, slot);
+        return CAB_OK;
+    }
+};
+
+#endif